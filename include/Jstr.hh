@@ -23,10 +23,16 @@
 #ifndef _JSTR_HH_
 #define _JSTR_HH_
 
+#include <chrono>
 #include <memory>
+#include <stdexcept>
 #include <vector>
 #include <map>
+#include <list>
+#include <unordered_map>
+#include <mutex>
 #include <string>
+#include <string_view>
 #include <nlohmann/json.hpp>
 
 namespace Jstr {
@@ -42,7 +48,9 @@ namespace Xpath {
 class Node {
 public:
     Node();
-    Node(const Node* parent, const std::string& name, const nlohmann::json& json);
+    Node(const Node* parent,
+         const std::shared_ptr<const std::string>& name,
+         const nlohmann::json& json);
     Node(const Node& node) = delete;
     virtual ~Node();
     Node& operator=(const Node& node) = delete;
@@ -53,16 +61,45 @@ public:
     double getNumber() const;
     bool getBoolean() const;
     std::string getString() const;
+    /**
+     * Returns the string value without copying if the node is a JSON string. The view
+     * is valid as long as the JSON data of the document. For other nodes the string
+     * value is built in buffer and a view of buffer is returned.
+     * @param buffer storage used when the string value must be built.
+     * @return a view of the string value.
+     */
+    std::string_view getStringView(std::string& buffer) const;
     const std::string& getLocalName() const;
+    /**
+     * Returns the local name as shared storage. Nodes created from the same JSON
+     * array share the name.
+     * @return the local name.
+     */
+    const std::shared_ptr<const std::string>& getSharedLocalName() const;
     virtual bool isArrayChild() const;
     void getAncestors(std::vector<const Node*>& result) const;
     virtual void getChild(const std::string& name, std::vector<const Node*>& result) const = 0;
+    /**
+     * Returns the number of children with a name, the children are not created.
+     * @param name the name of the children.
+     * @return the number of children.
+     */
+    virtual size_t getChildCount(const std::string& name) const = 0;
+    /**
+     * Returns one of the children with a name, the other children are not
+     * created, e.g. an element of a large array is found without creating
+     * nodes for the rest of the array.
+     * @param name the name of the child.
+     * @param i the index of the child among the children with the name.
+     * @return the child or nullptr if i is not less than getChildCount(name).
+     */
+    virtual const Node* getChildAt(const std::string& name, size_t i) const = 0;
     virtual void getChildren(std::vector<const Node*>& result) const = 0;
     virtual void getSubTreeNodes(std::vector<const Node*>& result) const = 0;
     virtual void search(const std::string& name, std::vector<const Node*>& result) const = 0;
 protected:
     const Node* _parent;
-    std::string _name;
+    std::shared_ptr<const std::string> _name;
     const nlohmann::json* _json;
 };
 
@@ -117,9 +154,20 @@ public:
     Value(bool b);
     Value(const char* s);
     Value(const std::string& s);
+    Value(std::string&& s);
+    /**
+     * Creates a string value that shares the immutable string s, nothing is copied.
+     * @param s the string.
+     */
+    Value(const std::shared_ptr<const std::string>& s);
     //Value(const std::string& name, const nlohmann::json& json);
     Value(const Node* node);
     Value(const std::vector<const Node*>& ns);
+    /**
+     * Creates a node set value taking the nodes of ns, ns is left empty.
+     * @param ns the nodes.
+     */
+    Value(std::vector<const Node*>&& ns);
     Value& operator=(const Value& xd);
     Value& operator=(Value&& xd);
     ~Value();
@@ -138,6 +186,14 @@ public:
      * @return a string representation of the value.
      */
     std::string getString() const;
+    /**
+     * Same as getString but avoids copying strings that are held by this value or
+     * by a node in the document.
+     * @param buffer storage used when the string must be built.
+     * @return a view of the string representation, valid as long as this value,
+     *         the document and buffer.
+     */
+    std::string_view getStringView(std::string& buffer) const;
     /**
      * Returns the XML "string value" of the data.
      * Primitive values are interpreted as XML text nodes.
@@ -160,7 +216,6 @@ public:
     bool operator>(const Value& v) const;
     bool operator>=(const Value& v) const;
 private:
-    void checkOrderingRelationArgs(const Value& v) const;
     void assign(const Value& v);
     void exchange(Value&& v);
     void clear();
@@ -168,9 +223,10 @@ private:
     union Data {
         double n;
         bool b;
-        std::string* s;
         std::vector<const Node*>* ns;
     } _d;
+    // Strings are immutable and shared between copies of a value.
+    std::shared_ptr<const std::string> _s;
 };
 
 inline
@@ -186,9 +242,10 @@ operator==(const Value& v, double d) {
 
 inline
 bool
-operator==(const Value& v, const std::string& s) {
+operator==(const Value& v, std::string_view s) {
+    std::string buffer;
     for (const Node* l : v.getNodeSet()) {
-        if (l->getString() == s) {
+        if (l->getStringView(buffer) == s) {
             return true;
         }
     }
@@ -220,10 +277,10 @@ operator!=(const Value& v, double d) {
 
 inline
 bool
-operator!=(const Value& v, const std::string& s) {
-    const std::vector<const Node*>& ns = v.getNodeSet();
+operator!=(const Value& v, std::string_view s) {
+    std::string buffer;
     for (const Node* l : v.getNodeSet()) {
-        if (l->getString() != s) {
+        if (l->getStringView(buffer) != s) {
             return true;
         }
     }
@@ -265,6 +322,26 @@ operator<<(std::ostream& os, const Value& v) {
     return os;
 }
 
+/**
+ * Thrown when an evaluation exceeds a limit of the budget of its environment,
+ * see Env::setBudget.
+ */
+class BudgetExceeded : public std::runtime_error {
+public:
+    /**
+     * The limit that is exceeded.
+     */
+    enum Limit {
+        Nodes,          // the nodes selected by all steps
+        NodeSetSize,    // the size of one node set
+        Time            // the time of the evaluation
+    };
+    BudgetExceeded(Limit limit, const std::string& what);
+    Limit getLimit() const;
+private:
+    Limit _limit;
+};
+
 // Env
 class Env {
 public:
@@ -277,28 +354,289 @@ public:
     const Value& getCurrent() const;
     Value getRoot() const;
     void addVariable(const std::string& name, const Value& v);
+    /**
+     * Same as addVariable but the value is moved instead of copied.
+     */
+    void addVariable(const std::string& name, Value&& v);
     const Value& getVariable(const std::string& name) const;
+    /**
+     * Turns on parallel evaluation. Descendant steps, "*" steps and
+     * predicates split large node sets into chunks that are evaluated by
+     * several threads, the results keep their order. Predicates are only
+     * split if they do not look outside the subtrees of the nodes they
+     * filter, e.g. "[contains(c, 'x')]" but not "[../c]" or "[. = $v]".
+     * @param threads the number of threads, the calling thread included, 1
+     * turns parallel evaluation off.
+     * @param threshold the smallest number of nodes that is split.
+     */
+    void setParallelism(size_t threads, size_t threshold = 4096);
+    size_t getThreads() const;
+    size_t getParallelThreshold() const;
+    /**
+     * Bounds the work of each evaluation in the environment, an evaluation
+     * that exceeds a limit throws BudgetExceeded. The limits are checked
+     * whenever a step or predicate produces a node set, 0 is no limit.
+     * @param maxNodes the most nodes all node sets of an evaluation may hold
+     * in total, i.e. the nodes its steps and predicates visit. Each node set
+     * counts one more than its size.
+     * @param maxNodeSetSize the most nodes one node set may hold.
+     * @param timeout the longest time an evaluation may take.
+     */
+    void setBudget(size_t maxNodes,
+                   size_t maxNodeSetSize = 0,
+                   std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+    size_t getMaxNodes() const;
+    size_t getMaxNodeSetSize() const;
+    std::chrono::milliseconds getTimeout() const;
 private:
     std::map<std::string, Value> _vals;
     Value _context;
+    size_t _threads;
+    size_t _threshold;
+    size_t _maxNodes;
+    size_t _maxNodeSetSize;
+    std::chrono::milliseconds _timeout;
 };
 
 class Expr;
+class Program;
+class Bindings;
 
 class Expression {
 public:
-    Expression(const std::string& s);
+    /**
+     * How an expression is evaluated.
+     */
+    enum Backend {
+        Tree,       // walks the expression tree
+        Bytecode    // runs the tree compiled for a register machine
+    };
+    /**
+     * Parses an expression.
+     * @param s the expression.
+     * @param backend how the expression is evaluated.
+     */
+    Expression(const std::string& s, Backend backend = Tree);
     Expression(const Expression& expr) = delete;
     Expression& operator=(const Expression& expr) = delete;
     ~Expression();
     Value eval(const Env& env) const;
+    /**
+     * Evaluates the expression with values bound to its variables, variables
+     * that are not bound are looked up in env.
+     * @param env the environment.
+     * @param bindings the values, created for this expression.
+     * @return the result.
+     */
+    Value eval(const Env& env, const Bindings& bindings) const;
+    /**
+     * Returns the names of the variables the expression references, the index
+     * of a name is the slot of the variable.
+     * @return the names.
+     */
+    const std::vector<std::string>& getVariables() const;
+    /**
+     * Returns the slot of a variable.
+     * @param name the name of the variable, without "$".
+     * @return the slot.
+     * @throws std::runtime_error if the expression does not reference the variable.
+     */
+    size_t getSlot(const std::string& name) const;
+    /**
+     * Writes the parsed and optimized expression to a compact binary blob.
+     * The blob starts with a format version, it is only read by libraries
+     * with the same version of the format.
+     * @return the blob.
+     */
+    std::string serialize() const;
+    /**
+     * Creates an expression from a blob written by serialize, without
+     * parsing or optimizing it again.
+     * @param blob the blob.
+     * @param backend how the expression is evaluated.
+     * @return the expression.
+     * @throws std::runtime_error if the blob has another format version or
+     * is not valid.
+     */
+    static std::unique_ptr<Expression> deserialize(std::string_view blob, Backend backend = Tree);
 private:
+    friend class Coroutine;
+    Expression(Expr* expr, Backend backend);
+    Value run(const Env& env, const Bindings* bindings) const;
     const Expr* _expr;
+    const Program* _program;
+    std::vector<std::string> _variables;
 };
-    
+
+/**
+ * Values of the variables of an expression, stored by slot. The values can be
+ * bound again between evaluations, the environment is not rebuilt and no name
+ * is looked up.
+ */
+class Bindings {
+public:
+    /**
+     * Creates bindings with no value bound.
+     * @param expression the expression the slots belong to.
+     */
+    Bindings(const Expression& expression);
+    Bindings(const Bindings&) = delete;
+    Bindings& operator=(const Bindings&) = delete;
+    /**
+     * Binds a value by reference, it must live as long as it is bound.
+     * @param slot the slot of the variable.
+     * @param v the value, nullptr unbinds the variable.
+     */
+    void bind(size_t slot, const Value* v);
+    /**
+     * Binds a value that is moved into the bindings.
+     * @param slot the slot of the variable.
+     * @param v the value.
+     */
+    void bind(size_t slot, Value&& v);
+    /**
+     * Returns the value bound to a slot.
+     * @param slot the slot.
+     * @return the value or nullptr if no value is bound.
+     */
+    const Value* get(size_t slot) const;
+    /**
+     * Unbinds all variables.
+     */
+    void clear();
+private:
+    void checkSlot(size_t slot) const;
+    std::vector<const Value*> _values;
+    std::vector<Value> _owned;
+};
+
+class Coroutine;
+
+/**
+ * An evaluation of an expression that runs in slices on the calling thread,
+ * so that one thread can interleave many evaluations. Each call of resume
+ * runs the evaluation until it has done about slice units of work, one unit
+ * per node it visits, or until it is done. The evaluation is not parallel,
+ * the expression, the environment and the bindings must outlive it.
+ */
+class Evaluation {
+public:
+    /**
+     * Creates an evaluation that starts on the first call of resume.
+     * @param expression the expression.
+     * @param env the environment, its budget applies to the whole evaluation.
+     * @param slice the work done by each call of resume, at least 1.
+     */
+    Evaluation(const Expression& expression, const Env& env, size_t slice = 4096);
+    /**
+     * Same as above but with values bound to the variables.
+     */
+    Evaluation(const Expression& expression, const Env& env, const Bindings& bindings, size_t slice = 4096);
+    Evaluation(const Evaluation&) = delete;
+    Evaluation& operator=(const Evaluation&) = delete;
+    /**
+     * Cancels the evaluation if it is not done.
+     */
+    ~Evaluation();
+    /**
+     * Runs the next slice of the evaluation.
+     * @return true if the evaluation is done.
+     */
+    bool resume();
+    bool isDone() const;
+    /**
+     * Stops the evaluation, the stack of the evaluation is unwound before
+     * cancel returns. Does nothing if the evaluation is done.
+     */
+    void cancel();
+    bool isCancelled() const;
+    /**
+     * Returns the result of the evaluation.
+     * @return the result.
+     * @throws std::runtime_error if the evaluation is not done or is
+     * cancelled, or the exception that ended the evaluation.
+     */
+    const Value& getResult() const;
+private:
+    std::unique_ptr<Coroutine> _coroutine;
+};
+
+/**
+ * Bounded cache of parsed expressions keyed by their text, the least recently
+ * used expression is dropped when the cache is full. The cache is thread safe,
+ * the expressions it returns may be evaluated by several threads at once.
+ */
+class ExpressionCache {
+public:
+    /**
+     * @param capacity the maximum number of expressions, 0 turns caching off.
+     */
+    ExpressionCache(size_t capacity = 1024);
+    ExpressionCache(const ExpressionCache&) = delete;
+    ExpressionCache& operator=(const ExpressionCache&) = delete;
+    /**
+     * Returns the parsed expression, it is parsed if it is not in the cache.
+     * @param xpath the expression.
+     * @return the expression, valid as long as the caller holds it.
+     */
+    std::shared_ptr<const Expression> get(const std::string& xpath);
+    /**
+     * Sets the maximum number of expressions, the least recently used are
+     * dropped if there are more.
+     * @param capacity the maximum number of expressions, 0 turns caching off.
+     */
+    void setCapacity(size_t capacity);
+    size_t getCapacity() const;
+    size_t getSize() const;
+    size_t getHits() const;
+    size_t getMisses() const;
+    /**
+     * Drops all expressions and resets the counters.
+     */
+    void clear();
+    /**
+     * Returns the cache used by eval(xpath, document).
+     * @return the cache.
+     */
+    static ExpressionCache& getDefault();
+private:
+    using Entry = std::pair<std::string, std::shared_ptr<const Expression>>;
+    void evict();
+    mutable std::mutex _mutex;
+    // Most recently used first.
+    std::list<Entry> _entries;
+    std::unordered_map<std::string_view, std::list<Entry>::iterator> _index;
+    size_t _capacity;
+    size_t _hits;
+    size_t _misses;
+};
+
+/**
+ * Evaluates an expression with the root of a document as context. The parsed
+ * expression is kept in ExpressionCache::getDefault().
+ * @param xpath the expression.
+ * @param document the document.
+ * @return the result.
+ */
 Value
 eval(const std::string& xpath, const Document& document);
 
+/**
+ * Prints expression trees before and after they are optimized, intended for
+ * debugging. Turning printing on clears ExpressionCache::getDefault().
+ * @param os the stream to print to, nullptr turns printing off.
+ */
+void
+setOptimizerTrace(std::ostream* os);
+
+/**
+ * Turns the optimizer on or off, intended for checking that optimized
+ * expressions give the same results. Clears ExpressionCache::getDefault().
+ * @param on false leaves expressions as parsed.
+ */
+void
+setOptimizerEnabled(bool on);
+
 }
 
 namespace Schematron {
@@ -306,6 +644,19 @@ namespace Schematron {
 bool
 eval(const nlohmann::json& schematron, const nlohmann::json& data, std::ostream& out);
 
+/**
+ * Gets a string property of a schematron item.
+ * @param json the item.
+ * @param name the name of the property.
+ * @param messagePrefix the start of the error message.
+ * @return the string.
+ * @throws std::runtime_error if the property is missing or not a string.
+ */
+std::string
+getPropertyString(const nlohmann::json& json,
+                  const std::string& name,
+                  const std::string& messagePrefix);
+
 }
 }
 
@@ -0,0 +1,724 @@
+// MIT license
+//
+// Copyright 2023 Per Nilsson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the “Software”), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+#ifndef _STATIC_XPATH_HH_
+#define _STATIC_XPATH_HH_
+
+#include <algorithm>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <Jstr.hh>
+
+/**
+ * Expressions known when the program is compiled, parsed by the C++ compiler
+ * into a chain of templates instead of an expression tree. The result is the
+ * same as for Jstr::Xpath::Expression.
+ *
+ * Example:
+ *   auto e = JSTR_XPATH("/a/b[c > 1][last()]");
+ *   Value v = e.eval(env);
+ *
+ * Supported expressions:
+ *   Expr       := Operand | Operand Relation Literal
+ *   Operand    := Path | count(Path)
+ *   Path       := / | /Steps | //Steps | Steps
+ *   Steps      := Step | Steps/Step | Steps//Step
+ *   Step       := (name | * | . | ..) Predicate*
+ *   Predicate  := [number] | [last()] | [Expr]
+ *   Relation   := = | != | < | <= | > | >=
+ *   Literal    := number | 'string' | "string", strings only with = and !=
+ * Anything else fails to compile, use Jstr::Xpath::Expression for those.
+ */
+#define JSTR_XPATH(s)                                                   \
+    ([] {                                                               \
+        struct Source {                                                 \
+            static constexpr std::string_view value() { return s; }     \
+        };                                                              \
+        return ::Jstr::Xpath::Static::Expression<Source>();             \
+    }())
+
+namespace Jstr {
+namespace Xpath {
+namespace Static {
+
+using NodeSet = std::vector<const Node*>;
+
+namespace Parse {
+
+// Evaluated by the compiler, a throw makes the expression fail to compile.
+constexpr size_t
+error(const char* msg) {
+    return msg == nullptr ? 0 : throw std::logic_error(msg);
+}
+
+constexpr char
+at(std::string_view s, size_t i) {
+    return i < s.size() ? s[i] : '\0';
+}
+
+constexpr size_t
+skipSpace(std::string_view s, size_t i) {
+    while (at(s, i) == ' ' || at(s, i) == '\t' || at(s, i) == '\n') {
+        i++;
+    }
+    return i;
+}
+
+constexpr bool
+startsWith(std::string_view s, size_t i, std::string_view prefix) {
+    return s.substr(std::min(i, s.size()), prefix.size()) == prefix;
+}
+
+constexpr bool
+isDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+// Names start with a letter or "_", "-1" is a negative number.
+constexpr bool
+isNameStart(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+constexpr bool
+isNameChar(char c) {
+    return isNameStart(c) || isDigit(c) || c == '-';
+}
+
+constexpr size_t
+nameEnd(std::string_view s, size_t i) {
+    while (isNameChar(at(s, i))) {
+        i++;
+    }
+    return i;
+}
+
+constexpr size_t
+numberEnd(std::string_view s, size_t i) {
+    while (isDigit(at(s, i))) {
+        i++;
+    }
+    if (at(s, i) == '.') {
+        i++;
+        while (isDigit(at(s, i))) {
+            i++;
+        }
+    }
+    return i;
+}
+
+// The digits as an integer divided by a power of ten, exact for up to 15
+// digits like the runtime conversion.
+constexpr double
+toNumber(std::string_view s, size_t b, size_t e) {
+    double mantissa = 0;
+    double scale = 1;
+    bool fraction(false);
+    size_t digits = 0;
+    for (size_t i = b; i < e; i++) {
+        if (s[i] == '.') {
+            fraction = true;
+        } else {
+            mantissa = mantissa * 10 + (s[i] - '0');
+            digits++;
+            if (fraction) {
+                scale *= 10;
+            }
+        }
+    }
+    return digits > 15 ? error("number literal with too many digits") : mantissa / scale;
+}
+
+constexpr size_t
+stringEnd(std::string_view s, size_t i) {
+    char quote = s[i];
+    size_t end = s.find(quote, i + 1);
+    return end == std::string_view::npos ? error("unterminated string literal") : end + 1;
+}
+
+enum class StepKind {
+    Self,
+    Parent,
+    All,
+    Child,
+    DescendantAll,
+    DescendantSearch
+};
+
+constexpr StepKind
+stepKind(std::string_view s, size_t i, bool descendant) {
+    if (startsWith(s, i, "..")) {
+        return descendant ? (error("\"//..\" is not supported"), StepKind::Parent) : StepKind::Parent;
+    } else if (at(s, i) == '.') {
+        return descendant ? (error("\"//.\" is not supported"), StepKind::Self) : StepKind::Self;
+    } else if (at(s, i) == '*') {
+        return descendant ? StepKind::DescendantAll : StepKind::All;
+    } else if (isNameStart(at(s, i))) {
+        return descendant ? StepKind::DescendantSearch : StepKind::Child;
+    }
+    return error("expected a step"), StepKind::Self;
+}
+
+constexpr size_t
+stepEnd(std::string_view s, size_t i) {
+    if (startsWith(s, i, "..")) {
+        return i + 2;
+    } else if (at(s, i) == '.' || at(s, i) == '*') {
+        return i + 1;
+    }
+    return nameEnd(s, i);
+}
+
+constexpr bool
+isStepStart(std::string_view s, size_t i) {
+    char c = at(s, i);
+    return c == '.' || c == '*' || isNameStart(c);
+}
+
+enum class Relation {
+    None,
+    Eq,
+    Ne,
+    Lt,
+    Le,
+    Gt,
+    Ge
+};
+
+constexpr Relation
+relation(std::string_view s, size_t i) {
+    if (startsWith(s, i, "!=")) {
+        return Relation::Ne;
+    } else if (startsWith(s, i, "<=")) {
+        return Relation::Le;
+    } else if (startsWith(s, i, ">=")) {
+        return Relation::Ge;
+    } else if (at(s, i) == '=') {
+        return Relation::Eq;
+    } else if (at(s, i) == '<') {
+        return Relation::Lt;
+    } else if (at(s, i) == '>') {
+        return Relation::Gt;
+    }
+    return Relation::None;
+}
+
+constexpr size_t
+relationEnd(Relation r, size_t i) {
+    return r == Relation::Ne || r == Relation::Le || r == Relation::Ge ? i + 2 : i + 1;
+}
+
+constexpr size_t
+expect(std::string_view s, size_t i, char c, const char* msg) {
+    return at(s, i) == c ? i + 1 : error(msg);
+}
+
+enum class PredicateKind {
+    Position,
+    Last,
+    Expr
+};
+
+// The grammar. The templates below take their positions from these functions
+// when the program is compiled, isSupported runs them on strings at run time.
+
+constexpr size_t
+exprEnd(std::string_view s, size_t i);
+
+// Predicate := [number] | [last()] | [Expr], i is at the '['.
+constexpr size_t
+predicateStart(std::string_view s, size_t i) {
+    return skipSpace(s, i + 1);
+}
+
+constexpr PredicateKind
+predicateKind(std::string_view s, size_t i) {
+    size_t start = predicateStart(s, i);
+    if (isDigit(at(s, start)) && at(s, skipSpace(s, numberEnd(s, start))) == ']') {
+        return PredicateKind::Position;
+    } else if (startsWith(s, start, "last()") && at(s, skipSpace(s, start + 6)) == ']') {
+        return PredicateKind::Last;
+    }
+    return PredicateKind::Expr;
+}
+
+constexpr size_t
+predicateEnd(std::string_view s, size_t i) {
+    size_t start = predicateStart(s, i);
+    size_t end = 0;
+    switch (predicateKind(s, i)) {
+    case PredicateKind::Position:
+        end = numberEnd(s, start);
+        toNumber(s, start, end);
+        break;
+    case PredicateKind::Last:
+        end = start + 6;
+        break;
+    default:
+        end = exprEnd(s, start);
+        break;
+    }
+    return expect(s, skipSpace(s, end), ']', "expected ]");
+}
+
+constexpr size_t
+predicatesEnd(std::string_view s, size_t i) {
+    while (at(s, i) == '[') {
+        i = predicateEnd(s, i);
+    }
+    return i;
+}
+
+// Step := (name | * | . | ..) Predicate*
+constexpr size_t
+stepWithPredicatesEnd(std::string_view s, size_t i, bool descendant) {
+    stepKind(s, i, descendant);
+    return predicatesEnd(s, stepEnd(s, i));
+}
+
+constexpr bool
+isDescendantSeparator(std::string_view s, size_t i) {
+    return at(s, i) == '/' && at(s, i + 1) == '/';
+}
+
+// The start of the step after the separator at i.
+constexpr size_t
+nextStep(std::string_view s, size_t i) {
+    return i + (isDescendantSeparator(s, i) ? 2 : 1);
+}
+
+// Steps := Step | Steps/Step | Steps//Step
+constexpr size_t
+stepsEnd(std::string_view s, size_t i, bool descendant) {
+    size_t end = stepWithPredicatesEnd(s, i, descendant);
+    while (at(s, end) == '/') {
+        end = stepWithPredicatesEnd(s, nextStep(s, end), isDescendantSeparator(s, end));
+    }
+    return end;
+}
+
+// Path := / | /Steps | //Steps | Steps
+constexpr bool
+isAbsolute(std::string_view s, size_t i) {
+    return at(s, i) == '/';
+}
+
+constexpr size_t
+firstStep(std::string_view s, size_t i) {
+    return isDescendantSeparator(s, i) ? i + 2 : isAbsolute(s, i) ? i + 1 : i;
+}
+
+constexpr bool
+hasSteps(std::string_view s, size_t i) {
+    return !isAbsolute(s, i) || isDescendantSeparator(s, i) || isStepStart(s, firstStep(s, i));
+}
+
+constexpr size_t
+pathEnd(std::string_view s, size_t i) {
+    return hasSteps(s, i) ? stepsEnd(s, firstStep(s, i), isDescendantSeparator(s, i)) : firstStep(s, i);
+}
+
+// Operand := Path | count(Path)
+constexpr bool
+isCount(std::string_view s, size_t i) {
+    return startsWith(s, i, "count(");
+}
+
+constexpr size_t
+countArgument(std::string_view s, size_t i) {
+    return skipSpace(s, i + 6);
+}
+
+constexpr size_t
+countEnd(std::string_view s, size_t i) {
+    return expect(s, skipSpace(s, pathEnd(s, countArgument(s, i))), ')', "expected )");
+}
+
+constexpr size_t
+relationStart(std::string_view s, size_t i) {
+    return skipSpace(s, isCount(s, i) ? countEnd(s, i) : pathEnd(s, i));
+}
+
+// Expr := Operand | Operand Relation Literal, the literal starts after the
+// relation that starts at r.
+constexpr size_t
+literalStart(std::string_view s, size_t r) {
+    Relation rel = relation(s, r);
+    return rel == Relation::None ? r : skipSpace(s, relationEnd(rel, r));
+}
+
+constexpr bool
+isString(std::string_view s, size_t i) {
+    return at(s, i) == '\'' || at(s, i) == '"';
+}
+
+constexpr size_t
+exprEnd(std::string_view s, size_t i) {
+    size_t r = relationStart(s, i);
+    Relation rel = relation(s, r);
+    if (rel == Relation::None) {
+        return r;
+    }
+    size_t start = literalStart(s, r);
+    if (isString(s, start)) {
+        if (isCount(s, i) || (rel != Relation::Eq && rel != Relation::Ne)) {
+            error("strings can only be compared with a path and = or !=");
+        }
+        return stringEnd(s, start);
+    } else if (isDigit(at(s, start))) {
+        size_t end = numberEnd(s, start);
+        toNumber(s, start, end);
+        return end;
+    }
+    return error("expected a literal");
+}
+
+// The end of a whole expression, trailing space included.
+constexpr size_t
+expressionEnd(std::string_view s) {
+    return skipSpace(s, exprEnd(s, skipSpace(s, 0)));
+}
+
+}
+
+template <class S, size_t B, size_t E>
+struct Name {
+    // Node lookups take the name as a string, created once.
+    static const std::string& get() {
+        static const std::string name(S::value().substr(B, E - B));
+        return name;
+    }
+};
+
+template <size_t I>
+struct EndOfSteps {
+    static constexpr size_t end = I;
+    static void eval(const Env&, NodeSet&) {}
+};
+
+template <class S, size_t I, bool Descendant>
+struct Step;
+
+template <class S, size_t I, bool Descendant>
+struct StepChain {
+    using Head = Step<S, I, Descendant>;
+    static constexpr std::string_view s = S::value();
+    static constexpr bool more = Parse::at(s, Head::end) == '/';
+    using Tail = std::conditional_t<more,
+                                    StepChain<S,
+                                              Parse::nextStep(s, Head::end),
+                                              Parse::isDescendantSeparator(s, Head::end)>,
+                                    EndOfSteps<Head::end>>;
+    static constexpr size_t end = Parse::stepsEnd(s, I, Descendant);
+    /**
+     * Replaces nodes with the nodes selected by the steps.
+     * @param env the environment.
+     * @param nodes the context of the first step and the result.
+     */
+    static void eval(const Env& env, NodeSet& nodes) {
+        NodeSet selected;
+        Head::eval(env, nodes, selected);
+        nodes.swap(selected);
+        Tail::eval(env, nodes);
+    }
+};
+
+/**
+ * A path, the result is a node set.
+ */
+template <class S, size_t I>
+struct Path {
+    static constexpr std::string_view s = S::value();
+    static constexpr bool absolute = Parse::isAbsolute(s, I);
+    static constexpr size_t first = Parse::firstStep(s, I);
+    using Steps = std::conditional_t<Parse::hasSteps(s, I),
+                                     StepChain<S, first, Parse::isDescendantSeparator(s, I)>,
+                                     EndOfSteps<first>>;
+    static constexpr size_t end = Parse::pathEnd(s, I);
+    static void eval(const Env& env, const Node* context, NodeSet& result) {
+        result.clear();
+        result.emplace_back(absolute ? context->getRoot() : context);
+        Steps::eval(env, result);
+    }
+};
+
+/**
+ * count(Path)
+ */
+template <class S, size_t I>
+struct Count {
+    static constexpr std::string_view s = S::value();
+    using Arg = Path<S, Parse::countArgument(s, I)>;
+    static constexpr size_t end = Parse::countEnd(s, I);
+    static double eval(const Env& env, const Node* context) {
+        NodeSet nodes;
+        Arg::eval(env, context, nodes);
+        return nodes.size();
+    }
+};
+
+template <Parse::Relation R>
+bool
+compareNumbers(double l, double r) {
+    switch (R) {
+    case Parse::Relation::Eq: return l == r;
+    case Parse::Relation::Ne: return l != r;
+    case Parse::Relation::Lt: return l < r;
+    case Parse::Relation::Le: return l <= r;
+    case Parse::Relation::Gt: return l > r;
+    case Parse::Relation::Ge: return l >= r;
+    default: return false;
+    }
+}
+
+/**
+ * An operand optionally compared with a literal.
+ */
+template <class S, size_t I>
+struct Expr {
+    static constexpr std::string_view s = S::value();
+    static constexpr bool isCount = Parse::isCount(s, I);
+    using Operand = std::conditional_t<isCount, Count<S, I>, Path<S, I>>;
+    static constexpr size_t relationStart = Parse::relationStart(s, I);
+    static constexpr Parse::Relation relation = Parse::relation(s, relationStart);
+    static constexpr bool hasRelation = relation != Parse::Relation::None;
+    static constexpr size_t literalStart = Parse::literalStart(s, relationStart);
+    static constexpr bool isString = hasRelation && Parse::isString(s, literalStart);
+    static constexpr size_t end = Parse::exprEnd(s, I);
+    static constexpr std::string_view string =
+        isString ? s.substr(literalStart + 1, end - literalStart - 2) : std::string_view();
+    static constexpr double number =
+        hasRelation && !isString ? Parse::toNumber(s, literalStart, end) : 0;
+    /**
+     * The result type, e.g. the result of a predicate is a position if it is
+     * a number.
+     */
+    static constexpr bool isNumber = isCount && !hasRelation;
+    static constexpr bool isNodeSet = !isCount && !hasRelation;
+    static Value eval(const Env& env, const Node* context) {
+        if constexpr (isNumber) {
+            return Value(Operand::eval(env, context));
+        } else if constexpr (isNodeSet) {
+            NodeSet nodes;
+            Operand::eval(env, context, nodes);
+            return Value(std::move(nodes));
+        } else {
+            return Value(test(env, context));
+        }
+    }
+    static double getNumber(const Env& env, const Node* context) {
+        return Operand::eval(env, context);
+    }
+    static bool test(const Env& env, const Node* context) {
+        if constexpr (isCount) {
+            double n = Operand::eval(env, context);
+            return hasRelation ? compareNumbers<relation>(n, number) : n != 0;
+        } else {
+            NodeSet nodes;
+            Operand::eval(env, context, nodes);
+            if constexpr (!hasRelation) {
+                return !nodes.empty();
+            } else if constexpr (isString) {
+                std::string buffer;
+                for (const Node* n : nodes) {
+                    if ((n->getStringView(buffer) == string) == (relation == Parse::Relation::Eq)) {
+                        return true;
+                    }
+                }
+                return false;
+            } else if constexpr (relation == Parse::Relation::Eq ||
+                                 relation == Parse::Relation::Ne) {
+                for (const Node* n : nodes) {
+                    if (compareNumbers<relation>(n->getNumber(), number)) {
+                        return true;
+                    }
+                }
+                return false;
+            } else {
+                // Numbers are compared inline, other nodes are converted like
+                // Value does, which also rejects objects and arrays.
+                bool result(false);
+                for (const Node* n : nodes) {
+                    const nlohmann::json& j = n->getJson();
+                    if (j.is_number()) {
+                        result |= compareNumbers<relation>(j.get<double>(), number);
+                    } else {
+                        Value l(n);
+                        Value r(number);
+                        switch (relation) {
+                        case Parse::Relation::Lt: result |= l < r; break;
+                        case Parse::Relation::Le: result |= l <= r; break;
+                        case Parse::Relation::Gt: result |= l > r; break;
+                        default: result |= l >= r; break;
+                        }
+                    }
+                }
+                return result;
+            }
+        }
+    }
+};
+
+template <class S, size_t I>
+struct Predicate {
+    static constexpr std::string_view s = S::value();
+    static constexpr size_t start = Parse::predicateStart(s, I);
+    static constexpr Parse::PredicateKind kind = Parse::predicateKind(s, I);
+    // Only expressions have a body of their own.
+    using Body = std::conditional_t<kind == Parse::PredicateKind::Expr, Expr<S, start>, void>;
+    static constexpr size_t end = Parse::predicateEnd(s, I);
+    static void filter(const Env& env, NodeSet& nodes) {
+        if constexpr (kind == Parse::PredicateKind::Position) {
+            constexpr double position = Parse::toNumber(s, start, Parse::numberEnd(s, start));
+            if (position >= 1 && position <= nodes.size() &&
+                position == static_cast<size_t>(position)) {
+                const Node* n = nodes[static_cast<size_t>(position) - 1];
+                nodes.assign(1, n);
+            } else {
+                nodes.clear();
+            }
+        } else if constexpr (kind == Parse::PredicateKind::Last) {
+            if (!nodes.empty()) {
+                const Node* n = nodes.back();
+                nodes.assign(1, n);
+            }
+        } else if constexpr (Body::isNumber) {
+            NodeSet kept;
+            for (size_t i = 0, size = nodes.size(); i < size; i++) {
+                if (i + 1 == Body::getNumber(env, nodes[i])) {
+                    kept.emplace_back(nodes[i]);
+                }
+            }
+            nodes.swap(kept);
+        } else {
+            nodes.erase(std::remove_if(nodes.begin(),
+                                       nodes.end(),
+                                       [&env](const Node* n) { return !Body::test(env, n); }),
+                        nodes.end());
+        }
+    }
+};
+
+template <class S, size_t I, bool More = Parse::at(S::value(), I) == '['>
+struct Predicates {
+    using Head = Predicate<S, I>;
+    using Tail = Predicates<S, Head::end>;
+    static constexpr size_t end = Parse::predicatesEnd(S::value(), I);
+    static void filter(const Env& env, NodeSet& nodes) {
+        Head::filter(env, nodes);
+        Tail::filter(env, nodes);
+    }
+};
+
+template <class S, size_t I>
+struct Predicates<S, I, false> {
+    static constexpr size_t end = I;
+    static void filter(const Env&, NodeSet&) {}
+};
+
+/**
+ * A step and its predicates, the predicates filter the node set selected from
+ * all context nodes.
+ */
+template <class S, size_t I, bool Descendant>
+struct Step {
+    static constexpr std::string_view s = S::value();
+    static constexpr Parse::StepKind kind = Parse::stepKind(s, I, Descendant);
+    static constexpr size_t testEnd = Parse::stepEnd(s, I);
+    using Preds = Predicates<S, testEnd>;
+    using NameTest = Name<S, I, testEnd>;
+    static constexpr size_t end = Parse::stepWithPredicatesEnd(s, I, Descendant);
+    static void eval(const Env& env, const NodeSet& context, NodeSet& result) {
+        for (const Node* n : context) {
+            if constexpr (kind == Parse::StepKind::Self) {
+                result.emplace_back(n);
+            } else if constexpr (kind == Parse::StepKind::Parent) {
+                const Node* parent = n->getParent();
+                if (parent != nullptr &&
+                    std::find(result.begin(), result.end(), parent) == result.end()) {
+                    result.emplace_back(parent);
+                }
+            } else if constexpr (kind == Parse::StepKind::All) {
+                n->getChildren(result);
+            } else if constexpr (kind == Parse::StepKind::Child) {
+                n->getChild(NameTest::get(), result);
+            } else if constexpr (kind == Parse::StepKind::DescendantAll) {
+                n->getSubTreeNodes(result);
+            } else {
+                n->search(NameTest::get(), result);
+            }
+        }
+        Preds::filter(env, result);
+    }
+};
+
+/**
+ * An expression parsed when the program is compiled, create it with
+ * JSTR_XPATH.
+ */
+template <class S>
+class Expression {
+public:
+    using Root = Expr<S, Parse::skipSpace(S::value(), 0)>;
+    static_assert(Parse::expressionEnd(S::value()) == S::value().size(),
+                  "unexpected characters after the expression");
+    /**
+     * Evaluates the expression like Jstr::Xpath::Expression::eval.
+     * @param env the environment.
+     * @return the result.
+     */
+    Value eval(const Env& env) const {
+        const Value& context = env.getCurrent();
+        if (context.getType() != Value::NodeSet || context.getNodeSet().empty()) {
+            // Only node contexts are compiled, e.g. "." of a number is parsed.
+            static const ::Jstr::Xpath::Expression parsed{std::string(S::value())};
+            return parsed.eval(env);
+        }
+        return Root::eval(env, context.getNode(0));
+    }
+};
+
+/**
+ * Checks if an expression can be used with JSTR_XPATH.
+ * @param xpath the expression.
+ * @return true if the expression is supported.
+ */
+inline bool
+isSupported(std::string_view xpath) {
+    try {
+        return Parse::expressionEnd(xpath) == xpath.size();
+    } catch (const std::logic_error&) {
+        return false;
+    }
+}
+
+}
+}
+}
+
+#endif
@@ -28,7 +28,7 @@ namespace Jstr {
 namespace Xpath {
 
 ArrayNode::ArrayNode(const Node* parent,
-                     const std::string& name,
+                     const std::shared_ptr<const std::string>& name,
                      const nlohmann::json& json,
                      int64_t i) : ObjectNode(parent, name, json), _i(i) {
 }
@@ -51,16 +51,11 @@ ArrayNode::isArrayChild() const {
 
 void
 ArrayNode::instantiateChildren() const {
-    if (_children == nullptr) {
+    // Only objects in arrays have children.
+    if (getJson().is_object()) {
+        ObjectNode::instantiateChildren();
+    } else if (_children == nullptr) {
         _children = new std::vector<const Node*>();
-        const nlohmann::json& j = getJson();
-        if (j.is_object()) {
-            for (const auto& item : j.items()) {
-                for (const auto& item : j.items()) {
-                    addChildNode(item.key(), item.value());
-                }
-            }
-        }
     }
 }
 
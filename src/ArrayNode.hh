@@ -31,7 +31,10 @@ namespace Xpath {
 class ArrayNode : public ObjectNode {
 public:
     ArrayNode() = delete;
-    ArrayNode(const Node* parent, const std::string& name, const nlohmann::json& json, int64_t i);
+    ArrayNode(const Node* parent,
+              const std::shared_ptr<const std::string>& name,
+              const nlohmann::json& json,
+              int64_t i);
     ArrayNode(const ArrayNode& node) = delete;
     ArrayNode& operator=(const ArrayNode& node) = delete;
     bool isValue() const override;
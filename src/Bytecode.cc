@@ -0,0 +1,600 @@
+// MIT license
+//
+// Copyright 2023 Per Nilsson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the “Software”), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#include <cstring>
+#include <stdexcept>
+#include <typeinfo>
+
+#include "Expr.hh"
+#include "Functions.hh"
+#include "NodeSetPool.hh"
+#include "Simd.hh"
+#include "Bytecode.hh"
+
+namespace Jstr {
+namespace Xpath {
+
+namespace {
+
+bool
+isStep(const Expr* e) {
+    return
+        dynamic_cast<const Step*>(e) != nullptr ||
+        dynamic_cast<const AllStep*>(e) != nullptr ||
+        dynamic_cast<const ChildPath*>(e) != nullptr ||
+        dynamic_cast<const ParentStep*>(e) != nullptr ||
+        dynamic_cast<const SelfStep*>(e) != nullptr ||
+        dynamic_cast<const DescendantAll*>(e) != nullptr ||
+        dynamic_cast<const FollowingSiblingAll*>(e) != nullptr;
+}
+
+// Steps that select into the slots of the machine without values.
+bool
+selectsIntoSlots(const Expr* e) {
+    const std::type_info& type = typeid(*e);
+    return
+        type == typeid(ChildStep) ||
+        type == typeid(AllStep) ||
+        type == typeid(ParentStep) ||
+        type == typeid(SelfStep) ||
+        type == typeid(ChildIndexStep) ||
+        type == typeid(ChildPath) ||
+        type == typeid(DescendantAll) ||
+        type == typeid(DescendantOrSelfAll) ||
+        type == typeid(DescendantSearch) ||
+        type == typeid(DescendantOrSelfSearch);
+}
+
+// Searches of whole sub trees or of the document, count(), boolean() and not()
+// of them are left to the tree that streams the nodes instead of building them.
+bool
+isSearch(const Expr* e) {
+    if (dynamic_cast<const DescendantAll*>(e) != nullptr ||
+        dynamic_cast<const DescendantSearch*>(e) != nullptr ||
+        dynamic_cast<const FollowingStep*>(e) != nullptr ||
+        dynamic_cast<const PrecedingStep*>(e) != nullptr) {
+        return true;
+    }
+    std::vector<const Expr*> children;
+    e->getChildren(children);
+    for (const Expr* child : children) {
+        if (isSearch(child)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::vector<const Expr*>
+getChildren(const Expr* e) {
+    std::vector<const Expr*> children;
+    e->getChildren(children);
+    return children;
+}
+
+size_t
+index(Type type) {
+    return static_cast<size_t>(type);
+}
+
+}
+
+class Compiler {
+public:
+    Compiler(Program& program) : _p(program) {}
+    void compileProgram(const Expr* e) {
+        _p._expr = e;
+        _p._result = compile(e);
+        for (size_t t = 0; t < 4; t++) {
+            _p._frame[t] = _p._registers[t];
+            for (const std::unique_ptr<const Program>& block : _p._blocks) {
+                _p._frame[t] = std::max(_p._frame[t], _p._registers[t] + block->_frame[t]);
+            }
+        }
+    }
+private:
+    Operand compile(const Expr* e) {
+        Operand r = compileExpr(e);
+        return compilePredicates(e, r);
+    }
+    Operand compileExpr(const Expr* e) {
+        const std::type_info& type = typeid(*e);
+        if (type == typeid(Path)) {
+            return compilePath(e);
+        } else if (type == typeid(NumericLiteral)) {
+            _p._numbers.push_back(static_cast<const NumericLiteral*>(e)->getNumber());
+            return emit(Op::Number, Type::Number, 0, 0, _p._numbers.size() - 1);
+        } else if (type == typeid(StringLiteral)) {
+            const std::string& s = static_cast<const StringLiteral*>(e)->getString();
+            _p._strings.push_back(std::make_shared<const std::string>(s));
+            return emit(Op::String, Type::Value, 0, 0, _p._strings.size() - 1);
+        } else if (type == typeid(BooleanLiteral)) {
+            return emit(Op::Bool, Type::Boolean, 0, 0, static_cast<const BooleanLiteral*>(e)->getBoolean());
+        } else if (type == typeid(EmptyNodeSet)) {
+            return emit(Op::Empty, Type::NodeSet);
+        } else if (type == typeid(Root)) {
+            return emit(Op::Root, Type::NodeSet);
+        } else if (type == typeid(VarRef)) {
+            _p._needsContext = true;
+            return emit(Op::Variable, Type::Value, 0, 0, addExpr(e));
+        } else if (type == typeid(And) || type == typeid(Or)) {
+            return compileLogic(e, type == typeid(Or));
+        } else if (dynamic_cast<const BinaryExpr*>(e) != nullptr) {
+            return compileBinary(e, type);
+        } else if (dynamic_cast<const Fun*>(e) != nullptr) {
+            return compileFun(e);
+        } else if (isStep(e)) {
+            return emitStep(e, Program::Context, false);
+        }
+        return emitTree(e);
+    }
+    Operand compilePath(const Expr* e) {
+        Operand r{Type::NodeSet, Program::Context};
+        bool first(true);
+        for (const Expr* step : getChildren(e)) {
+            if (first && !isStep(step)) {
+                r = compile(step);
+            } else {
+                r = compilePredicates(step, emitStep(step, toNodeSet(r), first));
+            }
+            first = false;
+        }
+        // A path without steps is the context itself.
+        return first ? emitTree(e) : r;
+    }
+    Operand compileLogic(const Expr* e, bool isOr) {
+        std::vector<const Expr*> operands = getChildren(e);
+        Operand r = newRegister(Type::Boolean);
+        emitTo(Op::Move, r.index, toBoolean(compile(operands[0])));
+        size_t jump = _p._code.size();
+        emitTo(isOr ? Op::JumpIfTrue : Op::JumpIfFalse, 0, r.index);
+        emitTo(Op::Move, r.index, toBoolean(compile(operands[1])));
+        _p._code[jump].imm = _p._code.size();
+        return r;
+    }
+    Operand compileBinary(const Expr* e, const std::type_info& type) {
+        std::vector<const Expr*> operands = getChildren(e);
+        if (operands.size() == 1) {
+            return emit(Op::Neg, Type::Number, toNumber(compile(operands[0])));
+        }
+        Comparison comparison;
+        if (type == typeid(Eq)) {
+            comparison = Comparison::Eq;
+        } else if (type == typeid(Ne)) {
+            comparison = Comparison::Ne;
+        } else if (type == typeid(Lt)) {
+            comparison = Comparison::Lt;
+        } else if (type == typeid(Le)) {
+            comparison = Comparison::Le;
+        } else if (type == typeid(Gt)) {
+            comparison = Comparison::Gt;
+        } else if (type == typeid(Ge)) {
+            comparison = Comparison::Ge;
+        } else {
+            return compileArithmetic(e, type, operands);
+        }
+        Operand l = compile(operands[0]);
+        Operand r = compile(operands[1]);
+        if (l.type == Type::Number && r.type == Type::Number) {
+            return emit(Op::CompareNumber, Type::Boolean, l.index, r.index,
+                        static_cast<uint32_t>(comparison));
+        }
+        // Node sets, strings and booleans compare with the rules of values.
+        uint16_t a = toValue(l);
+        uint16_t b = toValue(r);
+        return emit(Op::Compare, Type::Boolean, a, b, static_cast<uint32_t>(comparison));
+    }
+    Operand compileArithmetic(const Expr* e,
+                              const std::type_info& type,
+                              const std::vector<const Expr*>& operands) {
+        Op op;
+        if (type == typeid(Union)) {
+            op = Op::Union;
+        } else if (type == typeid(Plus)) {
+            op = Op::Add;
+        } else if (type == typeid(Minus)) {
+            op = Op::Sub;
+        } else if (type == typeid(Mul)) {
+            op = Op::Mul;
+        } else if (type == typeid(Div)) {
+            op = Op::Div;
+        } else if (type == typeid(Mod)) {
+            op = Op::Mod;
+        } else {
+            return emitTree(e);
+        }
+        Operand l = compile(operands[0]);
+        Operand r = compile(operands[1]);
+        if (op == Op::Union) {
+            uint16_t a = toValue(l);
+            uint16_t b = toValue(r);
+            return emit(op, Type::Value, a, b);
+        }
+        uint16_t a = toNumber(l);
+        uint16_t b = toNumber(r);
+        return emit(op, Type::Number, a, b);
+    }
+    Operand compileFun(const Expr* e) {
+        const char* name = e->getName();
+        std::vector<const Expr*> args = getChildren(e);
+        if (args.empty()) {
+            if (std::strcmp(name, "position") == 0) {
+                return emit(Op::Position, Type::Number);
+            } else if (std::strcmp(name, "last") == 0) {
+                return emit(Op::Last, Type::Number);
+            } else if (std::strcmp(name, "current") == 0) {
+                return emit(Op::Current, Type::NodeSet);
+            } else if (std::strcmp(name, "true") == 0) {
+                return emit(Op::Bool, Type::Boolean, 0, 0, 1);
+            } else if (std::strcmp(name, "false") == 0) {
+                return emit(Op::Bool, Type::Boolean, 0, 0, 0);
+            }
+        } else if (args.size() == 1 && !isSearch(args[0])) {
+            // Functions evaluate their argument without its predicates.
+            bool isNot = std::strcmp(name, "not") == 0;
+            if (isNot || std::strcmp(name, "boolean") == 0) {
+                uint16_t b = toBoolean(compileExpr(args[0]));
+                return isNot ? emit(Op::Not, Type::Boolean, b) : Operand{Type::Boolean, b};
+            } else if (std::strcmp(name, "count") == 0 && args[0]->selectsNodeSet()) {
+                return emit(Op::Count, Type::Number, toNodeSet(compileExpr(args[0])));
+            }
+        }
+        return emitTree(e);
+    }
+    Operand compilePredicates(const Expr* e, Operand r) {
+        const std::list<const Expr*>* preds = e->getPredicates();
+        if (preds == nullptr || preds->empty()) {
+            return r;
+        }
+        size_t first = _p._blocks.size();
+        for (const Expr* pred : *preds) {
+            Program* block = new Program();
+            _p._blocks.emplace_back(block);
+            block->_position = dynamic_cast<const PositionPredicate*>(pred);
+            block->_compare = dynamic_cast<const ComparePredicate*>(pred);
+            if (block->_position != nullptr || block->_compare != nullptr) {
+                // Filtered by the predicate itself, the tree only evaluates
+                // it for contexts that are not node sets.
+                block->_expr = pred;
+                continue;
+            }
+            const Predicate* p = dynamic_cast<const Predicate*>(pred);
+            Compiler(*block).compileProgram(p != nullptr ? p->getExpr() : pred);
+        }
+        if (r.type == Type::NodeSet) {
+            return emit(Op::Filter, Type::NodeSet, r.index, preds->size(), first);
+        }
+        return emit(Op::FilterValue, Type::Value, toValue(r), preds->size(), first);
+    }
+    Operand emitStep(const Expr* e, uint16_t from, bool first) {
+        if (!selectsIntoSlots(e)) {
+            if (from == Program::Context) {
+                _p._needsContext = true;
+            }
+        }
+        return emit(Op::Step, Type::NodeSet, from, first, addExpr(e));
+    }
+    Operand emitTree(const Expr* e) {
+        _p._needsContext = true;
+        return emit(Op::Tree, Type::Value, 0, 0, addExpr(e));
+    }
+    uint16_t toNumber(Operand r) {
+        switch (r.type) {
+        case Type::Number: return r.index;
+        case Type::Boolean: return emit(Op::BooleanToNumber, Type::Number, r.index).index;
+        default: return emit(Op::ValueToNumber, Type::Number, toValue(r)).index;
+        }
+    }
+    uint16_t toBoolean(Operand r) {
+        switch (r.type) {
+        case Type::Boolean: return r.index;
+        case Type::Number: return emit(Op::NumberToBoolean, Type::Boolean, r.index).index;
+        case Type::NodeSet: return emit(Op::NotEmpty, Type::Boolean, r.index).index;
+        default: return emit(Op::ValueToBoolean, Type::Boolean, r.index).index;
+        }
+    }
+    uint16_t toNodeSet(Operand r) {
+        if (r.type == Type::NodeSet) {
+            return r.index;
+        }
+        return emit(Op::ValueToNodeSet, Type::NodeSet, toValue(r)).index;
+    }
+    uint16_t toValue(Operand r) {
+        switch (r.type) {
+        case Type::Number: return emit(Op::NumberToValue, Type::Value, r.index).index;
+        case Type::Boolean: return emit(Op::BooleanToValue, Type::Value, r.index).index;
+        case Type::NodeSet: return emit(Op::NodeSetToValue, Type::Value, r.index).index;
+        default: return r.index;
+        }
+    }
+    uint32_t addExpr(const Expr* e) {
+        _p._exprs.push_back(e);
+        return _p._exprs.size() - 1;
+    }
+    Operand newRegister(Type type) {
+        size_t& registers = _p._registers[index(type)];
+        if (registers == Program::Context) {
+            throw std::runtime_error("Compiler::newRegister, expression too large");
+        }
+        return Operand{type, static_cast<uint16_t>(registers++)};
+    }
+    Operand emit(Op op, Type type, uint16_t a = 0, uint16_t b = 0, uint32_t imm = 0) {
+        Operand dst = newRegister(type);
+        emitTo(op, dst.index, a, b, imm);
+        return dst;
+    }
+    void emitTo(Op op, uint16_t dst, uint16_t a = 0, uint16_t b = 0, uint32_t imm = 0) {
+        _p._code.push_back(Instruction{op, dst, a, b, imm});
+    }
+    Program& _p;
+};
+
+class Machine {
+public:
+    Machine(const Env& env) : _env(env) {}
+    Value run(const Program& p, const Value& context, size_t pos) {
+        _numbers.resize(p._frame[index(Type::Number)]);
+        _booleans.resize(p._frame[index(Type::Boolean)]);
+        _nodeSets.resize(p._frame[index(Type::NodeSet)]);
+        _values.resize(p._frame[index(Type::Value)]);
+        const std::vector<const Node*>& nodeSet = context.getNodeSet();
+        Frame frame{};
+        run(p, nodeSet, &context, pos, frame);
+        const Operand& r = p._result;
+        switch (r.type) {
+        case Type::Number: return Value(_numbers[r.index]);
+        case Type::Boolean: return Value(_booleans[r.index] != 0);
+        case Type::NodeSet:
+            return r.index == Program::Context ? context : Value(std::move(_nodeSets[r.index]));
+        default: return _values[r.index];
+        }
+    }
+private:
+    // The first register of each file a program uses.
+    struct Frame {
+        size_t base[4];
+        Frame next(const Program& p) const {
+            Frame f;
+            for (size_t t = 0; t < 4; t++) {
+                f.base[t] = base[t] + p._registers[t];
+            }
+            return f;
+        }
+    };
+    /**
+     * Runs a program.
+     * @param nodeSet the context node set.
+     * @param context the context as a value, only needed if the program
+     * evaluates trees in the context.
+     */
+    void run(const Program& p,
+             const std::vector<const Node*>& nodeSet,
+             const Value* context,
+             size_t pos,
+             const Frame& frame) {
+        // The frame size is reserved up front, register references stay valid.
+        double* n = _numbers.data() + frame.base[index(Type::Number)];
+        uint8_t* b = _booleans.data() + frame.base[index(Type::Boolean)];
+        std::vector<const Node*>* s = _nodeSets.data() + frame.base[index(Type::NodeSet)];
+        Value* v = _values.data() + frame.base[index(Type::Value)];
+        auto in = [&nodeSet, s](uint16_t i) -> const std::vector<const Node*>& {
+            return i == Program::Context ? nodeSet : s[i];
+        };
+        for (size_t pc = 0, size = p._code.size(); pc < size; ) {
+            const Instruction& i = p._code[pc++];
+            switch (i.op) {
+            case Op::Number: n[i.dst] = p._numbers[i.imm]; break;
+            case Op::String: v[i.dst] = Value(p._strings[i.imm]); break;
+            case Op::Bool: b[i.dst] = i.imm != 0; break;
+            case Op::Empty: s[i.dst].clear(); break;
+            case Op::Current: assign(s[i.dst], _env.getCurrent()); break;
+            case Op::Root: assign(s[i.dst], _env.getRoot()); break;
+            case Op::Position: n[i.dst] = pos + 1; break;
+            case Op::Last: n[i.dst] = nodeSet.size(); break;
+            case Op::Variable: v[i.dst] = p._exprs[i.imm]->evalExpr(_env, *context, pos); break;
+            case Op::Tree:
+                v[i.dst] = p._exprs[i.imm]->evalExpr(_env, *context, pos);
+                Budget::visit(v[i.dst]);
+                break;
+            case Op::Step: {
+                const Expr* step = p._exprs[i.imm];
+                std::vector<const Node*>& result = s[i.dst];
+                result.clear();
+                if (i.a == Program::Context && !selectsIntoSlots(step)) {
+                    // The step takes the context value as it is, without a copy.
+                    assign(result, step->evalExpr(_env, *context, pos, i.b != 0));
+                } else {
+                    step->selectExpr(_env, in(i.a), pos, i.b != 0, result);
+                }
+                Budget::visitNodeSet(result.size());
+                break;
+            }
+            case Op::Filter:
+                filter(p, i, in(i.a), s[i.dst], frame.next(p));
+                Budget::visitNodeSet(s[i.dst].size());
+                break;
+            case Op::FilterValue:
+                v[i.dst] = filter(p, i, v[i.a], frame.next(p));
+                Budget::visit(v[i.dst]);
+                break;
+            case Op::Union:
+                v[i.dst] = v[i.a].nodeSetUnion(v[i.b]);
+                Budget::visit(v[i.dst]);
+                break;
+            case Op::Compare: b[i.dst] = compare(v[i.a], v[i.b], static_cast<Comparison>(i.imm)); break;
+            case Op::CompareNumber:
+                b[i.dst] = compare(n[i.a], n[i.b], static_cast<Comparison>(i.imm));
+                break;
+            case Op::Add: n[i.dst] = n[i.a] + n[i.b]; break;
+            case Op::Sub: n[i.dst] = n[i.a] - n[i.b]; break;
+            case Op::Mul: n[i.dst] = n[i.a] * n[i.b]; break;
+            case Op::Div: n[i.dst] = n[i.a] / n[i.b]; break;
+            case Op::Mod: n[i.dst] = static_cast<int64_t>(n[i.a]) % static_cast<int64_t>(n[i.b]); break;
+            case Op::Neg: n[i.dst] = -n[i.a]; break;
+            case Op::Not: b[i.dst] = !b[i.a]; break;
+            case Op::Count: n[i.dst] = in(i.a).size(); break;
+            case Op::NotEmpty: b[i.dst] = !in(i.a).empty(); break;
+            case Op::NumberToBoolean: b[i.dst] = Value(n[i.a]).getBoolean(); break;
+            case Op::BooleanToNumber: n[i.dst] = b[i.a]; break;
+            case Op::ValueToNumber: n[i.dst] = v[i.a].getNumber(); break;
+            case Op::ValueToBoolean: b[i.dst] = v[i.a].getBoolean(); break;
+            case Op::ValueToNodeSet: assign(s[i.dst], v[i.a]); break;
+            case Op::NumberToValue: v[i.dst] = Value(n[i.a]); break;
+            case Op::BooleanToValue: v[i.dst] = Value(b[i.a] != 0); break;
+            case Op::NodeSetToValue:
+                // Each slot is read once, its nodes move into the value.
+                v[i.dst] = i.a == Program::Context ? Value(nodeSet) : Value(std::move(s[i.a]));
+                break;
+            case Op::Move: b[i.dst] = b[i.a]; break;
+            case Op::JumpIfTrue:
+                if (b[i.a]) {
+                    pc = i.imm;
+                }
+                break;
+            case Op::JumpIfFalse:
+                if (!b[i.a]) {
+                    pc = i.imm;
+                }
+                break;
+            default:
+                throw std::runtime_error("Machine::run, unknown instruction");
+            }
+        }
+    }
+    static void assign(std::vector<const Node*>& nodeSet, const Value& v) {
+        const std::vector<const Node*>& nodes = v.getNodeSet();
+        nodeSet.assign(nodes.begin(), nodes.end());
+    }
+    static bool compare(const Value& l, const Value& r, Comparison comparison) {
+        switch (comparison) {
+        case Comparison::Eq: return l == r;
+        case Comparison::Ne: return l != r;
+        case Comparison::Lt: return l < r;
+        case Comparison::Le: return l <= r;
+        case Comparison::Gt: return l > r;
+        default: return l >= r;
+        }
+    }
+    static bool compare(double l, double r, Comparison comparison) {
+        switch (comparison) {
+        case Comparison::Eq: return l == r;
+        case Comparison::Ne: return l != r;
+        case Comparison::Lt: return l < r;
+        case Comparison::Le: return l <= r;
+        case Comparison::Gt: return l > r;
+        default: return l >= r;
+        }
+    }
+    // Runs a predicate for the node at pos, same semantics as Expr::evalFilter.
+    bool test(const Program& block,
+              const std::vector<const Node*>& nodeSet,
+              const Value* context,
+              size_t pos,
+              const Frame& frame) {
+        run(block, nodeSet, context, pos, frame);
+        const Operand& r = block._result;
+        switch (r.type) {
+        case Type::Number: return pos + 1 == _numbers[frame.base[index(Type::Number)] + r.index];
+        case Type::Boolean: return _booleans[frame.base[index(Type::Boolean)] + r.index] != 0;
+        case Type::NodeSet:
+            return r.index == Program::Context ?
+                !nodeSet.empty() :
+                !_nodeSets[frame.base[index(Type::NodeSet)] + r.index].empty();
+        default: {
+            const Value& v = _values[frame.base[index(Type::Value)] + r.index];
+            return v.getType() == Value::Number ? pos + 1 == v.getNumber() : v.getBoolean();
+        }
+        }
+    }
+    void filter(const Program& p,
+                const Instruction& i,
+                const std::vector<const Node*>& nodeSet,
+                std::vector<const Node*>& result,
+                const Frame& frame) {
+        // The context of the first predicate is the node set, the following
+        // predicates take the nodes kept by the previous one.
+        ScratchNodeSet context;
+        context->assign(nodeSet.begin(), nodeSet.end());
+        for (uint32_t n = i.imm; n < i.imm + i.b; n++) {
+            const Program& block = *p._blocks[n];
+            result.clear();
+            size_t index;
+            if (block._position != nullptr) {
+                if (block._position->getIndex(context->size(), index)) {
+                    result.emplace_back((*context)[index]);
+                }
+            } else if (block._compare != nullptr) {
+                block._compare->select(*context, result);
+            } else {
+                // Trees in the predicate take the context as a value, it is
+                // built once for all nodes.
+                std::unique_ptr<Value> value;
+                if (block._needsContext) {
+                    value = std::make_unique<Value>(*context);
+                }
+                for (size_t pos = 0, size = context->size(); pos < size; pos++) {
+                    if (test(block, *context, value.get(), pos, frame)) {
+                        result.emplace_back((*context)[pos]);
+                    }
+                }
+            }
+            context->swap(result);
+        }
+        context->swap(result);
+    }
+    Value filter(const Program& p, const Instruction& i, const Value& val, const Frame& frame) {
+        if (val.getType() == Value::NodeSet) {
+            ScratchNodeSet result;
+            filter(p, i, val.getNodeSet(), *result, frame);
+            return Value(std::move(*result));
+        }
+        bool keep(true);
+        for (uint32_t n = i.imm; n < i.imm + i.b; n++) {
+            keep &= p._blocks[n]->_expr->eval(_env, val, 0).getBoolean();
+        }
+        return keep ? val : Value();
+    }
+    const Env& _env;
+    std::vector<double> _numbers;
+    std::vector<uint8_t> _booleans;
+    std::vector<std::vector<const Node*>> _nodeSets;
+    std::vector<Value> _values;
+};
+
+std::unique_ptr<const Program>
+Program::compile(const Expr* e) {
+    std::unique_ptr<Program> program(new Program());
+    Compiler(*program).compileProgram(e);
+    return program;
+}
+
+Value
+Program::run(const Env& env, const Value& context, size_t pos) const {
+    if (context.getType() != Value::NodeSet) {
+        return _expr->eval(env, context, pos);
+    }
+    Machine machine(env);
+    return machine.run(*this, context, pos);
+}
+
+}
+}
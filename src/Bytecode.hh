@@ -0,0 +1,164 @@
+// MIT license
+//
+// Copyright 2023 Per Nilsson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the “Software”), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+#ifndef _BYTECODE_HH_
+#define _BYTECODE_HH_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <Jstr.hh>
+
+namespace Jstr {
+namespace Xpath {
+
+class Expr;
+class PositionPredicate;
+class ComparePredicate;
+
+/**
+ * The register files of the machine. Numbers and booleans are kept unboxed,
+ * node sets in scratch slots that keep their capacity between the nodes a
+ * predicate runs for. Strings and results of the tree are values.
+ */
+enum class Type : uint8_t {
+    Number,
+    Boolean,
+    NodeSet,
+    Value
+};
+
+// The comments give the register file of each operand: n number, b boolean,
+// s node set slot and v value. A node set operand may be the context.
+enum class Op : uint8_t {
+    Number,       // n[dst] = numbers[imm]
+    String,       // v[dst] = strings[imm]
+    Bool,         // b[dst] = imm != 0
+    Empty,        // s[dst] = empty node set
+    Current,      // s[dst] = current()
+    Root,         // s[dst] = root of the context
+    Position,     // n[dst] = position()
+    Last,         // n[dst] = last()
+    Variable,     // v[dst] = exprs[imm], a variable reference by slot or name
+    Tree,         // v[dst] = exprs[imm] evaluated as a tree, without predicates
+    Step,         // s[dst] = exprs[imm] step from s[a], b != 0 if it is the first step
+    Filter,       // s[dst] = s[a] filtered by the programs blocks[imm, imm + b)
+    FilterValue,  // v[dst] = v[a] filtered by the programs blocks[imm, imm + b)
+    Union,        // v[dst] = v[a] | v[b]
+    Compare,      // b[dst] = v[a] compared with v[b], imm is the Comparison
+    CompareNumber,// b[dst] = n[a] compared with n[b], imm is the Comparison
+    Add,          // n[dst] = n[a] + n[b]
+    Sub,          // n[dst] = n[a] - n[b]
+    Mul,          // n[dst] = n[a] * n[b]
+    Div,          // n[dst] = n[a] div n[b]
+    Mod,          // n[dst] = n[a] mod n[b]
+    Neg,          // n[dst] = -n[a]
+    Not,          // b[dst] = not(b[a])
+    Count,        // n[dst] = count(s[a])
+    NotEmpty,     // b[dst] = boolean(s[a])
+    NumberToBoolean, // b[dst] = boolean(n[a])
+    BooleanToNumber, // n[dst] = number(b[a])
+    ValueToNumber,   // n[dst] = number(v[a])
+    ValueToBoolean,  // b[dst] = boolean(v[a])
+    ValueToNodeSet,  // s[dst] = v[a], empty if it is not a node set
+    NumberToValue,   // v[dst] = n[a]
+    BooleanToValue,  // v[dst] = b[a]
+    NodeSetToValue,  // v[dst] = s[a], the slot is moved
+    Move,         // b[dst] = b[a]
+    JumpIfTrue,   // continue at imm if b[a] is true
+    JumpIfFalse   // continue at imm if b[a] is false
+};
+
+/**
+ * One instruction, operands are register numbers.
+ */
+struct Instruction {
+    Op op;
+    uint16_t dst;
+    uint16_t a;
+    uint16_t b;
+    uint32_t imm;
+};
+
+/**
+ * A register and the file it is in.
+ */
+struct Operand {
+    Type type;
+    uint16_t index;
+};
+
+/**
+ * An expression compiled into linear code for a register machine with typed
+ * registers. Location steps select from one node set slot into another, the
+ * predicates of a filter are compiled into separate programs run once per
+ * node with the node set as context. Expressions without instructions of
+ * their own, e.g. most string functions, are evaluated by the tree they were
+ * compiled from.
+ */
+class Program {
+public:
+    /**
+     * Compiles an expression tree, the tree must outlive the program.
+     * @param e the tree.
+     * @return the program.
+     */
+    static std::unique_ptr<const Program> compile(const Expr* e);
+    /**
+     * Runs the program.
+     * @param env the environment.
+     * @param context the context value.
+     * @param pos the position of the context node in the context.
+     * @return the result.
+     */
+    Value run(const Env& env, const Value& context, size_t pos) const;
+    /**
+     * Register number that refers to the context node set of the program.
+     */
+    static const uint16_t Context = UINT16_MAX;
+private:
+    friend class Compiler;
+    friend class Machine;
+    Program() = default;
+    const Expr* _expr = nullptr;
+    std::vector<Instruction> _code;
+    Operand _result{Type::Value, 0};
+    // Registers of this program, indexed by Type.
+    size_t _registers[4] = {};
+    // Registers needed by this program and the programs it runs.
+    size_t _frame[4] = {};
+    // Set if the tree is evaluated with the context as a value.
+    bool _needsContext = false;
+    std::vector<double> _numbers;
+    std::vector<std::shared_ptr<const std::string>> _strings;
+    std::vector<const Expr*> _exprs;
+    std::vector<std::unique_ptr<const Program>> _blocks;
+    // Set if the program is a predicate that selects by index.
+    const PositionPredicate* _position = nullptr;
+    // Set if the program is a predicate that filters the node set at once.
+    const ComparePredicate* _compare = nullptr;
+};
+
+}
+}
+
+#endif
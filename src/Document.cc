@@ -23,7 +23,7 @@
 #include <stdexcept>
 #include <Jstr.hh>
 
-#include "ObjectNode.hh"
+#include "RootNode.hh"
 
 namespace Jstr {
 namespace Xpath {
@@ -33,7 +33,7 @@ Document::Document(const nlohmann::json& json) {
     // if (!json.is_object()) {
     //     throw std::runtime_error("Document::Document json must be object");
     // }
-    _root.reset(new ObjectNode(nullptr, "", json));
+    _root.reset(new RootNode(json));
 }
     
 const Node*
@@ -30,7 +30,23 @@
 namespace Jstr {
 namespace Xpath {
 
-Env::Env(const Value& context) : _context(context) {
+// BudgetExceeded
+BudgetExceeded::BudgetExceeded(Limit limit, const std::string& what) :
+    std::runtime_error(what), _limit(limit) {}
+
+BudgetExceeded::Limit
+BudgetExceeded::getLimit() const {
+    return _limit;
+}
+
+// Env
+Env::Env(const Value& context) :
+    _context(context),
+    _threads(1),
+    _threshold(4096),
+    _maxNodes(0),
+    _maxNodeSetSize(0),
+    _timeout(0) {
     const std::vector<const Node*>& nodeSet = context.getNodeSet();
     if (context.getType() == Value::NodeSet) {
         if (nodeSet.size() != 1) {
@@ -58,6 +74,15 @@ Env::addVariable(const std::string& name, const Value& val) {
     }
 }
 
+void
+Env::addVariable(const std::string& name, Value&& val) {
+    if (!_vals.emplace(name, std::move(val)).second) {
+        std::stringstream ss;
+        ss << "Env::addVariable " << name << " is allready added.";
+        throw std::runtime_error(ss.str());
+    }
+}
+
 const Value&
 Env::getVariable(const std::string& name) const {
     std::map<std::string, Value>::const_iterator i = _vals.find(name);
@@ -69,5 +94,46 @@ Env::getVariable(const std::string& name) const {
     return i->second;
 }
 
+void
+Env::setParallelism(size_t threads, size_t threshold) {
+    if (threads == 0) {
+        throw std::runtime_error("Env::setParallelism threads must be at least 1.");
+    }
+    _threads = threads;
+    _threshold = threshold;
+}
+
+size_t
+Env::getThreads() const {
+    return _threads;
+}
+
+size_t
+Env::getParallelThreshold() const {
+    return _threshold;
+}
+
+void
+Env::setBudget(size_t maxNodes, size_t maxNodeSetSize, std::chrono::milliseconds timeout) {
+    _maxNodes = maxNodes;
+    _maxNodeSetSize = maxNodeSetSize;
+    _timeout = timeout;
+}
+
+size_t
+Env::getMaxNodes() const {
+    return _maxNodes;
+}
+
+size_t
+Env::getMaxNodeSetSize() const {
+    return _maxNodeSetSize;
+}
+
+std::chrono::milliseconds
+Env::getTimeout() const {
+    return _timeout;
+}
+
 }
 }
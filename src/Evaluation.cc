@@ -0,0 +1,313 @@
+// MIT license
+//
+// Copyright 2023 Per Nilsson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the “Software”), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <cstdint>
+#include <exception>
+#include <stdexcept>
+
+#include <Jstr.hh>
+#include "Expr.hh"
+
+#if defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define JSTR_ASAN 1
+#endif
+#endif
+#if defined(__SANITIZE_ADDRESS__)
+#define JSTR_ASAN 1
+#endif
+#ifdef JSTR_ASAN
+#include <sanitizer/common_interface_defs.h>
+#endif
+
+namespace {
+
+// AddressSanitizer must be told which stack the thread switches to.
+#ifdef JSTR_ASAN
+void
+startSwitch(void** fakeStack, const void* bottom, size_t size) {
+    __sanitizer_start_switch_fiber(fakeStack, bottom, size);
+}
+
+void
+finishSwitch(void* fakeStack, const void** bottom, size_t* size) {
+    __sanitizer_finish_switch_fiber(fakeStack, bottom, size);
+}
+#else
+void
+startSwitch(void**, const void*, size_t) {}
+
+void
+finishSwitch(void*, const void**, size_t*) {}
+#endif
+
+// Evaluations recurse over the expression and the document, the stack is as
+// large as the default stack of the main thread so that documents nested as
+// deep as for eval can be evaluated.
+const size_t StackSize = 8 << 20;
+
+/**
+ * A stack of StackSize bytes mapped below an inaccessible guard page, a
+ * recursion that overflows it faults instead of writing over the heap. The
+ * pages are only backed by memory once they are used.
+ */
+class Stack {
+public:
+    Stack() : _pageSize(sysconf(_SC_PAGESIZE)) {
+        _mapping = mmap(nullptr, _pageSize + StackSize, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+        if (_mapping == MAP_FAILED) {
+            throw std::runtime_error("Evaluation::resume, can not map the stack.");
+        }
+        // The stack grows down towards the guard page.
+        if (mprotect(_mapping, _pageSize, PROT_NONE) != 0) {
+            munmap(_mapping, _pageSize + StackSize);
+            throw std::runtime_error("Evaluation::resume, can not protect the stack.");
+        }
+    }
+    Stack(const Stack&) = delete;
+    Stack& operator=(const Stack&) = delete;
+    ~Stack() {
+        munmap(_mapping, _pageSize + StackSize);
+    }
+    char* get() const {
+        return static_cast<char*>(_mapping) + _pageSize;
+    }
+private:
+    size_t _pageSize;
+    void* _mapping;
+};
+
+// Thrown into a suspended evaluation to cancel it. It is not a std::exception,
+// nothing on the way out catches it.
+struct Cancelled {};
+
+}
+
+namespace Jstr {
+namespace Xpath {
+
+/**
+ * Runs an evaluation on a stack of its own. The budget of the evaluation
+ * switches back to the caller each slice, resume switches to the evaluation
+ * again.
+ */
+class Coroutine {
+public:
+    Coroutine(const Expression& expression, const Env& env, const Bindings* bindings, size_t slice);
+    Coroutine(const Coroutine&) = delete;
+    Coroutine& operator=(const Coroutine&) = delete;
+    bool resume();
+    void cancel();
+    bool isDone() const;
+    bool isCancelled() const;
+    const Value& getResult() const;
+private:
+    static void start(uint32_t high, uint32_t low);
+    void run();
+    void suspend();
+    const Expression& _expression;
+    const Env& _env;
+    const Bindings* _bindings;
+    const size_t _slice;
+    std::unique_ptr<Stack> _stack;
+    ucontext_t _caller;
+    ucontext_t _context;
+    // The fake stack and the stack of the side that switched.
+    void* _fakeStack;
+    const void* _callerBottom;
+    size_t _callerSize;
+    EvalState _state;
+    bool _started;
+    bool _running;
+    bool _done;
+    bool _cancelled;
+    Value _result;
+    std::exception_ptr _exception;
+};
+
+Coroutine::Coroutine(const Expression& expression, const Env& env, const Bindings* bindings, size_t slice) :
+    _expression(expression),
+    _env(env),
+    _bindings(bindings),
+    _slice(slice),
+    _fakeStack(nullptr),
+    _callerBottom(nullptr),
+    _callerSize(0),
+    _state{nullptr, nullptr},
+    _started(false),
+    _running(false),
+    _done(false),
+    _cancelled(false) {
+    if (slice == 0) {
+        throw std::runtime_error("Evaluation::Evaluation, slice must be at least 1.");
+    }
+}
+
+bool
+Coroutine::resume() {
+    if (_done) {
+        return true;
+    }
+    if (_running) {
+        throw std::runtime_error("Evaluation::resume, the evaluation is running.");
+    }
+    if (!_started) {
+        _stack.reset(new Stack());
+        if (getcontext(&_context) != 0) {
+            throw std::runtime_error("Evaluation::resume, can not create the context.");
+        }
+        _context.uc_stack.ss_sp = _stack->get();
+        _context.uc_stack.ss_size = StackSize;
+        _context.uc_link = &_caller;
+        // makecontext passes int arguments, the pointer is split in two.
+        uint64_t self = reinterpret_cast<uintptr_t>(this);
+        makecontext(&_context,
+                    reinterpret_cast<void (*)()>(&Coroutine::start),
+                    2,
+                    static_cast<uint32_t>(self >> 32),
+                    static_cast<uint32_t>(self));
+        _started = true;
+    }
+    _running = true;
+    EvalState caller = EvalState::exchange(_state);
+    startSwitch(&_fakeStack, _stack->get(), StackSize);
+    swapcontext(&_caller, &_context);
+    finishSwitch(_fakeStack, nullptr, nullptr);
+    _state = EvalState::exchange(caller);
+    _running = false;
+    return _done;
+}
+
+void
+Coroutine::cancel() {
+    if (_done) {
+        return;
+    }
+    _cancelled = true;
+    if (_started) {
+        // The next suspend throws Cancelled, the evaluation unwinds.
+        resume();
+    }
+    _done = true;
+}
+
+bool
+Coroutine::isDone() const {
+    return _done;
+}
+
+bool
+Coroutine::isCancelled() const {
+    return _cancelled;
+}
+
+const Value&
+Coroutine::getResult() const {
+    if (!_done) {
+        throw std::runtime_error("Evaluation::getResult, the evaluation is not done.");
+    }
+    if (_cancelled) {
+        throw std::runtime_error("Evaluation::getResult, the evaluation is cancelled.");
+    }
+    if (_exception != nullptr) {
+        std::rethrow_exception(_exception);
+    }
+    return _result;
+}
+
+void
+Coroutine::start(uint32_t high, uint32_t low) {
+    uint64_t self = (static_cast<uint64_t>(high) << 32) | low;
+    Coroutine* coroutine = reinterpret_cast<Coroutine*>(static_cast<uintptr_t>(self));
+    finishSwitch(nullptr, &coroutine->_callerBottom, &coroutine->_callerSize);
+    coroutine->run();
+    // Returns to the caller through uc_link, the stack is not used again.
+    startSwitch(nullptr, coroutine->_callerBottom, coroutine->_callerSize);
+}
+
+void
+Coroutine::run() {
+    // Exceptions can not leave the stack of the evaluation.
+    try {
+        Budget budget(_env, _slice, [this]() { suspend(); });
+        _result = _expression.run(_env, _bindings);
+    } catch (const Cancelled&) {
+    } catch (...) {
+        _exception = std::current_exception();
+    }
+    _done = true;
+}
+
+void
+Coroutine::suspend() {
+    void* fakeStack = nullptr;
+    startSwitch(&fakeStack, _callerBottom, _callerSize);
+    swapcontext(&_context, &_caller);
+    finishSwitch(fakeStack, &_callerBottom, &_callerSize);
+    if (_cancelled) {
+        throw Cancelled();
+    }
+}
+
+// Evaluation
+Evaluation::Evaluation(const Expression& expression, const Env& env, size_t slice) :
+    _coroutine(new Coroutine(expression, env, nullptr, slice)) {}
+
+Evaluation::Evaluation(const Expression& expression, const Env& env, const Bindings& bindings, size_t slice) :
+    _coroutine(new Coroutine(expression, env, &bindings, slice)) {}
+
+Evaluation::~Evaluation() {
+    _coroutine->cancel();
+}
+
+bool
+Evaluation::resume() {
+    return _coroutine->resume();
+}
+
+bool
+Evaluation::isDone() const {
+    return _coroutine->isDone();
+}
+
+void
+Evaluation::cancel() {
+    _coroutine->cancel();
+}
+
+bool
+Evaluation::isCancelled() const {
+    return _coroutine->isCancelled();
+}
+
+const Value&
+Evaluation::getResult() const {
+    return _coroutine->getResult();
+}
+
+}
+}
@@ -20,25 +20,127 @@
 // FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
 // DEALINGS IN THE SOFTWARE.
 
+#include <algorithm>
+#include <cstring>
+#include <functional>
 #include <iostream>
 #include <sstream>
+#include <unordered_map>
+#include <unordered_set>
 #include <Jstr.hh>
 
 #include "Utils.hh"
+#include "Numbers.hh"
 #include "Expr.hh"
+#include "Functions.hh"
+#include "NodeSetPool.hh"
+#include "RootNode.hh"
+#include "ThreadPool.hh"
 
 namespace {
 using namespace Jstr::Xpath;    
-    
-std::vector<const Node*>
-filter(const std::vector<const Node*>& ns, const std::vector<size_t>& keepIndexes) {
-    std::vector<const Node*> result;
-    for (size_t i : keepIndexes) {
-        result.emplace_back(ns[i]);
+
+// The cache of the expression the thread evaluates.
+thread_local EvalCache* currentCache = nullptr;
+
+// The budget of the evaluation the thread takes part in.
+thread_local Budget* currentBudget = nullptr;
+
+bool
+visitNodes(const std::vector<const Node*>& nodeSet, const NodeVisitor& f) {
+    for (const Node* n : nodeSet) {
+        if (!f(n)) {
+            return false;
+        }
     }
-    return result;
+    return true;
+}
+
+bool
+usesPosition(const Expr* e) {
+    if (std::strcmp(e->getName(), "position") == 0 ||
+        std::strcmp(e->getName(), "last") == 0) {
+        return true;
+    }
+    // Predicates of sub expressions have their own positions.
+    std::vector<const Expr*> children;
+    e->getChildren(children);
+    for (const Expr* child : children) {
+        if (usesPosition(child)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Returns an indication if a predicate is a boolean that does not depend on the
+ * position, it can then be evaluated for one node at a time.
+ */
+bool
+isNodePredicate(const Expr* pred) {
+    if (dynamic_cast<const ComparePredicate*>(pred) != nullptr) {
+        return true;
+    }
+    const Predicate* p = dynamic_cast<const Predicate*>(pred);
+    if (p == nullptr || p->getExpr()->getPredicates() != nullptr) {
+        return false;
+    }
+    const Expr* e = p->getExpr();
+    static const char* const booleans[] = {
+        "Eq", "Ne", "Lt", "Le", "Gt", "Ge", "And", "Or", "BooleanLiteral",
+        "not", "boolean", "true", "false", "starts-with", "contains"
+    };
+    for (const char* name : booleans) {
+        if (std::strcmp(e->getName(), name) == 0) {
+            return !usesPosition(e);
+        }
+    }
+    return false;
+}
+
+/**
+ * Visits the nodes n->search(name, result) selects, in the same order. The
+ * children of the nodes on the way down are kept on one stack.
+ */
+bool
+searchNodes(const Node* n,
+            const std::string& name,
+            const NodeVisitor& f,
+            std::vector<const Node*>& stack) {
+    size_t begin = stack.size();
+    n->getChildren(stack);
+    size_t end = stack.size();
+    bool more = true;
+    for (size_t i = begin; more && i < end; i++) {
+        more = stack[i]->getLocalName() != name || f(stack[i]);
+    }
+    for (size_t i = begin; more && i < end; i++) {
+        more = searchNodes(stack[i], name, f, stack);
+    }
+    stack.resize(begin);
+    return more;
 }
 
+/**
+ * Visits the nodes n->getSubTreeNodes(result) selects, in the same order.
+ */
+bool
+subTreeNodes(const Node* n, const NodeVisitor& f, std::vector<const Node*>& stack) {
+    size_t begin = stack.size();
+    n->getChildren(stack);
+    size_t end = stack.size();
+    bool more = true;
+    for (size_t i = begin; more && i < end; i++) {
+        more = f(stack[i]);
+    }
+    for (size_t i = begin; more && i < end; i++) {
+        more = subTreeNodes(stack[i], f, stack);
+    }
+    stack.resize(begin);
+    return more;
+}
+    
 void
 addIfUnique(std::vector<const Node*>& result, const std::vector<const Node*>& ns) {
     for (const Node* n : ns) {
@@ -56,6 +158,274 @@ concatenate(std::vector<const Node*>& u, const std::vector<const Node*>& v) {
     u.insert(u.end(), v.begin(), v.end());
     return u;
 }
+
+/**
+ * Returns the number of chunks a node set is split into for parallel
+ * evaluation, 0 if the calling thread evaluates it alone.
+ */
+size_t
+getChunks(const Env& env, size_t size) {
+    Budget* budget = Budget::getCurrent();
+    if (env.getThreads() < 2 ||
+        (budget != nullptr && budget->isResumable()) ||
+        size < 2 ||
+        size < env.getParallelThreshold() ||
+        ThreadPool::inTask()) {
+        return 0;
+    }
+    // More chunks than threads, threads that are done steal the chunks of
+    // slower ones.
+    return std::min(size, env.getThreads() * 4);
+}
+
+/**
+ * Calls f(chunk, begin, end) for each chunk of [0, size) on the thread pool
+ * of env, the chunks are consecutive ranges.
+ */
+void
+forEachChunk(const Env& env,
+             size_t size,
+             size_t chunks,
+             const std::function<void(size_t, size_t, size_t)>& f) {
+    Budget* budget = Budget::getCurrent();
+    ThreadPool::get(env.getThreads()).run(chunks, [size, chunks, &f, budget](size_t chunk) {
+        Budget::Scope scope(budget);
+        f(chunk, size * chunk / chunks, size * (chunk + 1) / chunks);
+    });
+}
+
+bool
+isDistinct(const std::vector<const Node*>& nodeSet) {
+    ScratchNodeSet sorted;
+    sorted->assign(nodeSet.begin(), nodeSet.end());
+    std::sort(sorted->begin(), sorted->end());
+    return std::adjacent_find(sorted->begin(), sorted->end()) == sorted->end();
+}
+
+/**
+ * Returns an indication if the subtrees of the nodes do not overlap, the nodes
+ * are distinct and have the same depth. Threads may then create the children
+ * of different nodes at once.
+ */
+bool
+isDisjoint(const std::vector<const Node*>& nodeSet) {
+    const Node* parent = nodeSet.front()->getParent();
+    size_t depth = 0;
+    for (const Node* p = parent; p != nullptr; p = p->getParent()) {
+        depth++;
+    }
+    for (const Node* n : nodeSet) {
+        if (n->getParent() == parent) {
+            continue;
+        }
+        parent = n->getParent();
+        size_t d = 0;
+        for (const Node* p = parent; p != nullptr; p = p->getParent()) {
+            d++;
+        }
+        if (d != depth) {
+            return false;
+        }
+    }
+    return isDistinct(nodeSet);
+}
+
+/**
+ * Returns the nodes of a node set that are not in the subtree of another node
+ * of the set, the descendants of nested nodes would be selected twice.
+ * @param nodeSet the node set.
+ * @param roots filled with the nodes if some are nested.
+ * @return nodeSet or roots.
+ */
+const std::vector<const Node*>&
+getSubTreeRoots(const std::vector<const Node*>& nodeSet, std::vector<const Node*>& roots) {
+    if (nodeSet.size() < 2) {
+        return nodeSet;
+    }
+    // Siblings do not contain each other, e.g. the context of "/a/b//c".
+    const Node* parent = nodeSet.front()->getParent();
+    if (std::all_of(nodeSet.begin(), nodeSet.end(), [parent](const Node* n) { return n->getParent() == parent; })) {
+        return nodeSet;
+    }
+    std::unordered_set<const Node*> nodes(nodeSet.begin(), nodeSet.end());
+    for (const Node* n : nodeSet) {
+        const Node* p = n->getParent();
+        while (p != nullptr && nodes.count(p) == 0) {
+            p = p->getParent();
+        }
+        if (p == nullptr) {
+            roots.push_back(n);
+        }
+    }
+    return roots;
+}
+
+/**
+ * Returns an indication if an expression only looks at the subtree of its
+ * context node: its steps go down, it has no variables, absolute paths,
+ * cached values or current().
+ */
+bool
+isConfined(const Expr* e) {
+    static const char* const confined[] = {
+        "Path", "Predicate", "PositionPredicate", "ComparePredicate", "SelfStep",
+        "SelfMatchStep", "ChildStep", "AllStep", "ChildPath", "ChildIndexStep",
+        "DescendantAll", "DescendantOrSelfAll", "DescendantSearch",
+        "DescendantOrSelfSearch", "StringLiteral", "NumericLiteral",
+        "BooleanLiteral", "EmptyNodeSet", "Union", "Or", "And", "Eq", "Ne", "Lt",
+        "Gt", "Le", "Ge", "Plus", "Minus", "Mul", "Div", "Mod"
+    };
+    bool known = dynamic_cast<const Fun*>(e) != nullptr && std::strcmp(e->getName(), "current") != 0;
+    for (const char* name : confined) {
+        known |= std::strcmp(e->getName(), name) == 0;
+    }
+    if (!known) {
+        return false;
+    }
+    std::vector<const Expr*> children;
+    e->getChildren(children);
+    if (e->getPredicates() != nullptr) {
+        children.insert(children.end(), e->getPredicates()->begin(), e->getPredicates()->end());
+    }
+    return std::all_of(children.begin(), children.end(), isConfined);
+}
+
+/**
+ * Returns an indication if a JSON value has at least limit values, the
+ * values are counted until the limit is reached.
+ */
+bool
+hasAtLeast(const nlohmann::json& j, size_t& limit) {
+    if (limit == 0) {
+        return true;
+    }
+    limit--;
+    if (j.is_structured()) {
+        for (const nlohmann::json& child : j) {
+            if (hasAtLeast(child, limit)) {
+                return true;
+            }
+        }
+    }
+    return limit == 0;
+}
+
+/**
+ * Appends the nodes n->search(*name, result) selects, or
+ * n->getSubTreeNodes(result) if name is nullptr, in the same order. Large
+ * trees are expanded level by level until there are enough subtrees for the
+ * threads, the subtrees are then searched by the thread pool.
+ */
+void
+selectDescendants(const Env& env,
+                  const Node* n,
+                  const std::string* name,
+                  std::vector<const Node*>& result) {
+    size_t limit = env.getParallelThreshold();
+    Budget* budget = Budget::getCurrent();
+    if (env.getThreads() < 2 ||
+        (budget != nullptr && budget->isResumable()) ||
+        ThreadPool::inTask() ||
+        !hasAtLeast(n->getJson(), limit)) {
+        if (budget == nullptr) {
+            name != nullptr ? n->search(*name, result) : n->getSubTreeNodes(result);
+            return;
+        }
+        // Visit node by node, a large subtree is charged while it is
+        // searched and a resumable evaluation yields during the search.
+        const size_t batch = 1024;
+        size_t visited = 0;
+        ScratchNodeSet stack;
+        subTreeNodes(n, [name, &result, &visited, batch](const Node* node) {
+            if (name == nullptr || node->getLocalName() == *name) {
+                result.push_back(node);
+            }
+            if (++visited == batch) {
+                visited = 0;
+                Budget::visit(batch);
+            }
+            return true;
+        }, *stack);
+        Budget::visit(visited);
+        return;
+    }
+    // The result is the sequence of the items: the nodes an expanded node
+    // selects itself, a range of own, followed by the nodes the searches of
+    // the subtrees of a range of open nodes select.
+    struct Item {
+        size_t ownBegin;
+        size_t ownEnd;
+        size_t openBegin;
+        size_t openEnd;
+    };
+    const size_t maxLevels = 16;
+    const size_t chunks = env.getThreads() * 4;
+    std::vector<Item> items(1, Item{0, 0, 0, 1});
+    std::vector<const Node*> own;
+    std::vector<const Node*> open(1, n);
+    for (size_t level = 0; !open.empty() && open.size() < chunks * 8 && level < maxLevels; level++) {
+        std::vector<Item> nextItems;
+        std::vector<const Node*> nextOpen;
+        for (const Item& item : items) {
+            nextItems.push_back(Item{item.ownBegin, item.ownEnd, nextOpen.size(), nextOpen.size()});
+            for (size_t i = item.openBegin; i < item.openEnd; i++) {
+                size_t ownBegin = own.size();
+                if (name != nullptr) {
+                    open[i]->getChild(*name, own);
+                } else {
+                    open[i]->getChildren(own);
+                }
+                size_t openBegin = nextOpen.size();
+                open[i]->getChildren(nextOpen);
+                nextItems.push_back(Item{ownBegin, own.size(), openBegin, nextOpen.size()});
+            }
+        }
+        items.swap(nextItems);
+        open.swap(nextOpen);
+    }
+    // Each chunk collects the nodes of its open nodes in one vector, starts
+    // holds the chunk and offset where the nodes of each item begin.
+    std::vector<std::vector<const Node*>> selected(std::max<size_t>(std::min(chunks, open.size()), 1));
+    std::vector<std::pair<size_t, size_t>> starts(items.size() + 1);
+    auto search = [name, &items, &open, &selected, &starts](size_t chunk, size_t begin, size_t end) {
+        std::vector<const Node*>& nodes = selected[chunk];
+        size_t k = std::lower_bound(items.begin(), items.end(), begin, [](const Item& item, size_t i) {
+            return item.openBegin < i;
+        }) - items.begin();
+        for (size_t i = begin; i < end; i++) {
+            for (; k < items.size() && items[k].openBegin == i; k++) {
+                starts[k] = std::make_pair(chunk, nodes.size());
+            }
+            if (name != nullptr) {
+                open[i]->search(*name, nodes);
+            } else {
+                open[i]->getSubTreeNodes(nodes);
+            }
+        }
+    };
+    if (selected.size() > 1) {
+        forEachChunk(env, open.size(), selected.size(), search);
+    } else {
+        search(0, 0, open.size());
+    }
+    std::pair<size_t, size_t> last(selected.size() - 1, selected.back().size());
+    for (size_t k = 0; k <= items.size(); k++) {
+        if (k == items.size() || items[k].openBegin == open.size()) {
+            starts[k] = last;
+        }
+    }
+    for (size_t k = 0; k < items.size(); k++) {
+        result.insert(result.end(), own.begin() + items[k].ownBegin, own.begin() + items[k].ownEnd);
+        std::pair<size_t, size_t> from = starts[k];
+        std::pair<size_t, size_t> to = starts[k + 1];
+        for (size_t c = from.first; c <= to.first; c++) {
+            const std::vector<const Node*>& nodes = selected[c];
+            result.insert(result.end(),
+                          nodes.begin() + (c == from.first ? from.second : 0),
+                          nodes.begin() + (c == to.first ? to.second : nodes.size()));
+        }
+    }
+}
 }
 
 namespace Jstr {
@@ -73,12 +443,96 @@ Expr::~Expr() {
 
 Value
 Expr::eval(const Env& e, const Value& v, size_t pos, bool firstStep) const {
+    Value result = evalExpr(e, v, pos, firstStep);
+    if (_preds != nullptr) {
+        result = evalFilter(e, result);
+    }
+    Budget::visit(result);
+    return result;
+}
+
+bool
+Expr::visit(const Env& env,
+            const Value& val,
+            size_t pos,
+            bool firstStep,
+            const NodeVisitor& f) const {
+    if (Budget::getCurrent() == nullptr) {
+        return visitFiltered(env, val, pos, firstStep, f);
+    }
+    // The nodes are not collected in a node set, count them one by one.
+    return visitFiltered(env, val, pos, firstStep, [&f](const Node* n) {
+        Budget::visit(1);
+        return f(n);
+    });
+}
+
+bool
+Expr::visitFiltered(const Env& env,
+                    const Value& val,
+                    size_t pos,
+                    bool firstStep,
+                    const NodeVisitor& f) const {
     if (_preds == nullptr) {
-        return evalExpr(e, v, pos, firstStep);
-    } else {
-        const Value& val = evalExpr(e, v, pos, firstStep);
-        return evalFilter(e, val);
+        return visitExpr(env, val, pos, firstStep, f);
+    }
+    for (const Expr* pred : *_preds) {
+        if (!isNodePredicate(pred)) {
+            return visitNodes(eval(env, val, pos, firstStep).getNodeSet(), f);
+        }
+    }
+    return visitExpr(env, val, pos, firstStep, [this, &env, &f](const Node* n) {
+        Value context(n);
+        for (const Expr* pred : *_preds) {
+            const ComparePredicate* compare = dynamic_cast<const ComparePredicate*>(pred);
+            if (compare != nullptr ? !compare->test(n) : !pred->eval(env, context, 0).getBoolean()) {
+                return true;
+            }
+        }
+        return f(n);
+    });
+}
+
+bool
+Expr::visitExpr(const Env& env,
+                const Value& val,
+                size_t pos,
+                bool firstStep,
+                const NodeVisitor& f) const {
+    return visitNodes(evalExpr(env, val, pos, firstStep).getNodeSet(), f);
+}
+
+size_t
+Expr::count(const Env& env, const Value& val, size_t pos, bool firstStep) const {
+    if (_preds == nullptr) {
+        size_t n = countExpr(env, val, pos, firstStep);
+        Budget::visitNodeSet(n);
+        return n;
     }
+    size_t n = 0;
+    visit(env, val, pos, firstStep, [&n](const Node*) { n++; return true; });
+    return n;
+}
+
+size_t
+Expr::countExpr(const Env& env, const Value& val, size_t pos, bool firstStep) const {
+    size_t n = 0;
+    visitExpr(env, val, pos, firstStep, [&n](const Node*) { n++; return true; });
+    return n;
+}
+
+void
+Expr::selectExpr(const Env& env,
+                 const std::vector<const Node*>& nodeSet,
+                 size_t pos,
+                 bool firstStep,
+                 std::vector<const Node*>& result) const {
+    concatenate(result, evalExpr(env, Value(nodeSet), pos, firstStep).getNodeSet());
+}
+
+bool
+Expr::selectsNodeSet() const {
+    return false;
 }
 
 void
@@ -93,6 +547,40 @@ Expr::takePredicates() {
     return result;
 }
 
+const std::list<const Expr*>*
+Expr::getPredicates() const {
+    return _preds;
+}
+
+void
+Expr::print(std::ostream& os) const {
+    os << getName();
+}
+
+bool
+Expr::isConstant() const {
+    return false;
+}
+
+bool
+Expr::isContextIndependent() const {
+    return isConstant();
+}
+
+void
+Expr::getChildren(std::vector<const Expr*>& children) const {
+}
+
+void
+Expr::rewriteChildren(const Rewrite& f) {
+    if (_preds != nullptr) {
+        std::list<const Expr*>* preds = const_cast<std::list<const Expr*>*>(_preds);
+        for (const Expr*& pred : *preds) {
+            pred = f(const_cast<Expr*>(pred));
+        }
+    }
+}
+
 Value
 Expr::evalFilter(const Env& env, const Value& val) const {
     if (val.getType() != Value::NodeSet) {
@@ -103,29 +591,99 @@ Expr::evalFilter(const Env& env, const Value& val) const {
         }
         return keep ? val : Value();
     }
-    std::vector<const Node*> result = val.getNodeSet();
+    // The context of the first predicate is val, the following predicates
+    // take the node set kept by the previous one.
+    Value result;
+    const Value* context = &val;
     for (const Expr* pred : *_preds) {
-        std::vector<size_t> keepIndexes;
-        for (int i = 0; i < result.size(); i++) {
-            Value r = pred->eval(env, result, i);
-            if (r.getType() == Value::Number) {
-                if (i + 1 == r.getNumber()) {
-                    keepIndexes.emplace_back(i);
+        const std::vector<const Node*>& nodeSet = context->getNodeSet();
+        ScratchNodeSet kept;
+        const PositionPredicate* position = dynamic_cast<const PositionPredicate*>(pred);
+        if (position != nullptr) {
+            size_t index;
+            if (position->getIndex(nodeSet.size(), index)) {
+                kept->emplace_back(nodeSet[index]);
+            }
+            result = Value(std::move(*kept));
+            context = &result;
+            continue;
+        }
+        if (const ComparePredicate* compare = dynamic_cast<const ComparePredicate*>(pred)) {
+            compare->select(nodeSet, *kept);
+            result = Value(std::move(*kept));
+            context = &result;
+            continue;
+        }
+        auto isKept = [&env, pred, context](size_t i) {
+            Value r = pred->eval(env, *context, i);
+            return r.getType() == Value::Number ? i + 1 == r.getNumber() : r.getBoolean();
+        };
+        size_t chunks = getChunks(env, nodeSet.size());
+        if (chunks > 0 && isConfined(pred) && isDisjoint(nodeSet)) {
+            std::vector<uint8_t> selected(nodeSet.size());
+            forEachChunk(env, nodeSet.size(), chunks, [&isKept, &selected](size_t, size_t begin, size_t end) {
+                for (size_t i = begin; i < end; i++) {
+                    selected[i] = isKept(i);
                 }
-            } else {
-                if (r.getBoolean()) {
-                    keepIndexes.emplace_back(i);
+            });
+            for (size_t i = 0, size = nodeSet.size(); i < size; i++) {
+                if (selected[i]) {
+                    kept->emplace_back(nodeSet[i]);
+                }
+            }
+        } else {
+            for (size_t i = 0, size = nodeSet.size(); i < size; i++) {
+                if (isKept(i)) {
+                    kept->emplace_back(nodeSet[i]);
                 }
             }
         }
-        result = filter(result, keepIndexes);
+        result = Value(std::move(*kept));
+        context = &result;
     }
-    return Value(result);
+    return result;
 }
 
 // BinaryExpr
 BinaryExpr::BinaryExpr(const Expr* l, const Expr* r) : _l(l), _r(r) {}
 
+bool
+BinaryExpr::isConstant() const {
+    return
+        getPredicates() == nullptr &&
+        _l->isConstant() &&
+        (_r == nullptr || _r->isConstant());
+}
+
+bool
+BinaryExpr::isContextIndependent() const {
+    return
+        _l->isContextIndependent() &&
+        (_r == nullptr || _r->isContextIndependent());
+}
+
+void
+BinaryExpr::getChildren(std::vector<const Expr*>& children) const {
+    children.push_back(_l.get());
+    if (_r != nullptr) {
+        children.push_back(_r.get());
+    }
+}
+
+void
+BinaryExpr::swapOperands() {
+    std::swap(_l, _r);
+}
+
+void
+BinaryExpr::rewriteChildren(const Rewrite& f) {
+    Expr::rewriteChildren(f);
+    _l.reset(f(const_cast<Expr*>(_l.release())));
+    if (_r != nullptr) {
+        _r.reset(f(const_cast<Expr*>(_r.release())));
+    }
+}
+
 // StrExpr
 StrExpr::StrExpr(const std::string& s) : _s(s) {
 }
@@ -170,75 +728,117 @@ Root::evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep) const {
     return e.getRoot();
 }
 
+bool
+Root::isContextIndependent() const {
+    return true;
+}
+
+bool
+Root::selectsNodeSet() const {
+    return true;
+}
+
 // Path
 Path::Path(Expr* e) : MultiExpr(e) {}
 
 Value
 Path::evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep) const {
-    Value result = val;
+    if (_exprs.empty()) {
+        return val;
+    }
+    // Predicates evaluate paths once per node of their context, do not copy
+    // the context node set into the first step.
+    Value result;
+    const Value* context = &val;
     bool first(true);
     for (const Expr* exp : _exprs) {
-        result = exp->eval(env, result, pos, first);
+        result = exp->eval(env, *context, pos, first);
+        context = &result;
         first = false;
     }
     return result;
 }
 
-Expr*
-Path::createDescendant() {
-    // The grammar ensures there is at least one step
-    Expr* step = _exprs.front();
-    Expr* descendant;
-    if (Step::isAllStep(step)) {
-        descendant = new DescendantAll();
-        descendant->addPredicates(step->takePredicates());
-        _exprs.pop_front();
-       delete step;
-    } else if (Step::isSelfOrParentStep(step)) {
-        descendant = new DescendantAll();
+void
+Path::addDescendantFront() {
+    Expr* descendant = _exprs.empty() ? nullptr : Step::createDescendant(_exprs.front());
+    if (descendant != nullptr) {
+        _exprs.front() = descendant;
     } else {
-        Step* s = static_cast<Step*>(step);
-        const std::string& stepName = s->getString();
-        descendant = new DescendantSearch(stepName);
-        descendant->addPredicates(s->takePredicates());
-        _exprs.pop_front();
-       delete step;
+        _exprs.push_front(new DescendantOrSelfAll());
     }
-    return descendant;
-}
-    
-void
-Path::addAbsoluteDescendant() {
-    Expr* item = createDescendant();
-    _exprs.push_front(item);
-    _exprs.push_front(new Root);
 }
 
 void
-Path::addRelativeDescendant(Expr* step) {
-    Expr* descendant;
-    if (Step::isAllStep(step)) {
-        Step* s = static_cast<Step*>(step);
-        descendant = new DescendantAll();
-        descendant->addPredicates(s->takePredicates());
-       delete step;
-    } else if (Step::isSelfOrParentStep(step)) {
-        descendant = new DescendantAll();
-        _exprs.push_back(step);
+Path::addDescendantBack(Expr* step) {
+    Expr* descendant = Step::createDescendant(step);
+    if (descendant != nullptr) {
+        _exprs.push_back(descendant);
     } else {
-        Step* s = static_cast<Step*>(step);
-        const std::string& stepName = s->getString();
-        descendant = new DescendantSearch(stepName);
-        descendant->addPredicates(s->takePredicates());
-       delete step;
+        _exprs.push_back(new DescendantOrSelfAll());
+        _exprs.push_back(step);
+    }
+}
+
+bool
+Path::isContextIndependent() const {
+    // Only the first step is evaluated in the context.
+    return !_exprs.empty() && _exprs.front()->isContextIndependent();
+}
+
+bool
+Path::visitExpr(const Env& env,
+                const Value& val,
+                size_t pos,
+                bool firstStep,
+                const NodeVisitor& f) const {
+    if (_exprs.empty()) {
+        return Expr::visitExpr(env, val, pos, firstStep, f);
+    }
+    // Only the last step is streamed.
+    Value result;
+    const Value* context = &val;
+    bool first(true);
+    for (std::list<Expr*>::const_iterator i = _exprs.begin(); i != std::prev(_exprs.end()); ++i) {
+        result = (*i)->eval(env, *context, pos, first);
+        context = &result;
+        first = false;
+    }
+    return _exprs.back()->visit(env, *context, pos, first, f);
+}
+
+size_t
+Path::countExpr(const Env& env, const Value& val, size_t pos, bool firstStep) const {
+    if (_exprs.empty()) {
+        return Expr::countExpr(env, val, pos, firstStep);
+    }
+    Value result;
+    const Value* context = &val;
+    bool first(true);
+    for (std::list<Expr*>::const_iterator i = _exprs.begin(); i != std::prev(_exprs.end()); ++i) {
+        result = (*i)->eval(env, *context, pos, first);
+        context = &result;
+        first = false;
     }
-    _exprs.push_back(descendant);
+    return _exprs.back()->count(env, *context, pos, first);
+}
+
+bool
+Path::selectsNodeSet() const {
+    return !_exprs.empty() && _exprs.back()->selectsNodeSet();
+}
+
+void
+Path::getChildren(std::vector<const Expr*>& children) const {
+    children.insert(children.end(), _exprs.begin(), _exprs.end());
 }
 
 void
-Path::addRelativeDescendant() {
-    Expr* item = createDescendant();
-    _exprs.push_back(item);
+Path::rewriteChildren(const Rewrite& f) {
+    Expr::rewriteChildren(f);
+    for (Expr*& e : _exprs) {
+        e = f(e);
+    }
 }
 
 // Step
@@ -286,6 +886,12 @@ Step::create(const std::string& axisName, const std::string& nodeTest) {
         } else {
             return new FollowingSiblingSearch(nodeTest);
         }
+    } else if (axisName == "following") {
+        return new FollowingStep(nodeTest);
+    } else if (axisName == "preceding") {
+        return new PrecedingStep(nodeTest);
+    } else if (axisName == "preceding-sibling") {
+        return new PrecedingSiblingStep(nodeTest);
     } else if (axisName == "parent") {
         if (nodeTest == "*") {
             return new ParentStep();
@@ -303,6 +909,16 @@ Step::create(const std::string& axisName, const std::string& nodeTest) {
     }
 }
 
+bool
+Step::selectsNodeSet() const {
+    return true;
+}
+
+void
+Step::print(std::ostream& os) const {
+    os << getName() << " " << _s;
+}
+
 bool Step::isAllStep(const Expr* step) {
     return dynamic_cast<const AllStep*>(step) != nullptr;
 }
@@ -314,35 +930,54 @@ bool Step::isSelfOrParentStep(const Expr* step) {
         dynamic_cast<const ParentMatchStep*>(step) != nullptr;
 }
 
+Expr*
+Step::createDescendant(Expr* step) {
+    const std::type_info& type = typeid(*step);
+    Expr* descendant;
+    if (type == typeid(AllStep)) {
+        descendant = new DescendantAll();
+    } else if (type == typeid(ChildStep)) {
+        descendant = new DescendantSearch(static_cast<Step*>(step)->getString());
+    } else if (type == typeid(DescendantAll) || type == typeid(DescendantSearch)) {
+        // The step already selects from the whole sub tree.
+        return step;
+    } else {
+        return nullptr;
+    }
+    descendant->addPredicates(step->takePredicates());
+    delete step;
+    return descendant;
+}
+
 AncestorStep::AncestorStep(const std::string& s) : Step(s) {
 }
 
 Value
 AncestorStep::evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep) const {
     const std::vector<const Node*>& nodeSet = val.getNodeSet();
-    std::vector<const Node*> tmp1;
+    ScratchNodeSet tmp1;
     if (firstStep) {
         const Node* n = nodeSet[pos];
-        n->getAncestors(tmp1);
+        n->getAncestors(*tmp1);
     } else {
         for (const Node* n : nodeSet) {
-            std::vector<const Node*> tmp2;
-            n->getAncestors(tmp2);
-            ::addIfUnique(tmp1, tmp2);
+            ScratchNodeSet tmp2;
+            n->getAncestors(*tmp2);
+            ::addIfUnique(*tmp1, *tmp2);
         }
     }
-    std::vector<const Node*> result;
+    ScratchNodeSet result;
     // TODO Could be more efficient with search instead of filter
     if (_s != "*") {
-        for (const Node* n : tmp1) {
+        for (const Node* n : *tmp1) {
             if (n->getLocalName() == _s) {
-                result.emplace_back(n);
+                result->emplace_back(n);
             }
         }
     } else {
-        result = tmp1;
+        result->swap(*tmp1);
     }
-    return Value(result);
+    return Value(std::move(*result));
 }
 
 AncestorSelfStep::AncestorSelfStep(const std::string& s) :
@@ -352,61 +987,142 @@ AncestorSelfStep::AncestorSelfStep(const std::string& s) :
 Value
 AncestorSelfStep::evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep) const {
     const std::vector<const Node*>& nodeSet = val.getNodeSet();
-    std::vector<const Node*> result;
+    ScratchNodeSet result;
     if (firstStep) {
         const Node* n = nodeSet[pos];
         if (checkLocalName(n, _s)) {
-            result.emplace_back(n);
+            result->emplace_back(n);
         }
     } else {
         for (const Node* n : nodeSet) {
             if (checkLocalName(n, _s)) {
-                result.emplace_back(n);
+                result->emplace_back(n);
             }
         }
     }
     Value tmp = AncestorStep::evalExpr(env, val, pos, firstStep);
-    return Value(concatenate(result, tmp.getNodeSet()));
+    return Value(std::move(concatenate(*result, tmp.getNodeSet())));
+}
+
+bool
+AllStep::selectsNodeSet() const {
+    return true;
 }
 
 Value
 AllStep::evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep) const {
-    const std::vector<const Node*>& nodeSet = val.getNodeSet();
-    std::vector<const Node*> result;
+    ScratchNodeSet result;
+    selectExpr(env, val.getNodeSet(), pos, firstStep, *result);
+    return Value(std::move(*result));
+}
+
+void
+AllStep::selectExpr(const Env& env,
+                    const std::vector<const Node*>& nodeSet,
+                    size_t pos,
+                    bool firstStep,
+                    std::vector<const Node*>& result) const {
     if (firstStep) {
         const Node* n = nodeSet[pos];
         n->getChildren(result);
     } else {
-        for (const Node* n : nodeSet) {
-            n->getChildren(result);
+        size_t chunks = getChunks(env, nodeSet.size());
+        if (chunks > 0 && isDistinct(nodeSet)) {
+            std::vector<std::vector<const Node*>> children(chunks);
+            forEachChunk(env, nodeSet.size(), chunks, [&nodeSet, &children](size_t chunk, size_t begin, size_t end) {
+                for (size_t i = begin; i < end; i++) {
+                    nodeSet[i]->getChildren(children[chunk]);
+                }
+            });
+            for (const std::vector<const Node*>& c : children) {
+                concatenate(result, c);
+            }
+        } else {
+            for (const Node* n : nodeSet) {
+                n->getChildren(result);
+            }
         }
     }
-    return Value(result);
 }
 
 ChildStep::ChildStep(const std::string& s) :
     Step(s) {
 }
 
-Value
-ChildStep::evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep) const {
+bool
+ChildStep::visitExpr(const Env& env,
+                     const Value& val,
+                     size_t pos,
+                     bool firstStep,
+                     const NodeVisitor& f) const {
     const std::vector<const Node*>& nodeSet = val.getNodeSet();
-    std::vector<const Node*> result;
-    if (firstStep) {
-        const Node* n = nodeSet[pos];
-        n->getChild(_s, result);
-    } else {
-        for (const Node* n : nodeSet) {
-            n->getChild(_s, result);
+    size_t begin = firstStep ? pos : 0;
+    size_t end = firstStep ? pos + 1 : nodeSet.size();
+    // Only the children of one node are kept at a time.
+    ScratchNodeSet children;
+    for (size_t i = begin; i < end; i++) {
+        children->clear();
+        nodeSet[i]->getChild(_s, *children);
+        if (!visitNodes(*children, f)) {
+            return false;
         }
     }
-    return result;
+    return true;
 }
 
-Value
-ParentStep::evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep) const {
+size_t
+ChildStep::countExpr(const Env& env, const Value& val, size_t pos, bool firstStep) const {
     const std::vector<const Node*>& nodeSet = val.getNodeSet();
-    std::vector<const Node*> result;
+    size_t begin = firstStep ? pos : 0;
+    size_t end = firstStep ? pos + 1 : nodeSet.size();
+    size_t n = 0;
+    for (size_t i = begin; i < end; i++) {
+        n += nodeSet[i]->getChildCount(_s);
+    }
+    return n;
+}
+
+Value
+ChildStep::evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep) const {
+    ScratchNodeSet result;
+    selectExpr(env, val.getNodeSet(), pos, firstStep, *result);
+    return Value(std::move(*result));
+}
+
+void
+ChildStep::selectExpr(const Env& env,
+                      const std::vector<const Node*>& nodeSet,
+                      size_t pos,
+                      bool firstStep,
+                      std::vector<const Node*>& result) const {
+    if (firstStep) {
+        const Node* n = nodeSet[pos];
+        n->getChild(_s, result);
+    } else {
+        for (const Node* n : nodeSet) {
+            n->getChild(_s, result);
+        }
+    }
+}
+
+bool
+ParentStep::selectsNodeSet() const {
+    return true;
+}
+
+Value
+ParentStep::evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep) const {
+    ScratchNodeSet result;
+    selectExpr(env, val.getNodeSet(), pos, firstStep, *result);
+    return Value(std::move(*result));
+}
+
+void
+ParentStep::selectExpr(const Env& env,
+                       const std::vector<const Node*>& nodeSet,
+                       size_t pos,
+                       bool firstStep,
+                       std::vector<const Node*>& result) const {
     if (firstStep) {
         const Node* n = nodeSet[pos];
         const Node* parent = n->getParent();
@@ -421,7 +1137,6 @@ ParentStep::evalExpr(const Env& env, const Value& val, size_t pos, bool firstSte
             }
         }
     }
-    return Value(result);
 }
 
 ParentMatchStep::ParentMatchStep(const std::string& s) : Step(s) {
@@ -430,22 +1145,22 @@ ParentMatchStep::ParentMatchStep(const std::string& s) : Step(s) {
 Value
 ParentMatchStep::evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep) const {
     const std::vector<const Node*>& nodeSet = val.getNodeSet();
-    std::vector<const Node*> result;
+    ScratchNodeSet result;
     if (firstStep) {
         const Node* n = nodeSet[pos];
         const Node* parent = n->getParent();
         if (parent != nullptr && checkLocalName(parent, _s)) {
-            addIfUnique(result, parent);
+            addIfUnique(*result, parent);
         }
     } else {
         for (const Node* n : nodeSet) {
             const Node* parent = n->getParent();
             if (parent != nullptr && checkLocalName(parent, _s)) {
-                addIfUnique(result, parent);
+                addIfUnique(*result, parent);
             }
         }
     }
-    return Value(result);
+    return Value(std::move(*result));
 }
 
 Value
@@ -453,15 +1168,22 @@ SelfStep::evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep)
     if (val.getType() != Value::NodeSet) {
         return val;
     } else {
-        const std::vector<const Node*>& nodeSet = val.getNodeSet();
-        std::vector<const Node*> result;
-        if (firstStep) {
-            const Node* n = nodeSet[pos];
-            result.emplace_back(nodeSet[pos]);
-        } else {
-            result = nodeSet;
-        }
-        return Value(result);
+        ScratchNodeSet result;
+        selectExpr(env, val.getNodeSet(), pos, firstStep, *result);
+        return Value(std::move(*result));
+    }
+}
+
+void
+SelfStep::selectExpr(const Env& env,
+                     const std::vector<const Node*>& nodeSet,
+                     size_t pos,
+                     bool firstStep,
+                     std::vector<const Node*>& result) const {
+    if (firstStep) {
+        result.emplace_back(nodeSet[pos]);
+    } else {
+        result.assign(nodeSet.begin(), nodeSet.end());
     }
 }
 
@@ -475,23 +1197,174 @@ SelfMatchStep::evalExpr(const Env& env, const Value& val, size_t pos, bool first
         return Value();
     } else {
         const std::vector<const Node*>& nodeSet = val.getNodeSet();
-        std::vector<const Node*> result;
+        ScratchNodeSet result;
         if (firstStep) {
             const Node* n = nodeSet[pos];
             if (checkLocalName(n, _s)) {
-                result.emplace_back(nodeSet[pos]);
+                result->emplace_back(nodeSet[pos]);
             }
         } else {
             for (const Node* n : nodeSet) {
                 if (n->getLocalName() == _s) {
-                    result.emplace_back(n);
+                    result->emplace_back(n);
                 }
             }
         }
-        return Value(result);
+        return Value(std::move(*result));
     }
 }
     
+ChildIndexStep::ChildIndexStep(const std::string& s, const PositionPredicate* position) :
+    Step(s), _position(position) {
+}
+
+Value
+ChildIndexStep::evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep) const {
+    ScratchNodeSet result;
+    selectExpr(env, val.getNodeSet(), pos, firstStep, *result);
+    return Value(std::move(*result));
+}
+
+void
+ChildIndexStep::selectExpr(const Env& env,
+                           const std::vector<const Node*>& nodeSet,
+                           size_t pos,
+                           bool firstStep,
+                           std::vector<const Node*>& result) const {
+    size_t begin = firstStep ? pos : 0;
+    size_t end = firstStep ? pos + 1 : nodeSet.size();
+    // Same as the position in the children of all nodes, counted without
+    // creating them.
+    size_t size = 0;
+    for (size_t i = begin; i < end; i++) {
+        size += nodeSet[i]->getChildCount(_s);
+    }
+    size_t index;
+    if (_position->getIndex(size, index)) {
+        for (size_t i = begin; i < end; i++) {
+            size_t count = nodeSet[i]->getChildCount(_s);
+            if (index < count) {
+                result.emplace_back(nodeSet[i]->getChildAt(_s, index));
+                break;
+            }
+            index -= count;
+        }
+    }
+}
+
+void
+ChildIndexStep::print(std::ostream& os) const {
+    os << getName() << " " << _s << " ";
+    _position->print(os);
+}
+
+const PositionPredicate*
+ChildIndexStep::getPosition() const {
+    return _position.get();
+}
+
+// ChildPath
+ChildPath::ChildPath(const std::vector<std::string>& names) : _names(names) {
+}
+
+Value
+ChildPath::evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep) const {
+    ScratchNodeSet result;
+    select(val.getNodeSet(), pos, firstStep, _names.size(), *result);
+    return Value(std::move(*result));
+}
+
+void
+ChildPath::selectExpr(const Env& env,
+                      const std::vector<const Node*>& nodeSet,
+                      size_t pos,
+                      bool firstStep,
+                      std::vector<const Node*>& result) const {
+    select(nodeSet, pos, firstStep, _names.size(), result);
+}
+
+bool
+ChildPath::visitExpr(const Env& env,
+                     const Value& val,
+                     size_t pos,
+                     bool firstStep,
+                     const NodeVisitor& f) const {
+    ScratchNodeSet parents;
+    select(val.getNodeSet(), pos, firstStep, _names.size() - 1, *parents);
+    const std::string& name = _names.back();
+    ScratchNodeSet children;
+    for (const Node* n : *parents) {
+        children->clear();
+        if (name.empty()) {
+            n->getChildren(*children);
+        } else {
+            n->getChild(name, *children);
+        }
+        if (!visitNodes(*children, f)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t
+ChildPath::countExpr(const Env& env, const Value& val, size_t pos, bool firstStep) const {
+    if (_names.back().empty()) {
+        return Expr::countExpr(env, val, pos, firstStep);
+    }
+    ScratchNodeSet parents;
+    select(val.getNodeSet(), pos, firstStep, _names.size() - 1, *parents);
+    size_t n = 0;
+    for (const Node* parent : *parents) {
+        n += parent->getChildCount(_names.back());
+    }
+    return n;
+}
+
+bool
+ChildPath::selectsNodeSet() const {
+    return true;
+}
+
+const std::vector<std::string>&
+ChildPath::getNames() const {
+    return _names;
+}
+
+void
+ChildPath::select(const std::vector<const Node*>& nodeSet,
+                  size_t pos,
+                  bool firstStep,
+                  size_t levels,
+                  std::vector<const Node*>& result) const {
+    if (firstStep) {
+        result.emplace_back(nodeSet[pos]);
+    } else {
+        result.assign(nodeSet.begin(), nodeSet.end());
+    }
+    // Selecting all children of one node set at a time keeps document order.
+    ScratchNodeSet from;
+    for (size_t i = 0; i < levels; i++) {
+        std::swap(*from, result);
+        result.clear();
+        for (const Node* n : *from) {
+            if (_names[i].empty()) {
+                n->getChildren(result);
+            } else {
+                n->getChild(_names[i], result);
+            }
+        }
+    }
+}
+
+void
+ChildPath::print(std::ostream& os) const {
+    os << getName() << " ";
+    for (size_t i = 0; i < _names.size(); i++) {
+        os << (i == 0 ? "" : "/") << (_names[i].empty() ? "*" : _names[i]);
+    }
+}
+
 // Predicate
 Predicate::Predicate(const Expr* e) : _e(e) {
 }
@@ -501,62 +1374,341 @@ Predicate::evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep
     return _e->eval(env, val, pos);
 }
 
+void
+Predicate::getChildren(std::vector<const Expr*>& children) const {
+    children.push_back(_e.get());
+}
+
+void
+Predicate::rewriteChildren(const Rewrite& f) {
+    Expr::rewriteChildren(f);
+    _e.reset(f(const_cast<Expr*>(_e.release())));
+}
+
+const Expr*
+Predicate::getExpr() const {
+    return _e.get();
+}
+
+// PositionPredicate
+PositionPredicate::PositionPredicate(double position, bool last) :
+    _position(position), _last(last) {
+}
+
+Value
+PositionPredicate::evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep) const {
+    if (_last) {
+        double size = val.getNodeSet().size();
+        return Value(size);
+    }
+    return Value(_position);
+}
+
+void
+PositionPredicate::print(std::ostream& os) const {
+    os << getName() << " ";
+    if (_last) {
+        os << "last()";
+    } else {
+        os << Value(_position).getString();
+    }
+}
+
+bool
+PositionPredicate::getIndex(size_t size, size_t& index) const {
+    if (_last) {
+        index = size - 1;
+        return size > 0;
+    }
+    // Positions that are not integers do not select anything.
+    if (_position >= 1 && _position <= size && _position == static_cast<size_t>(_position)) {
+        index = static_cast<size_t>(_position) - 1;
+        return true;
+    }
+    return false;
+}
+
+double
+PositionPredicate::getPosition() const {
+    return _position;
+}
+
+bool
+PositionPredicate::isLast() const {
+    return _last;
+}
+
+// ComparePredicate
+ComparePredicate::ComparePredicate(const Predicate* p,
+                                   Comparison comparison,
+                                   const std::string& name,
+                                   double d) :
+    _p(p), _comparison(comparison), _name(name), _d(d) {
+}
+
+Value
+ComparePredicate::evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep) const {
+    return _p->evalExpr(env, val, pos);
+}
+
+void
+ComparePredicate::print(std::ostream& os) const {
+    static const char* const names[] = {"Eq", "Ne", "Lt", "Le", "Gt", "Ge"};
+    os << getName() << " " << (_name.empty() ? "." : _name) << " "
+       << names[static_cast<int>(_comparison)] << " " << Value(_d).getString();
+}
+
+void
+ComparePredicate::getChildren(std::vector<const Expr*>& children) const {
+    children.push_back(_p.get());
+}
+
+bool
+ComparePredicate::test(const Node* n) const {
+    std::string buffer;
+    uint8_t mask;
+    if (_name.empty()) {
+        double d = getNumber(n, buffer);
+        compareEach(&d, 1, _comparison, _d, &mask);
+        return mask != 0;
+    }
+    ScratchNodeSet children;
+    n->getChild(_name, *children);
+    bool result(false);
+    // All children are converted, relations throw for any object or array.
+    for (const Node* child : *children) {
+        double d = getNumber(child, buffer);
+        compareEach(&d, 1, _comparison, _d, &mask);
+        result |= mask != 0;
+    }
+    return result;
+}
+
+Comparison
+ComparePredicate::getComparison() const {
+    return _comparison;
+}
+
+const std::string&
+ComparePredicate::getChildName() const {
+    return _name;
+}
+
+double
+ComparePredicate::getNumber() const {
+    return _d;
+}
+
+double
+ComparePredicate::getNumber(const Node* n, std::string& buffer) const {
+    if (_comparison == Comparison::Eq || _comparison == Comparison::Ne) {
+        return n->getNumber();
+    }
+    // Same conversion as relations between node sets and numbers.
+    if (!n->isValue()) {
+        throw std::runtime_error("Value::compare, can not compare objects or arrays");
+    }
+    const nlohmann::json& j = n->getJson();
+    return j.is_number() ? j.get<double>() : stringToNumber(n->getStringView(buffer));
+}
+
+void
+ComparePredicate::select(const std::vector<const Node*>& nodeSet,
+                         std::vector<const Node*>& result) const {
+    thread_local std::vector<double> numbers;
+    thread_local std::vector<uint8_t> mask;
+    thread_local std::vector<size_t> owners;
+    ScratchNodeSet children;
+    const std::vector<const Node*>* compared = &nodeSet;
+    if (!_name.empty()) {
+        owners.clear();
+        for (size_t i = 0, size = nodeSet.size(); i < size; i++) {
+            nodeSet[i]->getChild(_name, *children);
+            owners.resize(children->size(), i);
+        }
+        compared = &*children;
+    }
+    numbers.clear();
+    numbers.reserve(compared->size());
+    std::string buffer;
+    for (const Node* n : *compared) {
+        numbers.push_back(getNumber(n, buffer));
+    }
+    mask.resize(numbers.size());
+    compareEach(numbers.data(), numbers.size(), _comparison, _d, mask.data());
+    if (_name.empty()) {
+        for (size_t i = 0, size = nodeSet.size(); i < size; i++) {
+            if (mask[i]) {
+                result.push_back(nodeSet[i]);
+            }
+        }
+        return;
+    }
+    // A node is kept if any of its children is, owners are in order.
+    size_t last = nodeSet.size();
+    for (size_t i = 0, size = mask.size(); i < size; i++) {
+        if (mask[i] && owners[i] != last) {
+            last = owners[i];
+            result.push_back(nodeSet[last]);
+        }
+    }
+}
+
 // Descendant
 DescendantAll::DescendantAll() {
 }
 
 Value
 DescendantAll::evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep) const {
-    const std::vector<const Node*>& nodeSet = val.getNodeSet();
-    std::vector<const Node*> result;
-    for (const Node* n : nodeSet) {
-        n->getSubTreeNodes(result);
+    ScratchNodeSet result;
+    selectExpr(env, val.getNodeSet(), pos, firstStep, *result);
+    return Value(std::move(*result));
+}
+
+void
+DescendantAll::selectExpr(const Env& env,
+                          const std::vector<const Node*>& nodeSet,
+                          size_t pos,
+                          bool firstStep,
+                          std::vector<const Node*>& result) const {
+    ScratchNodeSet roots;
+    for (const Node* n : getSubTreeRoots(nodeSet, *roots)) {
+        selectDescendants(env, n, nullptr, result);
     }
-    return Value(result);
+}
+
+bool
+DescendantAll::visitExpr(const Env& env,
+                         const Value& val,
+                         size_t pos,
+                         bool firstStep,
+                         const NodeVisitor& f) const {
+    ScratchNodeSet stack;
+    ScratchNodeSet roots;
+    for (const Node* n : getSubTreeRoots(val.getNodeSet(), *roots)) {
+        if (!subTreeNodes(n, f, *stack)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool
+DescendantAll::selectsNodeSet() const {
+    return true;
 }
 
 DescendantOrSelfAll::DescendantOrSelfAll() :
     DescendantAll() {
 }
 
+bool
+DescendantOrSelfAll::visitExpr(const Env& env,
+                               const Value& val,
+                               size_t pos,
+                               bool firstStep,
+                               const NodeVisitor& f) const {
+    return Expr::visitExpr(env, val, pos, firstStep, f);
+}
+
 Value
 DescendantOrSelfAll::evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep) const {
-    const std::vector<const Node*>& nodeSet = val.getNodeSet();
-    std::vector<const Node*> result;
-    for (const Node* n : nodeSet) {
-        result.emplace_back(n);
-    }
-    const Value& d = DescendantAll::evalExpr(env, val, pos, firstStep); // TODO avoid extra copy
-    return concatenate(result, d.getNodeSet());
+    ScratchNodeSet result;
+    selectExpr(env, val.getNodeSet(), pos, firstStep, *result);
+    return Value(std::move(*result));
+}
+
+void
+DescendantOrSelfAll::selectExpr(const Env& env,
+                                const std::vector<const Node*>& nodeSet,
+                                size_t pos,
+                                bool firstStep,
+                                std::vector<const Node*>& result) const {
+    ScratchNodeSet roots;
+    const std::vector<const Node*>& selves = getSubTreeRoots(nodeSet, *roots);
+    result.insert(result.end(), selves.begin(), selves.end());
+    DescendantAll::selectExpr(env, selves, pos, firstStep, result);
 }
 
 
 DescendantSearch::DescendantSearch(const std::string& s) : Step(s) {
 }
 
+bool
+DescendantSearch::visitExpr(const Env& env,
+                            const Value& val,
+                            size_t pos,
+                            bool firstStep,
+                            const NodeVisitor& f) const {
+    ScratchNodeSet stack;
+    ScratchNodeSet roots;
+    for (const Node* n : getSubTreeRoots(val.getNodeSet(), *roots)) {
+        if (!searchNodes(n, _s, f, *stack)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t
+DescendantSearch::countExpr(const Env& env, const Value& val, size_t pos, bool firstStep) const {
+    // Node::search is faster than visiting when every node is needed.
+    return evalExpr(env, val, pos, firstStep).getNodeSet().size();
+}
+
 Value
 DescendantSearch::evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep) const {
-    const std::vector<const Node*>& nodeSet = val.getNodeSet();
-    std::vector<const Node*> result;
-    for (const Node* n : nodeSet) {
-        n->search(_s, result);
+    ScratchNodeSet result;
+    selectExpr(env, val.getNodeSet(), pos, firstStep, *result);
+    return Value(std::move(*result));
+}
+
+void
+DescendantSearch::selectExpr(const Env& env,
+                             const std::vector<const Node*>& nodeSet,
+                             size_t pos,
+                             bool firstStep,
+                             std::vector<const Node*>& result) const {
+    ScratchNodeSet roots;
+    for (const Node* n : getSubTreeRoots(nodeSet, *roots)) {
+        selectDescendants(env, n, &_s, result);
     }
-    return Value(result);
 }
 
 DescendantOrSelfSearch::DescendantOrSelfSearch(const std::string& s) :
     DescendantSearch(s) {
 }
 
+bool
+DescendantOrSelfSearch::visitExpr(const Env& env,
+                                  const Value& val,
+                                  size_t pos,
+                                  bool firstStep,
+                                  const NodeVisitor& f) const {
+    return Expr::visitExpr(env, val, pos, firstStep, f);
+}
+
 Value
 DescendantOrSelfSearch::evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep) const {
-    const std::vector<const Node*>& nodeSet = val.getNodeSet();
-    std::vector<const Node*> result;
-    for (const Node* n : nodeSet) {
-        result.emplace_back(n);
+    ScratchNodeSet result;
+    selectExpr(env, val.getNodeSet(), pos, firstStep, *result);
+    return Value(std::move(*result));
+}
+
+void
+DescendantOrSelfSearch::selectExpr(const Env& env,
+                                   const std::vector<const Node*>& nodeSet,
+                                   size_t pos,
+                                   bool firstStep,
+                                   std::vector<const Node*>& result) const {
+    ScratchNodeSet roots;
+    const std::vector<const Node*>& selves = getSubTreeRoots(nodeSet, *roots);
+    for (const Node* n : selves) {
+        if (n->getLocalName() == _s) {
+            result.push_back(n);
+        }
     }
-    const Value& d = DescendantSearch::evalExpr(env, val, pos, firstStep);
-    return concatenate(result, d.getNodeSet());
+    DescendantSearch::selectExpr(env, selves, pos, firstStep, result);
 }
 
 // FollowingSibling
@@ -577,10 +1729,15 @@ findPosition(const Node* node, std::vector<const Node*>& children) {
 }
 }
 
+bool
+FollowingSiblingAll::selectsNodeSet() const {
+    return true;
+}
+
 Value
 FollowingSiblingAll::evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep) const {
     const std::vector<const Node*>& nodeSet = val.getNodeSet();
-    std::vector<const Node*> result;
+    ScratchNodeSet result;
     if (!firstStep) {
         // All nodes in this node set must have same parent right!
         pos = 0;
@@ -588,15 +1745,15 @@ FollowingSiblingAll::evalExpr(const Env& env, const Value& val, size_t pos, bool
     const Node* node = nodeSet[pos];
     const Node* parent = node->getParent();
     if (parent == nullptr) {
-        return Value(result);
+        return Value(std::move(*result));
     }
-    std::vector<const Node*> children;
-    parent->getChildren(children);
-    size_t position = findPosition(node, children) + 1; // skip the current node
-    for (size_t i = position, size = children.size(); i < size; i++) {
-        result.emplace_back(children[i]);
+    ScratchNodeSet children;
+    parent->getChildren(*children);
+    size_t position = findPosition(node, *children) + 1; // skip the current node
+    for (size_t i = position, size = children->size(); i < size; i++) {
+        result->emplace_back((*children)[i]);
     }
-    return Value(result);
+    return Value(std::move(*result));
 }
 
 FollowingSiblingSearch::FollowingSiblingSearch(const std::string& s) : Step(s) {
@@ -605,7 +1762,7 @@ FollowingSiblingSearch::FollowingSiblingSearch(const std::string& s) : Step(s) {
 Value
 FollowingSiblingSearch::evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep) const {
     const std::vector<const Node*>& nodeSet = val.getNodeSet();
-    std::vector<const Node*> result;
+    ScratchNodeSet result;
     if (!firstStep) {
         // All nodes in this node set must have same parent right!
         pos = 0;
@@ -613,28 +1770,156 @@ FollowingSiblingSearch::evalExpr(const Env& env, const Value& val, size_t pos, b
     const Node* node = nodeSet[pos];
     const Node* parent = node->getParent();
     if (parent == nullptr) {
-        return Value(result);
+        return Value(std::move(*result));
     }
-    std::vector<const Node*> children;
-    parent->getChildren(children);
-    size_t position = findPosition(node, children) + 1; // skip first node
-    for (size_t i = position, size = children.size(); i < size; i++) {
-        const Node* child = children[i];
+    ScratchNodeSet children;
+    parent->getChildren(*children);
+    size_t position = findPosition(node, *children) + 1; // skip first node
+    for (size_t i = position, size = children->size(); i < size; i++) {
+        const Node* child = (*children)[i];
         if (child->getLocalName() == _s) {
-            result.emplace_back(child);
+            result->emplace_back(child);
         }
     }
-    return Value(result);
+    return Value(std::move(*result));
+}
+
+// Following
+FollowingStep::FollowingStep(const std::string& s) : Step(s) {
+}
+
+Value
+FollowingStep::evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep) const {
+    const std::vector<const Node*>& nodeSet = val.getNodeSet();
+    ScratchNodeSet result;
+    if (pos >= nodeSet.size()) {
+        return Value(std::move(*result));
+    }
+    const DocumentOrder& order = RootNode::getOrder(nodeSet[pos]);
+    // The following nodes of several nodes are the following nodes of the
+    // node whose subtree ends first.
+    size_t begin = order.size();
+    for (size_t i = firstStep ? pos : 0, size = firstStep ? pos + 1 : nodeSet.size(); i < size; i++) {
+        begin = std::min(begin, order.getEnd(order.getPosition(nodeSet[i])) + 1);
+    }
+    if (_s.empty() || _s == "*") {
+        for (size_t i = begin, size = order.size(); i < size; i++) {
+            result->emplace_back(order.getNode(i));
+        }
+    } else {
+        // A name test only visits the nodes with the name.
+        const std::vector<size_t>& positions = order.getPositions(_s);
+        for (std::vector<size_t>::const_iterator i = std::lower_bound(positions.begin(), positions.end(), begin);
+             i != positions.end(); ++i) {
+            result->emplace_back(order.getNode(*i));
+        }
+    }
+    return Value(std::move(*result));
+}
+
+// Preceding
+PrecedingStep::PrecedingStep(const std::string& s) : Step(s) {
+}
+
+Value
+PrecedingStep::evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep) const {
+    const std::vector<const Node*>& nodeSet = val.getNodeSet();
+    ScratchNodeSet result;
+    if (pos >= nodeSet.size()) {
+        return Value(std::move(*result));
+    }
+    const DocumentOrder& order = RootNode::getOrder(nodeSet[pos]);
+    // The preceding nodes of several nodes are the preceding nodes of the
+    // last one.
+    size_t last = 0;
+    for (size_t i = firstStep ? pos : 0, size = firstStep ? pos + 1 : nodeSet.size(); i < size; i++) {
+        last = std::max(last, order.getPosition(nodeSet[i]));
+    }
+    // A node before last is an ancestor of last if its subtree contains last.
+    if (_s.empty() || _s == "*") {
+        for (size_t i = last; i-- > 0; ) {
+            if (order.getEnd(i) < last) {
+                result->emplace_back(order.getNode(i));
+            }
+        }
+    } else {
+        // A name test only visits the nodes with the name.
+        const std::vector<size_t>& positions = order.getPositions(_s);
+        for (std::vector<size_t>::const_iterator i = std::lower_bound(positions.begin(), positions.end(), last);
+             i != positions.begin(); ) {
+            --i;
+            if (order.getEnd(*i) < last) {
+                result->emplace_back(order.getNode(*i));
+            }
+        }
+    }
+    return Value(std::move(*result));
+}
+
+// PrecedingSibling
+PrecedingSiblingStep::PrecedingSiblingStep(const std::string& s) : Step(s) {
+}
+
+Value
+PrecedingSiblingStep::evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep) const {
+    const std::vector<const Node*>& nodeSet = val.getNodeSet();
+    ScratchNodeSet result;
+    if (pos >= nodeSet.size()) {
+        return Value(std::move(*result));
+    }
+    const DocumentOrder& order = RootNode::getOrder(nodeSet[pos]);
+    // The last context node of each parent, the parents in the order they
+    // are found.
+    std::vector<size_t> lasts;
+    std::unordered_map<const Node*, size_t> parents;
+    for (size_t i = firstStep ? pos : 0, size = firstStep ? pos + 1 : nodeSet.size(); i < size; i++) {
+        const Node* parent = nodeSet[i]->getParent();
+        if (parent == nullptr) {
+            continue;
+        }
+        size_t position = order.getPosition(nodeSet[i]);
+        std::pair<std::unordered_map<const Node*, size_t>::iterator, bool> added =
+            parents.emplace(parent, lasts.size());
+        if (added.second) {
+            lasts.push_back(position);
+        } else {
+            lasts[added.first->second] = std::max(lasts[added.first->second], position);
+        }
+    }
+    for (size_t last : lasts) {
+        for (size_t i = order.getPreviousSibling(last); i != DocumentOrder::npos; i = order.getPreviousSibling(i)) {
+            const Node* n = order.getNode(i);
+            if (checkLocalName(n, _s)) {
+                result->emplace_back(n);
+            }
+        }
+    }
+    return Value(std::move(*result));
 }
 
 // Literals
-StringLiteral::StringLiteral(const std::string& l) : StrExpr(l) {}
+StringLiteral::StringLiteral(const std::string& l) : _s(std::make_shared<const std::string>(l)) {}
 
 Value
 StringLiteral::evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep) const {
   return Value(_s);
 }
 
+void
+StringLiteral::print(std::ostream& os) const {
+    os << getName() << " '" << *_s << "'";
+}
+
+bool
+StringLiteral::isConstant() const {
+    return getPredicates() == nullptr;
+}
+
+const std::string&
+StringLiteral::getString() const {
+    return *_s;
+}
+
 NumericLiteral::NumericLiteral(double d) : _d(d) {}
 
 Value
@@ -642,6 +1927,58 @@ NumericLiteral::evalExpr(const Env& e, const Value& d, size_t pos, bool firstSte
     return Value(_d);
 }
 
+void
+NumericLiteral::print(std::ostream& os) const {
+    os << getName() << " " << Value(_d).getString();
+}
+
+bool
+NumericLiteral::isConstant() const {
+    return getPredicates() == nullptr;
+}
+
+double
+NumericLiteral::getNumber() const {
+    return _d;
+}
+
+BooleanLiteral::BooleanLiteral(bool b) : _b(b) {}
+
+Value
+BooleanLiteral::evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep) const {
+    return Value(_b);
+}
+
+void
+BooleanLiteral::print(std::ostream& os) const {
+    os << getName() << " " << (_b ? "true" : "false");
+}
+
+bool
+BooleanLiteral::isConstant() const {
+    return getPredicates() == nullptr;
+}
+
+bool
+BooleanLiteral::getBoolean() const {
+    return _b;
+}
+
+Value
+EmptyNodeSet::evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep) const {
+    return Value();
+}
+
+bool
+EmptyNodeSet::isContextIndependent() const {
+    return true;
+}
+
+bool
+EmptyNodeSet::selectsNodeSet() const {
+    return true;
+}
+
 // Union
 Union::Union(const Expr* l, const Expr* r) : BinaryExpr(l, r) {}
 
@@ -657,9 +1994,10 @@ Or::Or(const Expr* l, const Expr* r) : BinaryExpr(l, r) {}
 
 Value
 Or::evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep) const {
-    Value l = _l->eval(e, d, pos);
-    Value r = _r->eval(e, d, pos);
-    return Value(l.getBoolean() || r.getBoolean());
+    if (_l->eval(e, d, pos).getBoolean()) {
+        return Value(true);
+    }
+    return Value(_r->eval(e, d, pos).getBoolean());
 }
 
 // And
@@ -667,9 +2005,10 @@ And::And(const Expr* l, const Expr* r) : BinaryExpr(l, r) {}
 
 Value
 And::evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep) const {
-    Value l = _l->eval(e, d, pos);
-    Value r = _r->eval(e, d, pos);
-    return Value(l.getBoolean() && r.getBoolean());
+    if (!_l->eval(e, d, pos).getBoolean()) {
+        return Value(false);
+    }
+    return Value(_r->eval(e, d, pos).getBoolean());
 }
 
 // Eq
@@ -789,11 +2128,264 @@ Mod::evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep) const {
 }
 
 // VarRef
-VarRef::VarRef(const std::string& s) : StrExpr(s) {}
+VarRef::VarRef(const std::string& s) : StrExpr(s), _slot(0) {}
 
 Value
 VarRef::evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep) const {
-    return e.getVariable(_s);
+    EvalCache* cache = EvalCache::getCurrent();
+    const Value* value = cache == nullptr ? nullptr : cache->getVariable(_slot);
+    return value != nullptr ? *value : e.getVariable(_s);
+}
+
+void
+VarRef::print(std::ostream& os) const {
+    os << getName() << " $" << _s;
+}
+
+bool
+VarRef::isContextIndependent() const {
+    return true;
+}
+
+void
+VarRef::setSlot(size_t slot) {
+    _slot = slot;
+}
+
+size_t
+VarRef::getSlot() const {
+    return _slot;
+}
+
+// EvalCache
+EvalCache::EvalCache(const Bindings* bindings) : _bindings(bindings), _previous(currentCache) {
+    currentCache = this;
+}
+
+EvalCache::~EvalCache() {
+    currentCache = _previous;
+}
+
+EvalCache*
+EvalCache::getCurrent() {
+    return currentCache;
+}
+
+const Value*
+EvalCache::get(size_t slot) const {
+    return slot < _set.size() && _set[slot] ? &_values[slot] : nullptr;
+}
+
+void
+EvalCache::set(size_t slot, const Value& value) {
+    if (slot >= _set.size()) {
+        _values.resize(slot + 1);
+        _set.resize(slot + 1, false);
+    }
+    _values[slot] = value;
+    _set[slot] = true;
+}
+
+const Value*
+EvalCache::get(const Expr* e, const Node* node) const {
+    std::map<std::pair<const Expr*, const Node*>, Value>::const_iterator i =
+        _nodeValues.find(std::make_pair(e, node));
+    return i == _nodeValues.end() ? nullptr : &i->second;
+}
+
+void
+EvalCache::set(const Expr* e, const Node* node, const Value& value) {
+    _nodeValues[std::make_pair(e, node)] = value;
+}
+
+const Value*
+EvalCache::getVariable(size_t slot) const {
+    return _bindings == nullptr ? nullptr : _bindings->get(slot);
+}
+
+// Budget
+Budget::Budget(const Env& env, size_t slice, std::function<void()> yield) :
+    _maxNodes(env.getMaxNodes()),
+    _maxNodeSetSize(env.getMaxNodeSetSize()),
+    _timed(env.getTimeout().count() > 0),
+    _deadline(std::chrono::steady_clock::now() + env.getTimeout()),
+    _slice(slice),
+    _yield(std::move(yield)),
+    _used(0),
+    _current(_maxNodes > 0 || _maxNodeSetSize > 0 || _timed || _slice > 0),
+    _previous(currentBudget) {
+    if (_current) {
+        currentBudget = this;
+    }
+}
+
+Budget::~Budget() {
+    if (_current) {
+        currentBudget = _previous;
+    }
+}
+
+Budget*
+Budget::getCurrent() {
+    return currentBudget;
+}
+
+Budget::Scope::Scope(Budget* budget) : _previous(currentBudget) {
+    currentBudget = budget;
+}
+
+Budget::Scope::~Scope() {
+    currentBudget = _previous;
+}
+
+void
+Budget::visit(const Value& v) {
+    if (currentBudget != nullptr && v.getType() == Value::NodeSet) {
+        visitNodeSet(v.getNodeSet().size());
+    }
+}
+
+void
+Budget::visitNodeSet(size_t size) {
+    if (currentBudget != nullptr) {
+        // Evaluating empty node sets is not free.
+        currentBudget->add(size, size + 1);
+    }
+}
+
+void
+Budget::visit(size_t nodes) {
+    if (currentBudget != nullptr) {
+        currentBudget->add(0, nodes);
+    }
+}
+
+bool
+Budget::isResumable() const {
+    return _slice > 0;
+}
+
+void
+Budget::add(size_t nodeSetSize, size_t cost) {
+    if (_maxNodeSetSize > 0 && nodeSetSize > _maxNodeSetSize) {
+        throw BudgetExceeded(BudgetExceeded::NodeSetSize,
+                             "Budget::add, node set size limit exceeded: " + std::to_string(nodeSetSize));
+    }
+    size_t used = _used.fetch_add(cost, std::memory_order_relaxed) + cost;
+    if (_maxNodes > 0 && used > _maxNodes) {
+        throw BudgetExceeded(BudgetExceeded::Nodes,
+                             "Budget::add, node limit exceeded: " + std::to_string(used));
+    }
+    // Reading the clock costs more than counting, it is read when the cost
+    // passes a multiple of 1024.
+    if (_timed && (used >> 10) != ((used - cost) >> 10) &&
+        std::chrono::steady_clock::now() > _deadline) {
+        throw BudgetExceeded(BudgetExceeded::Time, "Budget::add, time limit exceeded.");
+    }
+    if (_slice > 0 && used / _slice != (used - cost) / _slice) {
+        _yield();
+    }
+}
+
+// EvalState
+EvalState
+EvalState::exchange(const EvalState& state) {
+    EvalState previous{currentCache, currentBudget};
+    currentCache = state.cache;
+    currentBudget = state.budget;
+    return previous;
+}
+
+// Cached
+Cached::Cached(const Expr* e, size_t slot) : _e(e), _slot(slot) {}
+
+Value
+Cached::evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep) const {
+    EvalCache* cache = EvalCache::getCurrent();
+    if (cache == nullptr) {
+        return _e->eval(e, d, pos, firstStep);
+    }
+    const Value* value = cache->get(_slot);
+    if (value != nullptr) {
+        return *value;
+    }
+    Value result = _e->eval(e, d, pos, firstStep);
+    cache->set(_slot, result);
+    return result;
+}
+
+void
+Cached::print(std::ostream& os) const {
+    os << getName() << " " << _slot;
+}
+
+bool
+Cached::isContextIndependent() const {
+    return true;
+}
+
+void
+Cached::getChildren(std::vector<const Expr*>& children) const {
+    children.push_back(_e.get());
+}
+
+void
+Cached::rewriteChildren(const Rewrite& f) {
+    Expr::rewriteChildren(f);
+    _e.reset(f(const_cast<Expr*>(_e.release())));
+}
+
+size_t
+Cached::getSlot() const {
+    return _slot;
+}
+
+// MemoizedPath
+MemoizedPath::MemoizedPath(const Expr* e, size_t depth) : _e(e), _depth(depth) {}
+
+Value
+MemoizedPath::evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep) const {
+    EvalCache* cache = EvalCache::getCurrent();
+    if (cache == nullptr ||
+        d.getType() != Value::NodeSet ||
+        pos >= d.getNodeSet().size()) {
+        return _e->eval(e, d, pos, firstStep);
+    }
+    const Node* ancestor = d.getNodeSet()[pos];
+    for (size_t i = 0; i < _depth && ancestor != nullptr; i++) {
+        ancestor = ancestor->getParent();
+    }
+    if (ancestor == nullptr) {
+        return _e->eval(e, d, pos, firstStep);
+    }
+    const Value* value = cache->get(this, ancestor);
+    if (value != nullptr) {
+        return *value;
+    }
+    Value result = _e->eval(e, d, pos, firstStep);
+    cache->set(this, ancestor, result);
+    return result;
+}
+
+void
+MemoizedPath::print(std::ostream& os) const {
+    os << getName() << " " << _depth;
+}
+
+void
+MemoizedPath::getChildren(std::vector<const Expr*>& children) const {
+    children.push_back(_e.get());
+}
+
+void
+MemoizedPath::rewriteChildren(const Rewrite& f) {
+    Expr::rewriteChildren(f);
+    _e.reset(f(const_cast<Expr*>(_e.release())));
+}
+
+size_t
+MemoizedPath::getDepth() const {
+    return _depth;
 }
 
 }
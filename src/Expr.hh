@@ -25,13 +25,35 @@
 
 #include <memory>
 #include <list>
+#include <vector>
+#include <ostream>
+#include <functional>
+#include <map>
+#include <atomic>
+#include <chrono>
 #include <stdexcept>
 
 #include <Jstr.hh>
 
+#include "Simd.hh"
+
 namespace Jstr {
 namespace Xpath {
 
+class Expr;
+
+/**
+ * Rewrites an expression. The rewrite takes ownership of the expression it is
+ * given and returns the expression to use in its place.
+ */
+using Rewrite = std::function<Expr*(Expr*)>;
+
+/**
+ * Called for each node of a node set that is streamed instead of built.
+ * Returns false to stop the stream.
+ */
+using NodeVisitor = std::function<bool(const Node*)>;
+
 class Expr {
 public:
     Expr();
@@ -41,17 +63,111 @@ public:
                            const Value& val,
                            size_t pos,
                            bool firstStep = false) const = 0;
+    /**
+     * Calls f for each node eval selects, without building the node set when
+     * the expression can stream it. Only valid if selectsNodeSet is true.
+     * @param f the visitor.
+     * @return false if f stopped the stream.
+     */
+    bool visit(const Env& env,
+               const Value& val,
+               size_t pos,
+               bool firstStep,
+               const NodeVisitor& f) const;
+    /**
+     * Same as visit but for evalExpr, the predicates are not applied. The
+     * default evaluates the expression and visits the result.
+     */
+    virtual bool visitExpr(const Env& env,
+                           const Value& val,
+                           size_t pos,
+                           bool firstStep,
+                           const NodeVisitor& f) const;
+    /**
+     * Returns the number of nodes eval selects, without creating them when
+     * the expression can count them. Only valid if selectsNodeSet is true.
+     * @return the number of nodes.
+     */
+    size_t count(const Env& env, const Value& val, size_t pos, bool firstStep) const;
+    /**
+     * Same as count but for evalExpr, the predicates are not applied.
+     */
+    virtual size_t countExpr(const Env& env, const Value& val, size_t pos, bool firstStep) const;
+    /**
+     * Same as evalExpr for steps, the context and the result are node sets
+     * the caller keeps instead of values. The default evaluates the
+     * expression.
+     * @param nodeSet the context node set.
+     * @param result the selected nodes, empty when called.
+     */
+    virtual void selectExpr(const Env& env,
+                            const std::vector<const Node*>& nodeSet,
+                            size_t pos,
+                            bool firstStep,
+                            std::vector<const Node*>& result) const;
+    /**
+     * Returns an indication if the expression always evaluates to a node set.
+     * @return true for paths that end with a step.
+     */
+    virtual bool selectsNodeSet() const;
     void addPredicates(const std::list<const Expr*>* preds);
     const std::list<const Expr*>* takePredicates();
+    const std::list<const Expr*>* getPredicates() const;
+    /**
+     * Returns the name of the expression type, used when printing trees.
+     * @return the name.
+     */
+    virtual const char* getName() const = 0;
+    /**
+     * Prints the name of this expression and its own arguments (not children).
+     * @param os the stream to print to.
+     */
+    virtual void print(std::ostream& os) const;
+    /**
+     * Returns an indication if the expression has the same value in any context.
+     * @return true if the expression does not depend on the context.
+     */
+    virtual bool isConstant() const;
+    /**
+     * Returns an indication if the expression only depends on the environment,
+     * e.g. absolute paths, literals and variables. Such expressions have the
+     * same value for each node a predicate is evaluated for.
+     * @return true if the expression does not depend on the context node.
+     */
+    virtual bool isContextIndependent() const;
+    /**
+     * Adds the sub expressions of this expression, predicates not included.
+     * @param children the result.
+     */
+    virtual void getChildren(std::vector<const Expr*>& children) const;
+    /**
+     * Replaces each sub expression, predicates included, with the result of f.
+     * Only used while the tree is built, before it is shared.
+     * @param f the rewrite.
+     */
+    virtual void rewriteChildren(const Rewrite& f);
 private:
     Value evalFilter(const Env& e, const Value& val) const;
+    bool visitFiltered(const Env& env,
+                       const Value& val,
+                       size_t pos,
+                       bool firstStep,
+                       const NodeVisitor& f) const;
     const std::list<const Expr*>* _preds;
 
 };
 
-class BinaryExpr {
+class BinaryExpr : public Expr {
 public:
     BinaryExpr(const Expr* l, const Expr* r);
+    bool isConstant() const override;
+    bool isContextIndependent() const override;
+    void getChildren(std::vector<const Expr*>& children) const override;
+    void rewriteChildren(const Rewrite& f) override;
+    /**
+     * Swaps the left and right operand, only valid for commutative operators.
+     */
+    void swapOperands();
 protected:
     std::unique_ptr<const Expr> _l;
     std::unique_ptr<const Expr> _r;
@@ -79,18 +195,36 @@ protected:
 class Path : public Expr, public MultiExpr {
 public:
     Path(Expr* e);
+    /**
+     * Adds "//" in front of the steps.
+     */
+    void addDescendantFront();
+    /**
+     * Adds "//" and a step after the steps.
+     * @param step the step.
+     */
+    void addDescendantBack(Expr* step);
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override;
-    void addAbsoluteDescendant();
-    void addRelativeDescendant(Expr* Step);
-    void addRelativeDescendant();
-private:
-    Expr* createDescendant();
+    const char* getName() const override { return "Path"; }
+    bool isContextIndependent() const override;
+    bool visitExpr(const Env& env,
+                   const Value& val,
+                   size_t pos,
+                   bool firstStep,
+                   const NodeVisitor& f) const override;
+    size_t countExpr(const Env& env, const Value& val, size_t pos, bool firstStep) const override;
+    bool selectsNodeSet() const override;
+    void getChildren(std::vector<const Expr*>& children) const override;
+    void rewriteChildren(const Rewrite& f) override;
 };
 
 class Root : public Expr {
 public:
     Root() = default;
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "Root"; }
+    bool isContextIndependent() const override;
+    bool selectsNodeSet() const override;
 };
 
 /**
@@ -104,99 +238,356 @@ public:
     // TODO make this better
     static bool isAllStep(const Expr* step);
     static bool isSelfOrParentStep(const Expr* step);
-protected:
+    /**
+     * Merges "//" with the step after it, e.g. "//x" is a search for x.
+     * @param step the step, deleted if it is merged.
+     * @return the step that selects the same nodes as descendant-or-self
+     * followed by step, nullptr if there is none.
+     */
+    static Expr* createDescendant(Expr* step);
+    void print(std::ostream& os) const override;
+    bool selectsNodeSet() const override;
 };
     
 class AllStep : public Expr {
 public:
     AllStep() = default;
     Value evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "AllStep"; }
+    void selectExpr(const Env& env,
+                    const std::vector<const Node*>& nodeSet,
+                    size_t pos,
+                    bool firstStep,
+                    std::vector<const Node*>& result) const override;
+    bool selectsNodeSet() const override;
 };
 
 class AncestorStep : public Step {
 public:
     AncestorStep(const std::string& s);
     Value evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "AncestorStep"; }
 };
 
 class AncestorSelfStep : public AncestorStep {
 public:
     AncestorSelfStep(const std::string& s);
     Value evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "AncestorSelfStep"; }
 };
 
 class ChildStep : public Step {
 public:
     ChildStep(const std::string& s);
     Value evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "ChildStep"; }
+    void selectExpr(const Env& env,
+                    const std::vector<const Node*>& nodeSet,
+                    size_t pos,
+                    bool firstStep,
+                    std::vector<const Node*>& result) const override;
+    bool visitExpr(const Env& env,
+                   const Value& val,
+                   size_t pos,
+                   bool firstStep,
+                   const NodeVisitor& f) const override;
+    size_t countExpr(const Env& env, const Value& val, size_t pos, bool firstStep) const override;
 };
 
 class ParentStep : public Expr {
 public:
     ParentStep() = default;
     Value evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "ParentStep"; }
+    void selectExpr(const Env& env,
+                    const std::vector<const Node*>& nodeSet,
+                    size_t pos,
+                    bool firstStep,
+                    std::vector<const Node*>& result) const override;
+    bool selectsNodeSet() const override;
 };
     
 class ParentMatchStep : public Step {
 public:
     ParentMatchStep(const std::string& s);
     Value evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "ParentMatchStep"; }
 };
 
 class SelfStep : public Expr {
 public:
     SelfStep() = default;
     Value evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "SelfStep"; }
+    void selectExpr(const Env& env,
+                    const std::vector<const Node*>& nodeSet,
+                    size_t pos,
+                    bool firstStep,
+                    std::vector<const Node*>& result) const override;
 };
 
 class SelfMatchStep : public Step {
 public:
     SelfMatchStep(const std::string& s);
     Value evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "SelfMatchStep"; }
 };
     
 class Predicate : public Expr {
 public:
     Predicate(const Expr* e);
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "Predicate"; }
+    void getChildren(std::vector<const Expr*>& children) const override;
+    void rewriteChildren(const Rewrite& f) override;
+    const Expr* getExpr() const;
 private:
     std::unique_ptr<const Expr> _e; 
 };
 
-class DescendantAll : public Expr { 
+/**
+ * A predicate that selects by position, "[n]" or "[last()]". Node sets are
+ * filtered by index instead of evaluating the predicate for each node.
+ */
+class PositionPredicate : public Expr {
+public:
+    PositionPredicate(double position, bool last);
+    Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "PositionPredicate"; }
+    void print(std::ostream& os) const override;
+    /**
+     * Returns the index of the selected node.
+     * @param size the size of the node set.
+     * @param index the result.
+     * @return false if no node is selected.
+     */
+    bool getIndex(size_t size, size_t& index) const;
+    double getPosition() const;
+    bool isLast() const;
+private:
+    double _position;
+    bool _last;
+};
+
+/**
+ * A predicate that compares the context node, or its children with a name,
+ * with a number, e.g. "[. < 2]" or "[price >= 10]". Node sets are filtered
+ * all at once, the numbers of the nodes are gathered into an array and
+ * compared by compareEach.
+ */
+class ComparePredicate : public Expr {
+public:
+    /**
+     * @param p the predicate, evaluated for single nodes.
+     * @param comparison the comparison, the node is the left operand.
+     * @param name the name of the children to compare, empty for the node.
+     * @param d the number.
+     */
+    ComparePredicate(const Predicate* p, Comparison comparison, const std::string& name, double d);
+    Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "ComparePredicate"; }
+    void print(std::ostream& os) const override;
+    void getChildren(std::vector<const Expr*>& children) const override;
+    /**
+     * Adds the nodes the predicate is true for to result, in order.
+     * @param nodeSet the nodes to filter.
+     * @param result the result.
+     */
+    void select(const std::vector<const Node*>& nodeSet, std::vector<const Node*>& result) const;
+    /**
+     * Returns an indication if the predicate is true for one node.
+     * @param n the node.
+     * @return true if n is selected.
+     */
+    bool test(const Node* n) const;
+    Comparison getComparison() const;
+    const std::string& getChildName() const;
+    double getNumber() const;
+private:
+    double getNumber(const Node* n, std::string& buffer) const;
+    std::unique_ptr<const Predicate> _p;
+    Comparison _comparison;
+    std::string _name;
+    double _d;
+};
+
+/**
+ * A child step with a position predicate, e.g. "b[3]". Only the selected
+ * child is created.
+ */
+class ChildIndexStep : public Step {
+public:
+    ChildIndexStep(const std::string& s, const PositionPredicate* position);
+    Value evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "ChildIndexStep"; }
+    void selectExpr(const Env& env,
+                    const std::vector<const Node*>& nodeSet,
+                    size_t pos,
+                    bool firstStep,
+                    std::vector<const Node*>& result) const override;
+    void print(std::ostream& os) const override;
+    const PositionPredicate* getPosition() const;
+private:
+    std::unique_ptr<const PositionPredicate> _position;
+};
+
+/**
+ * Consecutive child steps, e.g. "b/c/d" in "/a/b/c/d", evaluated as one step.
+ * The steps in between share two scratch node sets instead of each creating a
+ * value.
+ */
+class ChildPath : public Expr {
+public:
+    /**
+     * @param names the names of the steps, an empty name is a "*" step.
+     */
+    ChildPath(const std::vector<std::string>& names);
+    Value evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "ChildPath"; }
+    void selectExpr(const Env& env,
+                    const std::vector<const Node*>& nodeSet,
+                    size_t pos,
+                    bool firstStep,
+                    std::vector<const Node*>& result) const override;
+    void print(std::ostream& os) const override;
+    bool visitExpr(const Env& env,
+                   const Value& val,
+                   size_t pos,
+                   bool firstStep,
+                   const NodeVisitor& f) const override;
+    size_t countExpr(const Env& env, const Value& val, size_t pos, bool firstStep) const override;
+    bool selectsNodeSet() const override;
+    const std::vector<std::string>& getNames() const;
+private:
+    /**
+     * Selects the nodes of the first steps.
+     * @param levels the number of steps.
+     * @param result the selected nodes.
+     */
+    void select(const std::vector<const Node*>& nodeSet,
+                size_t pos,
+                bool firstStep,
+                size_t levels,
+                std::vector<const Node*>& result) const;
+    std::vector<std::string> _names;
+};
+
+class DescendantAll : public Expr {
 public:
     DescendantAll();
     Value evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "DescendantAll"; }
+    void selectExpr(const Env& env,
+                    const std::vector<const Node*>& nodeSet,
+                    size_t pos,
+                    bool firstStep,
+                    std::vector<const Node*>& result) const override;
+    bool visitExpr(const Env& env,
+                   const Value& val,
+                   size_t pos,
+                   bool firstStep,
+                   const NodeVisitor& f) const override;
+    bool selectsNodeSet() const override;
 };
 
 class DescendantOrSelfAll : public DescendantAll {
 public:
     DescendantOrSelfAll();
     Value evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "DescendantOrSelfAll"; }
+    void selectExpr(const Env& env,
+                    const std::vector<const Node*>& nodeSet,
+                    size_t pos,
+                    bool firstStep,
+                    std::vector<const Node*>& result) const override;
+    bool visitExpr(const Env& env,
+                   const Value& val,
+                   size_t pos,
+                   bool firstStep,
+                   const NodeVisitor& f) const override;
 };
 
 class DescendantSearch : public Step {
 public:
     DescendantSearch(const std::string& s);
     Value evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "DescendantSearch"; }
+    void selectExpr(const Env& env,
+                    const std::vector<const Node*>& nodeSet,
+                    size_t pos,
+                    bool firstStep,
+                    std::vector<const Node*>& result) const override;
+    bool visitExpr(const Env& env,
+                   const Value& val,
+                   size_t pos,
+                   bool firstStep,
+                   const NodeVisitor& f) const override;
+    size_t countExpr(const Env& env, const Value& val, size_t pos, bool firstStep) const override;
 };
 
 class DescendantOrSelfSearch : public DescendantSearch {
 public:
     DescendantOrSelfSearch(const std::string& s);
     Value evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "DescendantOrSelfSearch"; }
+    void selectExpr(const Env& env,
+                    const std::vector<const Node*>& nodeSet,
+                    size_t pos,
+                    bool firstStep,
+                    std::vector<const Node*>& result) const override;
+    bool visitExpr(const Env& env,
+                   const Value& val,
+                   size_t pos,
+                   bool firstStep,
+                   const NodeVisitor& f) const override;
 };
 
 class FollowingSiblingAll : public Expr {
 public:
     FollowingSiblingAll() = default;
     Value evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "FollowingSiblingAll"; }
+    bool selectsNodeSet() const override;
 };
 
 class FollowingSiblingSearch : public Step {
 public:
     FollowingSiblingSearch(const std::string& s);
     Value evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "FollowingSiblingSearch"; }
+};
+
+/**
+ * The nodes after the context nodes in document order, their descendants
+ * excluded, in document order.
+ */
+class FollowingStep : public Step {
+public:
+    FollowingStep(const std::string& s);
+    Value evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "FollowingStep"; }
+};
+
+/**
+ * The nodes before the context nodes in document order, their ancestors
+ * excluded. Like the ancestor axis the nearest node comes first, positions
+ * count backwards.
+ */
+class PrecedingStep : public Step {
+public:
+    PrecedingStep(const std::string& s);
+    Value evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "PrecedingStep"; }
+};
+
+/**
+ * The siblings before the context nodes, the nearest sibling first.
+ */
+class PrecedingSiblingStep : public Step {
+public:
+    PrecedingSiblingStep(const std::string& s);
+    Value evalExpr(const Env& env, const Value& val, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "PrecedingSiblingStep"; }
 };
 
 class Parent : public Expr {
@@ -204,114 +595,355 @@ public:
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override;
 };
 
-class StringLiteral : public Expr, StrExpr {
+class StringLiteral : public Expr {
 public:
     StringLiteral(const std::string& l);
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "StringLiteral"; }
+    void print(std::ostream& os) const override;
+    bool isConstant() const override;
+    const std::string& getString() const;
+private:
+    // Shared with every value the literal evaluates to.
+    std::shared_ptr<const std::string> _s;
 };
 
 class NumericLiteral : public Expr {
 public:
     NumericLiteral(double d);
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "NumericLiteral"; }
+    void print(std::ostream& os) const override;
+    bool isConstant() const override;
+    double getNumber() const;
 private:
     double _d;
 };
 
+/**
+ * The result of folding a boolean expression, xpath has no boolean literals.
+ */
+class BooleanLiteral : public Expr {
+public:
+    BooleanLiteral(bool b);
+    Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "BooleanLiteral"; }
+    void print(std::ostream& os) const override;
+    bool isConstant() const override;
+    bool getBoolean() const;
+private:
+    bool _b;
+};
+
+/**
+ * An expression known to select nothing, e.g. a step with a predicate that is
+ * always false.
+ */
+class EmptyNodeSet : public Expr {
+public:
+    EmptyNodeSet() = default;
+    Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "EmptyNodeSet"; }
+    bool isContextIndependent() const override;
+    bool selectsNodeSet() const override;
+};
+
 class Args : public Expr, public MultiExpr { // TODO move to functions
 public:
     Args(const Expr* e);
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override;
 };
 
-class Union : public Expr, BinaryExpr {
+class Union : public BinaryExpr {
 public:
     Union(const Expr* l, const Expr* r);
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "Union"; }
 };
   
-class Or : public Expr, BinaryExpr {
+class Or : public BinaryExpr {
 public:
     Or(const Expr* l, const Expr* r);
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "Or"; }
 };
 
-class And : public Expr, BinaryExpr {
+class And : public BinaryExpr {
 public:
     And(const Expr* l, const Expr* r);
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "And"; }
 };
 
-class Eq : public Expr, BinaryExpr {
+class Eq : public BinaryExpr {
 public:
     Eq(const Expr* l, const Expr* r);
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "Eq"; }
 };
 
-class Ne : public Expr, BinaryExpr {
+class Ne : public BinaryExpr {
 public:
     Ne(const Expr* l, const Expr* r);
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "Ne"; }
 };
 
-class Lt : public Expr, BinaryExpr {
+class Lt : public BinaryExpr {
 public:
     Lt(const Expr* l, const Expr* r);
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "Lt"; }
 };
 
-class Gt : public Expr, BinaryExpr {
+class Gt : public BinaryExpr {
 public:
     Gt(const Expr* l, const Expr* r);
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "Gt"; }
 };
 
-class Le : public Expr, BinaryExpr {
+class Le : public BinaryExpr {
 public:
     Le(const Expr* l, const Expr* r);
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "Le"; }
 };
 
-class Ge : public Expr, BinaryExpr {
+class Ge : public BinaryExpr {
 public:
     Ge(const Expr* l, const Expr* r);
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "Ge"; }
 };
 
-class Plus : public Expr, BinaryExpr {
+class Plus : public BinaryExpr {
 public:
     Plus(const Expr* l, const Expr* r);
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "Plus"; }
 };
 
-class Minus : public Expr, BinaryExpr {
+class Minus : public BinaryExpr {
 public:
     Minus(const Expr* l, const Expr* r);
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "Minus"; }
 };
 
-class Mul : public Expr, BinaryExpr {
+class Mul : public BinaryExpr {
 public:
     Mul(const Expr* l, const Expr* r);
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "Mul"; }
 };
 
-class Div : public Expr, BinaryExpr {
+class Div : public BinaryExpr {
 public:
     Div(const Expr* l, const Expr* r);
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "Div"; }
 };
 
-class Mod : public Expr, BinaryExpr {
+class Mod : public BinaryExpr {
 public:
     Mod(const Expr* l, const Expr* r);
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "Mod"; }
 };
 
-class VarRef : public Expr, StrExpr {
+/**
+ * A variable reference. The value is taken from the bindings of the
+ * evaluation by slot, or looked up by name in the environment if the slot is
+ * not bound.
+ */
+class VarRef : public Expr, public StrExpr {
 public:
     VarRef(const std::string& s);
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "VarRef"; }
+    void print(std::ostream& os) const override;
+    bool isContextIndependent() const override;
+    /**
+     * Sets the slot, assigned when the expression is created.
+     * @param slot the index of the name in Expression::getVariables.
+     */
+    void setSlot(size_t slot);
+    size_t getSlot() const;
+private:
+    size_t _slot;
+};
+
+/**
+ * Values of context independent expressions computed during one evaluation of
+ * an expression. The cache is made current for the thread while it exists.
+ */
+class EvalCache {
+public:
+    /**
+     * @param bindings the values of the variables, nullptr if there are none.
+     */
+    EvalCache(const Bindings* bindings = nullptr);
+    EvalCache(const EvalCache&) = delete;
+    EvalCache& operator=(const EvalCache&) = delete;
+    ~EvalCache();
+    /**
+     * Returns the innermost cache of the calling thread.
+     * @return the cache or nullptr if no expression is evaluated.
+     */
+    static EvalCache* getCurrent();
+    /**
+     * Returns a cached value.
+     * @param slot the slot of the value.
+     * @return the value or nullptr if it is not computed yet.
+     */
+    const Value* get(size_t slot) const;
+    void set(size_t slot, const Value& value);
+    /**
+     * Returns a value cached for a node.
+     * @param e the expression the value belongs to.
+     * @param node the node the value depends on.
+     * @return the value or nullptr if it is not computed yet.
+     */
+    const Value* get(const Expr* e, const Node* node) const;
+    void set(const Expr* e, const Node* node, const Value& value);
+    /**
+     * Returns the value bound to a variable.
+     * @param slot the slot of the variable.
+     * @return the value or nullptr if it is not bound.
+     */
+    const Value* getVariable(size_t slot) const;
+private:
+    const Bindings* _bindings;
+    std::vector<Value> _values;
+    std::vector<bool> _set;
+    std::map<std::pair<const Expr*, const Node*>, Value> _nodeValues;
+    EvalCache* _previous;
+};
+
+/**
+ * The work done by one evaluation, checked against the budget of the
+ * environment. The budget is made current for the thread while it exists if
+ * the environment has a limit or the evaluation is resumable, threads that
+ * help the evaluation share it.
+ */
+class Budget {
+public:
+    /**
+     * @param env the environment with the limits.
+     * @param slice the work after which yield is called, 0 if the evaluation
+     * is not resumable.
+     * @param yield suspends the evaluation, it may throw to abandon it.
+     */
+    Budget(const Env& env, size_t slice = 0, std::function<void()> yield = nullptr);
+    Budget(const Budget&) = delete;
+    Budget& operator=(const Budget&) = delete;
+    ~Budget();
+    /**
+     * Returns the budget of the evaluation the thread takes part in.
+     * @return the budget or nullptr if there is no limit.
+     */
+    static Budget* getCurrent();
+    /**
+     * Makes a budget current for the thread while it exists.
+     */
+    class Scope {
+    public:
+        Scope(Budget* budget);
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+        ~Scope();
+    private:
+        Budget* _previous;
+    };
+    /**
+     * Counts the nodes of a node set against the current budget, if any. A
+     * node set costs one more than its size.
+     * @param v the value, other types than node sets are free.
+     * @throws BudgetExceeded if a limit is exceeded.
+     */
+    static void visit(const Value& v);
+    /**
+     * Same as above for a node set of a size, counted without being built.
+     */
+    static void visitNodeSet(size_t size);
+    /**
+     * Counts visited nodes that are not collected in a node set against the
+     * current budget, if any.
+     * @param nodes the number of nodes.
+     * @throws BudgetExceeded if a limit is exceeded.
+     */
+    static void visit(size_t nodes);
+    /**
+     * Returns an indication if the evaluation yields, it then runs on one
+     * thread.
+     */
+    bool isResumable() const;
+private:
+    void add(size_t nodeSetSize, size_t cost);
+    const size_t _maxNodes;
+    const size_t _maxNodeSetSize;
+    const bool _timed;
+    const std::chrono::steady_clock::time_point _deadline;
+    const size_t _slice;
+    const std::function<void()> _yield;
+    std::atomic<size_t> _used;
+    bool _current;
+    Budget* _previous;
+};
+
+/**
+ * The evaluation state of a thread, its current cache and budget. A suspended
+ * evaluation keeps its state while other evaluations run on the thread.
+ */
+struct EvalState {
+    EvalCache* cache;
+    Budget* budget;
+    /**
+     * Makes a state current for the calling thread.
+     * @param state the state.
+     * @return the state that was current.
+     */
+    static EvalState exchange(const EvalState& state);
+};
+
+/**
+ * A context independent expression that is evaluated at most once for each
+ * evaluation of the whole expression, e.g. "/r/limit" in "/r/a[. < /r/limit]".
+ * Expressions with the same slot share the value.
+ */
+class Cached : public Expr {
+public:
+    Cached(const Expr* e, size_t slot);
+    Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "Cached"; }
+    void print(std::ostream& os) const override;
+    bool isContextIndependent() const override;
+    void getChildren(std::vector<const Expr*>& children) const override;
+    void rewriteChildren(const Rewrite& f) override;
+    size_t getSlot() const;
+private:
+    std::unique_ptr<const Expr> _e;
+    size_t _slot;
+};
+
+/**
+ * A relative path that starts with parent steps, e.g. "../../limit". The
+ * value only depends on the ancestor the parent steps select, it is computed
+ * once per ancestor during one evaluation of the whole expression.
+ */
+class MemoizedPath : public Expr {
+public:
+    MemoizedPath(const Expr* e, size_t depth);
+    Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override;
+    const char* getName() const override { return "MemoizedPath"; }
+    void print(std::ostream& os) const override;
+    void getChildren(std::vector<const Expr*>& children) const override;
+    void rewriteChildren(const Rewrite& f) override;
+    size_t getDepth() const;
+private:
+    std::unique_ptr<const Expr> _e;
+    size_t _depth;
 };
 
 }
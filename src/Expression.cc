@@ -20,34 +20,158 @@
 // FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
 // DEALINGS IN THE SOFTWARE.
 
+
+#include <algorithm>
 #include <sstream>
 #include <stdexcept>
 
 #include "xpath10_driver.hh"
+#include "Expr.hh"
+#include "Bytecode.hh"
+#include "Serialization.hh"
 #include <Jstr.hh>
 
 namespace Jstr {
 namespace Xpath {
 
-Expression::Expression(const std::string& s) {
+namespace {
+
+Expr*
+parse(const std::string& s) {
     xpath10_driver driver;
     if (driver.parse(s) != 0) {
         std::stringstream ss;
-        ss << "Expression::Expression failed to parse exp: " << s;
+        ss << "Expression::Expression failed to parse exp: " << s << ", " << driver.getError();
         throw std::runtime_error(ss.str());
     }
-    _expr = driver.result.release();
+    return driver.result.release();
+}
+
+// Numbers the variables in the order they are referenced, references to the
+// same name share a slot.
+void
+resolveVariables(Expr* e, std::vector<std::string>& variables) {
+    VarRef* var = dynamic_cast<VarRef*>(e);
+    if (var != nullptr) {
+        std::vector<std::string>::const_iterator i =
+            std::find(variables.begin(), variables.end(), var->getString());
+        var->setSlot(i - variables.begin());
+        if (i == variables.end()) {
+            variables.push_back(var->getString());
+        }
+    }
+    e->rewriteChildren([&variables](Expr* child) {
+        resolveVariables(child, variables);
+        return child;
+    });
+}
+
+}
+
+Expression::Expression(const std::string& s, Backend backend) : Expression(parse(s), backend) {}
+
+Expression::Expression(Expr* expr, Backend backend) : _expr(expr), _program(nullptr) {
+    resolveVariables(expr, _variables);
+    if (backend == Bytecode) {
+        try {
+            _program = Program::compile(_expr).release();
+        } catch (...) {
+            delete _expr;
+            throw;
+        }
+    }
 }
 
 Expression::~Expression() {
+    delete _program;
+    _program = nullptr;
     delete _expr;
     _expr = nullptr;
 }
 
 Value
 Expression::eval(const Env& env) const {
+    Budget budget(env);
+    return run(env, nullptr);
+}
+
+Value
+Expression::eval(const Env& env, const Bindings& bindings) const {
+    Budget budget(env);
+    return run(env, &bindings);
+}
+
+Value
+Expression::run(const Env& env, const Bindings* bindings) const {
+    EvalCache cache(bindings);
+    if (_program != nullptr) {
+        return _program->run(env, env.getCurrent(), 0);
+    }
     return _expr->eval(env, env.getCurrent(), 0);
 }
 
+const std::vector<std::string>&
+Expression::getVariables() const {
+    return _variables;
+}
+
+size_t
+Expression::getSlot(const std::string& name) const {
+    std::vector<std::string>::const_iterator i = std::find(_variables.begin(), _variables.end(), name);
+    if (i == _variables.end()) {
+        throw std::runtime_error("Expression::getSlot, not a variable of the expression: " + name);
+    }
+    return i - _variables.begin();
+}
+
+std::string
+Expression::serialize() const {
+    std::string blob;
+    Xpath::serialize(_expr, blob);
+    return blob;
+}
+
+std::unique_ptr<Expression>
+Expression::deserialize(std::string_view blob, Backend backend) {
+    return std::unique_ptr<Expression>(new Expression(Xpath::deserialize(blob).release(), backend));
+}
+
+// Bindings
+Bindings::Bindings(const Expression& expression) :
+    _values(expression.getVariables().size(), nullptr),
+    _owned(expression.getVariables().size()) {
+}
+
+void
+Bindings::bind(size_t slot, const Value* v) {
+    checkSlot(slot);
+    _values[slot] = v;
+}
+
+void
+Bindings::bind(size_t slot, Value&& v) {
+    checkSlot(slot);
+    _owned[slot] = std::move(v);
+    _values[slot] = &_owned[slot];
+}
+
+const Value*
+Bindings::get(size_t slot) const {
+    return slot < _values.size() ? _values[slot] : nullptr;
+}
+
+void
+Bindings::clear() {
+    std::fill(_values.begin(), _values.end(), nullptr);
+    std::fill(_owned.begin(), _owned.end(), Value());
+}
+
+void
+Bindings::checkSlot(size_t slot) const {
+    if (slot >= _values.size()) {
+        throw std::runtime_error("Bindings::bind, invalid slot: " + std::to_string(slot));
+    }
+}
+
 }
 }
@@ -0,0 +1,114 @@
+// MIT license
+//
+// Copyright 2023 Per Nilsson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the “Software”), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+#include <Jstr.hh>
+
+namespace Jstr {
+namespace Xpath {
+
+ExpressionCache::ExpressionCache(size_t capacity) :
+    _capacity(capacity), _hits(0), _misses(0) {
+}
+
+std::shared_ptr<const Expression>
+ExpressionCache::get(const std::string& xpath) {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        std::unordered_map<std::string_view, std::list<Entry>::iterator>::iterator i =
+            _index.find(xpath);
+        if (i != _index.end()) {
+            _hits++;
+            _entries.splice(_entries.begin(), _entries, i->second);
+            return i->second->second;
+        }
+        _misses++;
+    }
+    // Parsed without the lock, a thread that parses the same expression at
+    // the same time keeps the expression it parsed itself.
+    std::shared_ptr<const Expression> expr = std::make_shared<const Expression>(xpath);
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_capacity == 0 || _index.find(xpath) != _index.end()) {
+        return expr;
+    }
+    _entries.emplace_front(xpath, expr);
+    _index.emplace(_entries.front().first, _entries.begin());
+    evict();
+    return expr;
+}
+
+void
+ExpressionCache::setCapacity(size_t capacity) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _capacity = capacity;
+    evict();
+}
+
+size_t
+ExpressionCache::getCapacity() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _capacity;
+}
+
+size_t
+ExpressionCache::getSize() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _entries.size();
+}
+
+size_t
+ExpressionCache::getHits() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _hits;
+}
+
+size_t
+ExpressionCache::getMisses() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _misses;
+}
+
+void
+ExpressionCache::clear() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _index.clear();
+    _entries.clear();
+    _hits = 0;
+    _misses = 0;
+}
+
+ExpressionCache&
+ExpressionCache::getDefault() {
+    static ExpressionCache cache;
+    return cache;
+}
+
+void
+ExpressionCache::evict() {
+    while (_entries.size() > _capacity) {
+        _index.erase(_entries.back().first);
+        _entries.pop_back();
+    }
+}
+
+}
+}
@@ -1,16 +1,54 @@
 #include <cmath>
+#include <map>
 #include <sstream>
 #include <iostream>
 
 #include "Utils.hh"
 #include "Functions.hh"
+#include "Numbers.hh"
+#include "Simd.hh"
 
 namespace Jstr {
 namespace Xpath {
 
+namespace {
+
+// Stops at the first node instead of building the node set.
+bool
+isEmpty(const Expr* arg, const Env& e, const Value& d, size_t pos) {
+    return arg->visitExpr(e, d, pos, false, [](const Node*) { return false; });
+}
+
+bool
+isContinuation(char c) {
+    return (static_cast<unsigned char>(c) & 0xc0) == 0x80;
+}
+
+// The end of the UTF-8 character that starts at i.
+size_t
+characterEnd(std::string_view s, size_t i) {
+    for (i++; i < s.size() && isContinuation(s[i]); i++) {
+    }
+    return i;
+}
+
+// The byte offset of a character, the size of s if it has fewer characters.
+size_t
+characterOffset(std::string_view s, double index) {
+    size_t i = 0;
+    for (size_t size = s.size(); i < size; i++) {
+        if (!isContinuation(s[i]) && index-- <= 0) {
+            break;
+        }
+    }
+    return i;
+}
+
+}
+
 struct CurrentFun : Fun {
     CurrentFun(const std::string& name, const std::list<const Expr*>* args) :
-        Fun(args) {
+        Fun(name, args) {
         checkArgs(name, 0);
     }
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override {
@@ -20,7 +58,7 @@ struct CurrentFun : Fun {
 
 struct LastFun : Fun {
     LastFun(const std::string& name, const std::list<const Expr*>* args) :
-        Fun(args) {
+        Fun(name, args) {
         checkArgs(name, 0);
     }
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override {
@@ -31,7 +69,7 @@ struct LastFun : Fun {
 
 struct PositionFun : Fun {
     PositionFun(const std::string& name, const std::list<const Expr*>* args) :
-        Fun(args) {
+        Fun(name, args) {
         checkArgs(name, 0);
     }
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override {
@@ -42,11 +80,14 @@ struct PositionFun : Fun {
 
 struct CountFun : Fun {
     CountFun(const std::string& name, const std::list<const Expr*>* args) :
-        Fun(args) {
+        Fun(name, args) {
         checkArgs(name, 1);
     }
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override {
         std::list<const Expr*>::const_iterator i = _args->begin();
+        if ((*i)->selectsNodeSet()) {
+            return Value(static_cast<double>((*i)->countExpr(e, d, pos, false)));
+        }
         Value arg = (*i)->evalExpr(e, d, pos);
         return arg.getNodeSetSize();
     }
@@ -54,13 +95,13 @@ struct CountFun : Fun {
 
 struct LocalNameFun : Fun {
     LocalNameFun(const std::string& name, const std::list<const Expr*>* args) :
-        Fun(args) {
+        Fun(name, args) {
         checkArgsZeroOrOne(name);
     }
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override {
         if (_args == nullptr || _args->empty()) {
             const Node* n = d.getNode(pos);
-            return n->getLocalName();
+            return Value(n->getSharedLocalName());
         } else {
             std::list<const Expr*>::const_iterator i = _args->begin();
             Value arg = (*i)->evalExpr(e, d, pos);
@@ -72,7 +113,7 @@ struct LocalNameFun : Fun {
 // String functions
 struct StringFun : Fun {
     StringFun(const std::string& name, const std::list<const Expr*>* args) :
-        Fun(args) {
+        Fun(name, args) {
         checkArgsZeroOrOne(name);
     }
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override {
@@ -82,29 +123,30 @@ struct StringFun : Fun {
         } else {
             std::list<const Expr*>::const_iterator i = _args->begin();
             Value arg = (*i)->evalExpr(e, d, pos);
-            return Value(arg.getString());
+            return arg.getType() == Value::String ? arg : Value(arg.getString());
         }
     }
 };
 
 struct ConcatFun : Fun {
     ConcatFun(const std::string& name, const std::list<const Expr*>* args) :
-        Fun(args) {
+        Fun(name, args) {
         checkArgsGe(name, 2);
     }
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override {
         std::string s;
+        std::string buffer;
         for (const Expr* arg : *_args) {
             Value val = arg->evalExpr(e, d, pos);
-            s += val.getString();
+            s += val.getStringView(buffer);
         }
-        return Value(s);
+        return Value(std::move(s));
     }
 };
 
 struct StartsWithFun : Fun {
     StartsWithFun(const std::string& name, const std::list<const Expr*>* args) :
-        Fun(args) {
+        Fun(name, args) {
         checkArgs(name, 2);
     }
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override {
@@ -112,65 +154,101 @@ struct StartsWithFun : Fun {
         Value left = (*i)->evalExpr(e, d, pos);
         ++i;
         Value right = (*i)->evalExpr(e, d, pos);
-        std::string l = left.getString();
-        std::string r = right.getString();
-        return Value(l.rfind(r, 0) == 0);
+        std::string lb;
+        std::string rb;
+        std::string_view l = left.getStringView(lb);
+        std::string_view r = right.getStringView(rb);
+        return Value(l.substr(0, r.size()) == r);
     }
 };
 
-struct ContainsFun : Fun {
-    ContainsFun(const std::string& name, const std::list<const Expr*>* args) :
-        Fun(args) {
+/**
+ * A function that searches for its second argument in its first, a literal
+ * pattern is taken from the tree instead of being evaluated for each call.
+ */
+struct SearchFun : Fun {
+    SearchFun(const std::string& name, const std::list<const Expr*>* args) :
+        Fun(name, args) {
         checkArgs(name, 2);
+        prepare();
+    }
+    void rewriteChildren(const Rewrite& f) override {
+        Fun::rewriteChildren(f);
+        prepare();
+    }
+    void prepare() {
+        const StringLiteral* pattern = dynamic_cast<const StringLiteral*>(*std::next(_args->begin()));
+        if (pattern != nullptr && pattern->getPredicates() == nullptr) {
+            _pattern = &pattern->getString();
+        } else {
+            _pattern = nullptr;
+        }
+    }
+    /**
+     * Finds the pattern in the first argument.
+     * @param l the first argument.
+     * @param size the size of the pattern.
+     * @return the position or std::string_view::npos.
+     */
+    size_t find(const Env& e, const Value& d, size_t pos, std::string_view l, size_t& size) const {
+        if (_pattern != nullptr) {
+            size = _pattern->size();
+            return findString(l, *_pattern);
+        }
+        Value right = (*std::next(_args->begin()))->evalExpr(e, d, pos);
+        std::string rb;
+        std::string_view r = right.getStringView(rb);
+        size = r.size();
+        return findString(l, r);
+    }
+    // The literal second argument or nullptr.
+    const std::string* _pattern = nullptr;
+};
+
+struct ContainsFun : SearchFun {
+    ContainsFun(const std::string& name, const std::list<const Expr*>* args) :
+        SearchFun(name, args) {
     }
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override {
-        std::list<const Expr*>::const_iterator i = _args->begin();
-        Value left = (*i)->evalExpr(e, d, pos);
-        ++i;
-        Value right = (*i)->evalExpr(e, d, pos);
-        std::string l = left.getString();
-        std::string r = right.getString();
-        return Value(l.find(r, 0) != std::string::npos);
+        Value left = _args->front()->evalExpr(e, d, pos);
+        std::string lb;
+        std::string_view l = left.getStringView(lb);
+        size_t size;
+        return Value(find(e, d, pos, l, size) != std::string_view::npos);
     }
 };
 
-struct SubstringBeforeFun : Fun {
+struct SubstringBeforeFun : SearchFun {
     SubstringBeforeFun(const std::string& name, const std::list<const Expr*>* args) :
-        Fun(args) {
-        checkArgs(name, 2);
+        SearchFun(name, args) {
     }
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override {
-        std::list<const Expr*>::const_iterator i = _args->begin();
-        Value left = (*i)->evalExpr(e, d, pos);
-        ++i;
-        Value right = (*i)->evalExpr(e, d, pos);
-        std::string l = left.getString();
-        std::string r = right.getString();
-        size_t p = l.find(r, 0);
-        return p == std::string::npos ? Value() : Value(l.substr(0, p));
+        Value left = _args->front()->evalExpr(e, d, pos);
+        std::string lb;
+        std::string_view l = left.getStringView(lb);
+        size_t size;
+        size_t p = find(e, d, pos, l, size);
+        return p == std::string_view::npos ? Value() : Value(std::string(l.substr(0, p)));
     }
 };
 
-struct SubstringAfterFun : Fun {
+struct SubstringAfterFun : SearchFun {
     SubstringAfterFun(const std::string& name, const std::list<const Expr*>* args) :
-        Fun(args) {
-        checkArgs(name, 2);
+        SearchFun(name, args) {
     }
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override {
-        std::list<const Expr*>::const_iterator i = _args->begin();
-        Value left = (*i)->evalExpr(e, d, pos);
-        ++i;
-        Value right = (*i)->evalExpr(e, d, pos);
-        std::string l = left.getString();
-        std::string r = right.getString();
-        size_t p = l.find(r, 0);
-        return p == std::string::npos ? Value() : Value(l.substr(p + r.size()));
+        Value left = _args->front()->evalExpr(e, d, pos);
+        std::string lb;
+        std::string_view l = left.getStringView(lb);
+        size_t size;
+        size_t p = find(e, d, pos, l, size);
+        return p == std::string_view::npos ? Value() : Value(std::string(l.substr(p + size)));
     }
 };
 
 struct SubstringFun : Fun {
     SubstringFun(const std::string& name, const std::list<const Expr*>* args) :
-        Fun(args) {
+        Fun(name, args) {
         checkArgsTwoOrThree(name);
     }
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override {
@@ -191,7 +269,8 @@ struct SubstringFun : Fun {
                 argsSize = 2;
             }
         }            
-        const std::string& s = str.getString();
+        std::string buffer;
+        std::string_view s = str.getStringView(buffer);
         double p = position.getNumber();
         if (std::isnan(p) || std::isnan(-p) || std::isinf(p)) {
             return Value("");
@@ -205,61 +284,145 @@ struct SubstringFun : Fun {
                 }
             }
         }
-        return  argsSize == 2 ? Value(s.substr(round(p))) : Value(s.substr(round(p), round(len)));
+        // The positions count characters, not bytes.
+        size_t begin = characterOffset(s, round(p));
+        if (argsSize == 2) {
+            return Value(std::string(s.substr(begin)));
+        }
+        std::string_view rest = s.substr(begin);
+        return Value(std::string(rest.substr(0, characterOffset(rest, round(len)))));
     }
 };
 
 struct StringLengthFun : Fun {
     StringLengthFun(const std::string& name, const std::list<const Expr*>* args) :
-        Fun(args) {
+        Fun(name, args) {
         checkArgsZeroOrOne(name);
     }
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override {
         double l;
+        std::string buffer;
         if (_args == nullptr || _args->empty()) {
             const Node* n = d.getNode(pos);
-            const std::string& s = n->getString();
-            l = s.size();
+            l = countCharacters(n->getStringView(buffer));
         } else  {
             std::list<const Expr*>::const_iterator i = _args->begin();
             Value v = (*i)->evalExpr(e, d, pos);
-            const std::string& s = v.getString();
-            l = s.size();
+            l = countCharacters(v.getStringView(buffer));
         }
         return Value(l);            
     }
 };
 
+/**
+ * The character mapping of translate(), the first occurrence of a character
+ * in from is replaced by the character at the same position in to, or
+ * deleted if to is shorter. ASCII characters that map to ASCII characters or
+ * are deleted are looked up in a byte table, other characters by name.
+ */
+struct Translation {
+    Translation(std::string_view from, std::string_view to) {
+        for (int i = 0; i < 128; i++) {
+            _ascii[i] = i;
+        }
+        bool mapped[128] = {};
+        for (size_t i = 0, j = 0, size = from.size(); i < size; ) {
+            size_t end = characterEnd(from, i);
+            std::string_view c = from.substr(i, end - i);
+            std::string_view r;
+            if (j < to.size()) {
+                size_t e = characterEnd(to, j);
+                r = to.substr(j, e - j);
+                j = e;
+            }
+            i = end;
+            unsigned char b = c[0];
+            if (b >= 128) {
+                _other.emplace(c, r);
+            } else if (!mapped[b]) {
+                mapped[b] = true;
+                if (r.empty()) {
+                    _ascii[b] = Delete;
+                } else if (static_cast<unsigned char>(r[0]) < 128) {
+                    _ascii[b] = r[0];
+                } else {
+                    _ascii[b] = Other;
+                    _other.emplace(c, r);
+                }
+            }
+        }
+    }
+    std::string apply(std::string_view s) const {
+        std::string result;
+        result.reserve(s.size());
+        for (size_t i = 0, size = s.size(); i < size; ) {
+            unsigned char b = s[i];
+            if (b < 128 && _ascii[b] >= 0) {
+                result += static_cast<char>(_ascii[b]);
+                i++;
+            } else if (b < 128 && _ascii[b] == Delete) {
+                i++;
+            } else {
+                size_t end = characterEnd(s, i);
+                std::string_view c = s.substr(i, end - i);
+                std::map<std::string, std::string, std::less<>>::const_iterator m = _other.find(c);
+                result.append(m == _other.end() ? c : std::string_view(m->second));
+                i = end;
+            }
+        }
+        return result;
+    }
+    static const int16_t Delete = -1;
+    static const int16_t Other = -2;
+    int16_t _ascii[128];
+    std::map<std::string, std::string, std::less<>> _other;
+};
+
 struct TranslateFun : Fun {
     TranslateFun(const std::string& name, const std::list<const Expr*>* args) :
-        Fun(args) {
+        Fun(name, args) {
         checkArgs(name, 3);
+        prepare();
+    }
+    void rewriteChildren(const Rewrite& f) override {
+        Fun::rewriteChildren(f);
+        prepare();
+    }
+    // The table is built once if the mapping is given by literals.
+    void prepare() {
+        std::list<const Expr*>::const_iterator i = std::next(_args->begin());
+        const StringLiteral* source = dynamic_cast<const StringLiteral*>(*i++);
+        const StringLiteral* target = dynamic_cast<const StringLiteral*>(*i);
+        if (source != nullptr && source->getPredicates() == nullptr &&
+            target != nullptr && target->getPredicates() == nullptr) {
+            _translation = std::make_unique<const Translation>(source->getString(), target->getString());
+        } else {
+            _translation.reset();
+        }
     }
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override {
         std::list<const Expr*>::const_iterator i = _args->begin();
         Value left = (*i)->evalExpr(e, d, pos);
+        std::string lb;
+        std::string_view l = left.getStringView(lb);
+        if (_translation != nullptr) {
+            return Value(_translation->apply(l));
+        }
         ++i;
         Value source = (*i)->evalExpr(e, d, pos);
         ++i;
         Value target = (*i)->evalExpr(e, d, pos);
-        std::string l = left.getString();
-        const std::string& s = source.getString();
-        const std::string& t = target.getString();
-        size_t translateSize = std::min(s.size(), t.size());
-        for (size_t i = 0, size = l.size() ; i < size; i++) {
-            size_t p = s.find(l[i]);
-            if (p != std::string::npos && p < translateSize) {
-                l[i] = t[p];
-            }
-        }
-        return Value(l);
+        std::string sb;
+        std::string tb;
+        return Value(Translation(source.getStringView(sb), target.getStringView(tb)).apply(l));
     }
+    std::unique_ptr<const Translation> _translation;
 };
 
 // Number functions
 struct NumberFun : Fun {
     NumberFun(const std::string& name, const std::list<const Expr*>* args) :
-        Fun(args) {
+        Fun(name, args) {
         checkArgsZeroOrOne(name);
     }
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override {
@@ -276,26 +439,23 @@ struct NumberFun : Fun {
 
 struct SumFun : Fun {
     SumFun(const std::string& name, const std::list<const Expr*>* args) :
-        Fun(args) {
+        Fun(name, args) {
         checkArgs(name, 1);
     }
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override {
         std::list<const Expr*>::const_iterator i = _args->begin();
-        Value v = (*i)->evalExpr(e, d, pos);
         double r(0);
+        std::string buffer;
+        if ((*i)->selectsNodeSet()) {
+            (*i)->visitExpr(e, d, pos, false, [&r, &buffer](const Node* n) {
+                r += stringToNumber(n->getStringView(buffer));
+                return true;
+            });
+            return Value(r);
+        }
+        Value v = (*i)->evalExpr(e, d, pos);
         for (const Node* n : v.getNodeSet()) {
-            const std::string& s = n->getString();
-            if (s.empty()) {
-                r = NAN;
-                break;
-            } else {
-                try {
-                    r += std::stod(s);
-                } catch (const std::exception& e) {
-                    r = NAN;
-                    break;
-                }
-            }
+            r += stringToNumber(n->getStringView(buffer));
         }
         return Value(r);
     }
@@ -303,7 +463,7 @@ struct SumFun : Fun {
 
 struct FloorFun : Fun {
     FloorFun(const std::string& name, const std::list<const Expr*>* args) :
-        Fun(args) {
+        Fun(name, args) {
         checkArgs(name, 1);
     }
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override {
@@ -315,7 +475,7 @@ struct FloorFun : Fun {
 
 struct CeilingFun : Fun {
     CeilingFun(const std::string& name, const std::list<const Expr*>* args) :
-        Fun(args) {
+        Fun(name, args) {
         checkArgs(name, 1);
     }
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override {
@@ -327,7 +487,7 @@ struct CeilingFun : Fun {
 
 struct RoundFun : Fun {
     RoundFun(const std::string& name, const std::list<const Expr*>* args) :
-        Fun(args) {
+        Fun(name, args) {
         checkArgs(name, 1);
     }
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override {
@@ -340,7 +500,7 @@ struct RoundFun : Fun {
 // Booelan Functions
 struct BooleanFun : Fun {
     BooleanFun(const std::string& name, const std::list<const Expr*>* args) :
-        Fun(args) {
+        Fun(name, args) {
         checkArgsZeroOrOne(name);
     }
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override {
@@ -349,6 +509,9 @@ struct BooleanFun : Fun {
             return Value(n->getBoolean());
         } else {
             std::list<const Expr*>::const_iterator i = _args->begin();
+            if ((*i)->selectsNodeSet()) {
+                return Value(!isEmpty(*i, e, d, pos));
+            }
             Value arg = (*i)->evalExpr(e, d, pos);
             return Value(arg.getBoolean());
         }
@@ -359,11 +522,14 @@ struct BooleanFun : Fun {
 // No fun to hang around freaked out for another day.
 struct NotFun : Fun {
     NotFun(const std::string& name, const std::list<const Expr*>* args) :
-        Fun(args) {
+        Fun(name, args) {
         checkArgs(name, 1);
     }
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override {
         std::list<const Expr*>::const_iterator i = _args->begin();
+        if ((*i)->selectsNodeSet()) {
+            return Value(isEmpty(*i, e, d, pos));
+        }
         Value arg = (*i)->evalExpr(e, d, pos);
         return Value(!arg.getBoolean());
     }
@@ -371,33 +537,89 @@ struct NotFun : Fun {
 
 struct TrueFun : Fun {
     TrueFun(const std::string& name, const std::list<const Expr*>* args) :
-        Fun(args) {
+        Fun(name, args) {
         checkArgs(name, 0);
     }
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override {
         return Value(true);
     }
+    bool isConstant() const override {
+        return true;
+    }
 };
 
 struct FalseFun : Fun {
     FalseFun(const std::string& name, const std::list<const Expr*>* args) :
-        Fun(args) {
+        Fun(name, args) {
         checkArgs(name, 0);
     }
     Value evalExpr(const Env& e, const Value& d, size_t pos, bool firstStep = false) const override {
         return Value(false);
     }
+    bool isConstant() const override {
+        return true;
+    }
 };
 
 // Fun
-Fun::Fun(const std::list<const Expr*>* args) :
-    _args(args) {
+Fun::Fun(const std::string& name, const std::list<const Expr*>* args) :
+    _name(name), _args(args) {
 }
 
 Fun::~Fun() {
     deleteExprs(_args);
 }
 
+const char*
+Fun::getName() const {
+    return _name.c_str();
+}
+
+bool
+Fun::isConstant() const {
+    // Without arguments the functions use the context, e.g. position() or string().
+    if (_args == nullptr || _args->empty() || getPredicates() != nullptr) {
+        return false;
+    }
+    for (const Expr* arg : *_args) {
+        if (!arg->isConstant()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool
+Fun::isContextIndependent() const {
+    if (_args == nullptr || _args->empty()) {
+        return _name == "current" || isConstant();
+    }
+    for (const Expr* arg : *_args) {
+        if (!arg->isContextIndependent()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void
+Fun::getChildren(std::vector<const Expr*>& children) const {
+    if (_args != nullptr) {
+        children.insert(children.end(), _args->begin(), _args->end());
+    }
+}
+
+void
+Fun::rewriteChildren(const Rewrite& f) {
+    Expr::rewriteChildren(f);
+    if (_args != nullptr) {
+        std::list<const Expr*>* args = const_cast<std::list<const Expr*>*>(_args);
+        for (const Expr*& arg : *args) {
+            arg = f(const_cast<Expr*>(arg));
+        }
+    }
+}
+
  Fun*
 Fun::create(const std::string& name, const std::list<const Expr*>* args) {
      if (name == "current") {
@@ -417,7 +639,7 @@ Fun::create(const std::string& name, const std::list<const Expr*>* args) {
      } else if (name == "starts-with") {
          return new StartsWithFun(name, args);
      } else if (name == "contains") {
-         return new StartsWithFun(name, args);
+         return new ContainsFun(name, args);
      } else if (name == "substring-before") {
          return new SubstringBeforeFun(name, args);
      } else if (name == "substring-after") {
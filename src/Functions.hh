@@ -30,14 +30,20 @@ namespace Xpath {
 
 class Fun : public Expr {
 public:
-    Fun(const std::list<const Expr*>* args);
+    Fun(const std::string& name, const std::list<const Expr*>* args);
     ~Fun();
     static Fun* create(const std::string& name, const std::list<const Expr*>* args);
+    const char* getName() const override;
+    bool isConstant() const override;
+    bool isContextIndependent() const override;
+    void getChildren(std::vector<const Expr*>& children) const override;
+    void rewriteChildren(const Rewrite& f) override;
 protected:
     void checkArgs(const std::string& name, size_t expectedSize) const;
     void checkArgsZeroOrOne(const std::string& name) const;
     void checkArgsTwoOrThree(const std::string& name) const;
     void checkArgsGe(const std::string& name, size_t expectedSize) const;
+    std::string _name;
     const std::list<const Expr*>* _args;
 };
 
@@ -24,45 +24,22 @@
 #include <stdexcept>
 #include <Jstr.hh>
 
-#include "xpath10_driver.hh"
-
 namespace Jstr {    
 namespace Xpath {
     
 Value
 eval(const std::string& xpath, const Document& document) {
-    xpath10_driver driver;
-    if (driver.parse(xpath) != 0) {
-        std::stringstream ss;
-        ss << "nljp::eval failed to parse exp: " << xpath;
-        throw std::runtime_error(ss.str());
-    }
+    std::shared_ptr<const Expression> expr = ExpressionCache::getDefault().get(xpath);
     Value context(document.getRoot());
     Env env(context);
-    return driver.result->eval(env, context, 0);
+    return expr->eval(env);
 }
     
 }
 
 namespace {
-
-std::string
-getPropertyString(const nlohmann::json& json,
-                  const std::string& name,
-                  const std::string& messagePrefix) {
-    if (!json.contains(name)) {
-        std::stringstream ss;
-        ss << messagePrefix << " can not find " << name; 
-        throw std::runtime_error(ss.str());
-    }
-    const nlohmann::json& t = json[name];
-    if (!t.is_string()) {
-        std::stringstream ss;
-        ss << messagePrefix << " " << name << " is not a string";
-        throw std::runtime_error(ss.str());
-    }
-    return t.get<std::string>();
-}
+using namespace Jstr::Xpath;
+using Jstr::Schematron::getPropertyString;
 
 bool
 evalExpression(const Expression& expr,
@@ -173,6 +150,24 @@ evalPattern(const nlohmann::json& pattern, const Document& document, std::ostrea
     
 namespace Schematron {
     
+std::string
+getPropertyString(const nlohmann::json& json,
+                  const std::string& name,
+                  const std::string& messagePrefix) {
+    if (!json.contains(name)) {
+        std::stringstream ss;
+        ss << messagePrefix << " can not find " << name;
+        throw std::runtime_error(ss.str());
+    }
+    const nlohmann::json& t = json[name];
+    if (!t.is_string()) {
+        std::stringstream ss;
+        ss << messagePrefix << " " << name << " is not a string";
+        throw std::runtime_error(ss.str());
+    }
+    return t.get<std::string>();
+}
+
 bool
 eval(const nlohmann::json& schematron, const nlohmann::json& data, std::ostream& out) {
     Jstr::Xpath::Document document(data);
@@ -37,6 +37,8 @@ printHelp() {
     std::cout << "Evaluates a xpath expression against a JSON object." << std::endl;
     std::cout << "JSON data is either read from stdin or file." << std::endl;
     std::cout << "Result is printed on stdout." << std::endl; 
+    std::cout << "--trace-optimizer prints the expression tree before and after" << std::endl;
+    std::cout << "optimization on stderr." << std::endl;
 }
 
 }
@@ -53,13 +55,14 @@ main (int argc, char* argv[])
             {"version", no_argument,       0, 'v'},
             {"json",    optional_argument, 0, 'j'},
             {"xpath",   required_argument, 0, 'x'},
+            {"trace-optimizer", no_argument, 0, 't'},
             {0, 0, 0, 0}
         };
       
         /* getopt_long stores the option index here. */
         int option_index = 0;
 
-        c = getopt_long (argc, argv, "hvx:", long_options, &option_index);
+        c = getopt_long (argc, argv, "hvx:t", long_options, &option_index);
 
         /* Detect the end of the options. */
         if (c == -1) {
@@ -90,6 +93,9 @@ main (int argc, char* argv[])
         case 'x':
             xpath = optarg;
             break;
+        case 't':
+            Jstr::Xpath::setOptimizerTrace(&std::cerr);
+            break;
         case '?':
             /* getopt_long already printed an error message. */
             break;
@@ -0,0 +1,292 @@
+// MIT license
+//
+// Copyright 2023 Per Nilsson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the “Software”), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+#include <Jstr.hh>
+#include <StaticXpath.hh>
+
+namespace {
+
+using Jstr::Schematron::getPropertyString;
+
+void
+printHelp() {
+    std::cout << "Usage: jxpc --schema=schematron-file | --xpath=\"xpath\"... [--function=name]" << std::endl;
+    std::cout << "Generates C++ code that evaluates a schematron file or xpath expressions." << std::endl;
+    std::cout << "For a schematron file the code has the function" << std::endl;
+    std::cout << "  bool name(const nlohmann::json& data, std::ostream& out)" << std::endl;
+    std::cout << "with the same result as Jstr::Schematron::eval, for expressions" << std::endl;
+    std::cout << "  Jstr::Xpath::Value nameN(const Jstr::Xpath::Env& env)" << std::endl;
+    std::cout << "where N is the position of the expression on the command line." << std::endl;
+    std::cout << "The code is printed on stdout, link it with libnljp." << std::endl;
+}
+
+// Quotes a string as a C++ string literal.
+std::string
+quote(const std::string& s) {
+    std::stringstream ss;
+    ss << '"';
+    for (char c : s) {
+        switch (c) {
+        case '"': ss << "\\\""; break;
+        case '\\': ss << "\\\\"; break;
+        case '\n': ss << "\\n"; break;
+        case '\t': ss << "\\t"; break;
+        case '\r': ss << "\\r"; break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                ss << "\\" << std::oct << static_cast<int>(c) << std::dec;
+            } else {
+                ss << c;
+            }
+        }
+    }
+    ss << '"';
+    return ss.str();
+}
+
+// Returns the items of a schematron property that is an object or an array
+// of objects.
+std::vector<const nlohmann::json*>
+getObjects(const nlohmann::json& json, const std::string& name, const std::string& messagePrefix) {
+    if (!json.contains(name)) {
+        throw std::runtime_error(messagePrefix + " can not find " + name);
+    }
+    const nlohmann::json& j = json[name];
+    std::vector<const nlohmann::json*> result;
+    if (j.is_object()) {
+        result.push_back(&j);
+    } else if (j.is_array() && !j.empty()) {
+        for (const nlohmann::json& item : j) {
+            if (!item.is_object()) {
+                throw std::runtime_error(messagePrefix + " " + name + " in array is not object");
+            }
+            result.push_back(&item);
+        }
+    } else {
+        throw std::runtime_error(messagePrefix + " " + name + " is not object or non empty array");
+    }
+    return result;
+}
+
+/**
+ * Writes the functions that evaluate expressions. Expressions supported by
+ * JSTR_XPATH are compiled by the C++ compiler, the others are parsed once
+ * when they are first used.
+ */
+class Generator {
+public:
+    Generator(std::ostream& out) : _out(out), _count(0) {}
+    void writeHeader(const std::string& source) {
+        _out << "// Generated by jxpc from " << source << ", do not edit." << std::endl
+             << "#include <ostream>" << std::endl
+             << "#include <Jstr.hh>" << std::endl
+             << "#include <StaticXpath.hh>" << std::endl
+             << std::endl;
+    }
+    /**
+     * Writes a function that evaluates an expression.
+     * @param name the function name.
+     * @param xpath the expression.
+     * @param isStatic if the function has internal linkage.
+     */
+    void writeExpression(const std::string& name, const std::string& xpath, bool isStatic) {
+        // Fail when generating instead of when the generated code is used.
+        Jstr::Xpath::Expression parsed(xpath);
+        _out << (isStatic ? "static " : "") << "Jstr::Xpath::Value" << std::endl
+             << name << "(const Jstr::Xpath::Env& env) {" << std::endl;
+        if (Jstr::Xpath::Static::isSupported(xpath)) {
+            _out << "    return JSTR_XPATH(" << quote(xpath) << ").eval(env);" << std::endl;
+        } else {
+            _out << "    static const Jstr::Xpath::Expression e(" << quote(xpath) << ");" << std::endl
+                 << "    return e.eval(env);" << std::endl;
+        }
+        _out << "}" << std::endl << std::endl;
+    }
+    void writeSchematron(const std::string& name, const nlohmann::json& schematron) {
+        struct Assert {
+            std::string pattern;
+            std::string message;
+            std::string test;
+        };
+        struct Rule {
+            std::string context;
+            std::vector<Assert> asserts;
+        };
+        std::vector<Rule> rules;
+        for (const nlohmann::json* pattern : getObjects(schematron, "pattern", "jxpc")) {
+            std::string patternName = getPropertyString(*pattern, "name", "jxpc pattern");
+            for (const nlohmann::json* rule : getObjects(*pattern, "rule", "jxpc pattern")) {
+                Rule r;
+                r.context = newName();
+                writeExpression(r.context, getPropertyString(*rule, "context", "jxpc rule"), true);
+                for (const nlohmann::json* assert : getObjects(*rule, "assert", "jxpc rule")) {
+                    Assert a;
+                    a.pattern = patternName;
+                    a.message = getPropertyString(*assert, "message", "jxpc assert");
+                    a.test = newName();
+                    writeExpression(a.test, getPropertyString(*assert, "test", "jxpc assert"), true);
+                    r.asserts.push_back(a);
+                }
+                rules.push_back(r);
+            }
+        }
+        _out << "static bool" << std::endl
+             << "check(Jstr::Xpath::Value (*test)(const Jstr::Xpath::Env&)," << std::endl
+             << "      const Jstr::Xpath::Value& context," << std::endl
+             << "      const char* name," << std::endl
+             << "      const char* message," << std::endl
+             << "      std::ostream& out) {" << std::endl
+             << "    bool result(true);" << std::endl
+             << "    auto eval = [&](const Jstr::Xpath::Env& env) {" << std::endl
+             << "        if (!test(env).getBoolean()) {" << std::endl
+             << "            out << name << \", error: \" << message << std::endl;" << std::endl
+             << "            result = false;" << std::endl
+             << "        }" << std::endl
+             << "    };" << std::endl
+             << "    if (context.getType() == Jstr::Xpath::Value::NodeSet) {" << std::endl
+             << "        for (const Jstr::Xpath::Node* n : context.getNodeSet()) {" << std::endl
+             << "            eval(Jstr::Xpath::Env(Jstr::Xpath::Value(n)));" << std::endl
+             << "        }" << std::endl
+             << "    } else {" << std::endl
+             << "        eval(Jstr::Xpath::Env(context));" << std::endl
+             << "    }" << std::endl
+             << "    return result;" << std::endl
+             << "}" << std::endl
+             << std::endl
+             << "bool" << std::endl
+             << name << "(const nlohmann::json& data, std::ostream& out) {" << std::endl
+             << "    Jstr::Xpath::Document document(data);" << std::endl
+             << "    Jstr::Xpath::Env env(document.getRoot());" << std::endl
+             << "    bool result(true);" << std::endl;
+        for (const Rule& r : rules) {
+            _out << "    {" << std::endl
+                 << "        Jstr::Xpath::Value context = " << r.context << "(env);" << std::endl;
+            for (const Assert& a : r.asserts) {
+                _out << "        result &= check(" << a.test << ", context, "
+                     << quote(a.pattern) << ", " << quote(a.message) << ", out);" << std::endl;
+            }
+            _out << "    }" << std::endl;
+        }
+        _out << "    return result;" << std::endl
+             << "}" << std::endl;
+    }
+private:
+    std::string newName() {
+        return "xpath" + std::to_string(_count++);
+    }
+    std::ostream& _out;
+    size_t _count;
+};
+
+}
+
+int
+main (int argc, char* argv[])
+{
+    std::string schema;
+    std::vector<std::string> xpaths;
+    std::string function;
+    int c;
+    while (true) {
+        static struct option long_options[] = {
+            {"help",     no_argument,       0, 'h'},
+            {"version",  no_argument,       0, 'v'},
+            {"schema",   required_argument, 0, 's'},
+            {"xpath",    required_argument, 0, 'x'},
+            {"function", required_argument, 0, 'f'},
+            {0, 0, 0, 0}
+        };
+      
+        /* getopt_long stores the option index here. */
+        int option_index = 0;
+
+        c = getopt_long (argc, argv, "hvs:x:f:", long_options, &option_index);
+
+        /* Detect the end of the options. */
+        if (c == -1) {
+            break;
+        }
+
+        switch (c) {
+        case 'h':
+            printHelp();
+            return 0;
+        case 'v':
+            std::cout << Jstr::getVersion() << std::endl;
+            return 0;
+        case 's':
+            schema = optarg;
+            break;
+        case 'x':
+            xpaths.push_back(optarg);
+            break;
+        case 'f':
+            function = optarg;
+            break;
+        case '?':
+            /* getopt_long already printed an error message. */
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    if (schema.empty() == xpaths.empty()) {
+        printHelp();
+        return -1;
+    }
+    try {
+        std::stringstream code;
+        Generator generator(code);
+        if (!schema.empty()) {
+            std::ifstream ifs(schema);
+            if (!ifs.good()) {
+                std::cerr << "jxpc: could not open schematron file: " << schema << std::endl;
+                return -1;
+            }
+            generator.writeHeader(schema);
+            generator.writeSchematron(function.empty() ? "validate" : function,
+                                      nlohmann::json::parse(ifs));
+        } else {
+            generator.writeHeader("the command line");
+            for (size_t i = 0; i < xpaths.size(); i++) {
+                std::string name = (function.empty() ? "xpath" : function) + std::to_string(i);
+                generator.writeExpression(name, xpaths[i], false);
+            }
+        }
+        // Nothing is printed if the input has errors.
+        std::cout << code.str();
+    } catch (const std::exception& e) {
+        std::cerr << "jxpc, exception: " << e.what() << std::endl;
+        return -1;
+    }
+    return 0;
+}
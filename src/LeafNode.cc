@@ -26,7 +26,9 @@
 namespace Jstr {
 namespace Xpath {
 
-LeafNode::LeafNode(const Node* parent, const std::string& name, const nlohmann::json& json) :
+LeafNode::LeafNode(const Node* parent,
+                   const std::shared_ptr<const std::string>& name,
+                   const nlohmann::json& json) :
     Node(parent, name, json) {
 }
 
@@ -39,6 +41,16 @@ void
 LeafNode::getChild(const std::string& name, std::vector<const Node*>& result) const {
 }
 
+size_t
+LeafNode::getChildCount(const std::string& name) const {
+    return 0;
+}
+
+const Node*
+LeafNode::getChildAt(const std::string& name, size_t i) const {
+    return nullptr;
+}
+
 void
 LeafNode::getChildren(std::vector<const Node*>& result) const {
 }
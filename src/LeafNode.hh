@@ -31,11 +31,15 @@ namespace Xpath {
 class LeafNode : public Node {
 public:
     LeafNode() = delete;
-    LeafNode(const Node* parent, const std::string& name, const nlohmann::json& json);
+    LeafNode(const Node* parent,
+             const std::shared_ptr<const std::string>& name,
+             const nlohmann::json& json);
     LeafNode(const LeafNode& node) = delete;
     LeafNode& operator=(const LeafNode& node) = delete;
     bool isValue() const override;
     void getChild(const std::string& name, std::vector<const Node*>& result) const override;
+    size_t getChildCount(const std::string& name) const override;
+    const Node* getChildAt(const std::string& name, size_t i) const override;
     void getChildren(std::vector<const Node*>& result) const override;
     void getSubTreeNodes(std::vector<const Node*>& result) const override;
     void search(const std::string& name, std::vector<const Node*>& result) const override;
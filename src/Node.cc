@@ -24,15 +24,19 @@
 #include <nlohmann/json.hpp>
 #include <Jstr.hh>
 
+#include "Numbers.hh"
+
 namespace {
     using namespace Jstr::Xpath;
     
 void
 getString(const nlohmann::json& json, std::string& r) {
     if (json.is_string()) {
-        r += json.get<std::string>(); // Dont want quotation marks you get with dump
-    }else if (json.is_primitive()) {
-        r += json.dump();       // TODO: check is number NAN "NaN" which is xml syntax
+        r += json.get_ref<const std::string&>(); // Dont want quotation marks you get with dump
+    } else if (json.is_number_float()) {
+        appendNumber(json.get<double>(), r);
+    } else if (json.is_primitive()) {
+        r += json.dump();
     } else {
         for (const nlohmann::json& j: json) {
             getString(j, r);
@@ -45,10 +49,12 @@ getString(const nlohmann::json& json, std::string& r) {
 namespace Jstr {
 namespace Xpath {
 
-Node::Node() : _parent(nullptr), _json(nullptr) {}
+Node::Node() : _parent(nullptr), _name(std::make_shared<const std::string>()), _json(nullptr) {}
 
-Node::Node(const Node* parent, const std::string& name, const nlohmann::json& json) :
-    _parent(parent), _json(&json), _name(name) {
+Node::Node(const Node* parent,
+           const std::shared_ptr<const std::string>& name,
+           const nlohmann::json& json) :
+    _parent(parent), _name(name), _json(&json) {
 }
 
 Node::~Node() {
@@ -84,8 +90,7 @@ Node::getNumber() const {
     if (j.is_number()) {
         return j.get<double>();
     } else if (j.is_string()) {
-        const std::string& s = j.get<std::string>();
-        return s.empty() ? NAN : std::stod(s);
+        return stringToNumber(j.get_ref<const std::string&>());
     } else if (j.is_boolean()) {
         return j.get<bool>() ? 1 : 0;
     } else {
@@ -116,8 +121,24 @@ Node::getString() const {
     return r;
 }
 
+std::string_view
+Node::getStringView(std::string& buffer) const {
+    const nlohmann::json& j = getJson();
+    if (j.is_string()) {
+        return j.get_ref<const std::string&>();
+    }
+    buffer.clear();
+    ::getString(j, buffer);
+    return buffer;
+}
+
 const std::string&
 Node::getLocalName() const {
+    return *_name;
+}
+
+const std::shared_ptr<const std::string>&
+Node::getSharedLocalName() const {
     return _name;
 }
 
@@ -0,0 +1,79 @@
+// MIT license
+//
+// Copyright 2023 Per Nilsson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the “Software”), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+#include "NodeSetPool.hh"
+
+namespace {
+using namespace Jstr::Xpath;
+
+const size_t MaxPooled = 256;
+const size_t MaxPooledCapacity = 1 << 16;
+
+struct Pool {
+    ~Pool();
+    std::vector<std::vector<const Node*>*> free;
+};
+
+// Values may outlive the pool at thread exit, they then free their node sets
+// directly.
+thread_local bool poolDestroyed = false;
+thread_local Pool pool;
+
+Pool::~Pool() {
+    for (std::vector<const Node*>* ns : free) {
+        delete ns;
+    }
+    poolDestroyed = true;
+}
+}
+
+namespace Jstr {
+namespace Xpath {
+
+std::vector<const Node*>*
+NodeSetPool::acquire() {
+    if (poolDestroyed || pool.free.empty()) {
+        return new std::vector<const Node*>();
+    }
+    std::vector<const Node*>* ns = pool.free.back();
+    pool.free.pop_back();
+    return ns;
+}
+
+void
+NodeSetPool::release(std::vector<const Node*>* ns) {
+    if (ns == nullptr) {
+        return;
+    }
+    if (poolDestroyed ||
+        pool.free.size() >= MaxPooled ||
+        ns->capacity() > MaxPooledCapacity) {
+        delete ns;
+        return;
+    }
+    ns->clear();
+    pool.free.push_back(ns);
+}
+
+}
+}
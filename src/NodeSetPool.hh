@@ -0,0 +1,71 @@
+// MIT license
+//
+// Copyright 2023 Per Nilsson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the “Software”), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+#ifndef _NODE_SET_POOL_HH_
+#define _NODE_SET_POOL_HH_
+
+#include <vector>
+#include <Jstr.hh>
+
+namespace Jstr {
+namespace Xpath {
+
+/**
+ * Per thread pool of node set vectors. Evaluating an expression creates and
+ * destroys many short lived node sets, taking them from the pool lets them
+ * reuse the storage of earlier node sets instead of going to the allocator.
+ */
+class NodeSetPool {
+public:
+    /**
+     * Takes an empty node set from the pool or creates a new one.
+     * @return an empty node set owned by the caller.
+     */
+    static std::vector<const Node*>* acquire();
+    /**
+     * Clears the node set and gives it back to the pool, it is deleted if the
+     * pool is full or if it holds too much storage.
+     * @param ns the node set, may be nullptr.
+     */
+    static void release(std::vector<const Node*>* ns);
+};
+
+/**
+ * Scratch node set borrowed from the pool for the lifetime of the object.
+ */
+class ScratchNodeSet {
+public:
+    ScratchNodeSet() : _ns(NodeSetPool::acquire()) {}
+    ScratchNodeSet(const ScratchNodeSet&) = delete;
+    ScratchNodeSet& operator=(const ScratchNodeSet&) = delete;
+    ~ScratchNodeSet() { NodeSetPool::release(_ns); }
+    std::vector<const Node*>& operator*() { return *_ns; }
+    std::vector<const Node*>* operator->() { return _ns; }
+private:
+    std::vector<const Node*>* _ns;
+};
+
+}
+}
+
+#endif
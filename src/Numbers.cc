@@ -0,0 +1,112 @@
+// MIT license
+//
+// Copyright 2023 Per Nilsson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the “Software”), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#include <cmath>
+#include <charconv>
+#include <cstdlib>
+
+#include "Numbers.hh"
+
+namespace {
+
+bool
+isWhitespace(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+bool
+isDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+}
+
+namespace Jstr {
+namespace Xpath {
+
+double
+stringToNumber(std::string_view s) {
+    const char* first = s.data();
+    const char* last = first + s.size();
+    while (first < last && isWhitespace(*first)) {
+        ++first;
+    }
+    while (last > first && isWhitespace(*(last - 1))) {
+        --last;
+    }
+    // Validate the XPath Number production, from_chars would also accept
+    // exponents, "inf" and "nan".
+    const char* p = first;
+    if (p < last && *p == '-') {
+        ++p;
+    }
+    size_t digits(0);
+    bool dot(false);
+    for (; p < last; ++p) {
+        if (isDigit(*p)) {
+            digits++;
+        } else if (*p == '.' && !dot) {
+            dot = true;
+        } else {
+            return NAN;
+        }
+    }
+    if (digits == 0) {
+        return NAN;
+    }
+    double result;
+    std::from_chars_result r = std::from_chars(first, last, result, std::chars_format::fixed);
+    if (r.ec == std::errc::result_out_of_range) {
+        // Let strtod decide between infinity and zero.
+        return std::strtod(std::string(first, last).c_str(), nullptr);
+    }
+    return result;
+}
+
+std::string
+numberToString(double d) {
+    std::string r;
+    appendNumber(d, r);
+    return r;
+}
+
+void
+appendNumber(double d, std::string& r) {
+    if (std::isnan(d)) {
+        r += "NaN";
+    } else if (std::isinf(d)) {
+        r += d < 0 ? "-Infinity" : "Infinity";
+    } else if (d == 0) {
+        r += '0';               // also negative zero
+    } else {
+        // Large enough for the longest fixed representation of a double.
+        char buffer[512];
+        std::to_chars_result res = std::to_chars(buffer,
+                                                 buffer + sizeof(buffer),
+                                                 d,
+                                                 std::chars_format::fixed);
+        r.append(buffer, res.ptr);
+    }
+}
+
+}
+}
@@ -0,0 +1,63 @@
+// MIT license
+//
+// Copyright 2023 Per Nilsson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the “Software”), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#ifndef _NUMBERS_HH_
+#define _NUMBERS_HH_
+
+#include <string>
+#include <string_view>
+
+namespace Jstr {
+namespace Xpath {
+
+/**
+ * Converts a string to a number following the rules of the XPath number function.
+ * "A string that consists of optional whitespace followed by an optional minus sign
+ *  followed by a Number followed by whitespace is converted to the IEEE 754 number
+ *  that is nearest ... Any other string is converted to NaN."
+ * @param s the string to convert.
+ * @return the number or NaN.
+ */
+double
+stringToNumber(std::string_view s);
+
+/**
+ * Converts a number to a string following the rules of the XPath string function.
+ * NaN is "NaN", infinities are "Infinity" and "-Infinity", integers have no decimal
+ * point and other numbers are written without exponent using as many digits as
+ * are needed to uniquely identify the number.
+ * @param d the number to convert.
+ * @return the string representation of d.
+ */
+std::string
+numberToString(double d);
+
+/**
+ * Same as numberToString but appends the result to r.
+ */
+void
+appendNumber(double d, std::string& r);
+
+}
+}
+
+#endif
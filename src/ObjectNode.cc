@@ -30,8 +30,10 @@
 namespace Jstr {
 namespace Xpath {
     
-ObjectNode::ObjectNode(const Node* parent, const std::string& name, const nlohmann::json& json) :
-    Node(parent, name, json), _children(nullptr) {
+ObjectNode::ObjectNode(const Node* parent,
+                       const std::shared_ptr<const std::string>& name,
+                       const nlohmann::json& json) :
+    Node(parent, name, json), _children(nullptr), _partial(false) {
 }
 
 ObjectNode::~ObjectNode() {
@@ -54,6 +56,59 @@ ObjectNode::getChild(const std::string& name, std::vector<const Node*>& result)
     }
 }
 
+size_t
+ObjectNode::getChildCount(const std::string& name) const {
+    const nlohmann::json& j = getJson();
+    if (!j.is_object()) {
+        instantiateChildren();
+        return std::count_if(_children->begin(),
+                             _children->end(),
+                             [&name](const Node* n) { return n->getLocalName() == name; });
+    }
+    nlohmann::json::const_iterator child = j.find(name);
+    if (child == j.end()) {
+        return 0;
+    }
+    return child->is_array() ? child->size() : 1;
+}
+
+const Node*
+ObjectNode::getChildAt(const std::string& name, size_t i) const {
+    const nlohmann::json& j = getJson();
+    if (!j.is_object()) {
+        instantiateChildren();
+        for (const Node* n : *_children) {
+            if (n->getLocalName() == name && i-- == 0) {
+                return n;
+            }
+        }
+        return nullptr;
+    }
+    nlohmann::json::const_iterator child = j.find(name);
+    if (child == j.end() || i >= (child->is_array() ? child->size() : 1)) {
+        return nullptr;
+    }
+    // The children are ordered like the JSON members, an array member has
+    // one child per element.
+    size_t slot = i;
+    for (nlohmann::json::const_iterator k = j.begin(); k != child; ++k) {
+        slot += k->is_array() ? k->size() : 1;
+    }
+    if (_children == nullptr) {
+        size_t size = 0;
+        for (const nlohmann::json& k : j) {
+            size += k.is_array() ? k.size() : 1;
+        }
+        _children = new std::vector<const Node*>(size, nullptr);
+        _partial = true;
+    }
+    const Node*& n = (*_children)[slot];
+    if (n == nullptr) {
+        n = createChildNode(std::make_shared<const std::string>(name), *child, i);
+    }
+    return n;
+}
+
 void
 ObjectNode::getChildren(std::vector<const Node*>& result) const {
     instantiateChildren();
@@ -78,17 +133,27 @@ ObjectNode::search(const std::string& name, std::vector<const Node*>& result) co
 
 void
 ObjectNode::addChildNode(const std::string& name, const nlohmann::json& child) const {
+    // The name is shared by all nodes created from the same key.
+    std::shared_ptr<const std::string> sharedName = std::make_shared<const std::string>(name);
     if (child.is_array()) {
         for (size_t i = 0, size = child.size(); i < size; i++) {
-            Node* n = new ArrayNode(this, name, child, i);
-            _children->emplace_back(n);
+            _children->emplace_back(createChildNode(sharedName, child, i));
         }
+    } else {
+        _children->emplace_back(createChildNode(sharedName, child, 0));
+    }
+}
+
+const Node*
+ObjectNode::createChildNode(const std::shared_ptr<const std::string>& name,
+                            const nlohmann::json& child,
+                            size_t i) const {
+    if (child.is_array()) {
+        return new ArrayNode(this, name, child, i);
     } else if (child.is_object()) {
-        Node* n = new ObjectNode(this, name, child);
-        _children->emplace_back(n);
+        return new ObjectNode(this, name, child);
     } else {
-        Node* n = new LeafNode(this, name, child);
-        _children->emplace_back(n);
+        return new LeafNode(this, name, child);
     }
 }
     
@@ -100,6 +165,23 @@ ObjectNode::instantiateChildren() const {
         for (const auto& item : j.items()) {
             addChildNode(item.key(), item.value());
         }
+    } else if (_partial) {
+        // Create the children getChildAt did not create, in the same order.
+        const nlohmann::json& j = getJson();
+        size_t slot = 0;
+        for (const auto& item : j.items()) {
+            const nlohmann::json& child = item.value();
+            std::shared_ptr<const std::string> name;
+            for (size_t i = 0, size = child.is_array() ? child.size() : 1; i < size; i++, slot++) {
+                if ((*_children)[slot] == nullptr) {
+                    if (name == nullptr) {
+                        name = std::make_shared<const std::string>(item.key());
+                    }
+                    (*_children)[slot] = createChildNode(name, child, i);
+                }
+            }
+        }
+        _partial = false;
     }
 }
     
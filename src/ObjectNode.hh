@@ -32,18 +32,26 @@ namespace Xpath {
 class ObjectNode : public Node {
 public:
     ObjectNode() = delete;
-    ObjectNode(const Node* parent, const std::string& name, const nlohmann::json& json);
+    ObjectNode(const Node* parent,
+               const std::shared_ptr<const std::string>& name,
+               const nlohmann::json& json);
     ObjectNode(const ObjectNode& node) = delete;
     ~ObjectNode();
     ObjectNode& operator=(const ObjectNode& node) = delete;
     void getChild(const std::string& name, std::vector<const Node*>& result) const override;
+    size_t getChildCount(const std::string& name) const override;
+    const Node* getChildAt(const std::string& name, size_t i) const override;
     void getChildren(std::vector<const Node*>& result) const override;
     void getSubTreeNodes(std::vector<const Node*>& result) const override;
     void search(const std::string& name, std::vector<const Node*>& result) const override;
 protected:
-    void addChildNode(const std::string& name, const nlohmann::json& child) const; 
+    void addChildNode(const std::string& name, const nlohmann::json& child) const;
+    const Node* createChildNode(const std::shared_ptr<const std::string>& name,
+                                const nlohmann::json& child,
+                                size_t i) const;
     mutable std::vector<const Node*>* _children;
-private:
+    // Some of the children are nullptr, only created by getChildAt.
+    mutable bool _partial;
     virtual void instantiateChildren() const;
 };
 
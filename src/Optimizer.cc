@@ -0,0 +1,781 @@
+// MIT license
+//
+// Copyright 2023 Per Nilsson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the “Software”), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+#include <algorithm>
+#include <atomic>
+#include <typeinfo>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <sstream>
+
+#include "Utils.hh"
+#include "Functions.hh"
+#include "Optimizer.hh"
+
+namespace {
+using namespace Jstr::Xpath;
+
+std::atomic<std::ostream*> trace(nullptr);
+std::atomic<bool> enabled(true);
+
+void
+printTree(std::ostream& os, const Expr* e, size_t indent) {
+    os << std::string(indent, ' ');
+    e->print(os);
+    os << std::endl;
+    std::vector<const Expr*> children;
+    e->getChildren(children);
+    for (const Expr* child : children) {
+        printTree(os, child, indent + 2);
+    }
+    const std::list<const Expr*>* preds = e->getPredicates();
+    if (preds != nullptr) {
+        for (const Expr* pred : *preds) {
+            printTree(os, pred, indent + 2);
+        }
+    }
+}
+
+/**
+ * Rough estimate of the work needed to evaluate an expression. Searches of
+ * whole sub trees dominate and predicates run once per selected node.
+ */
+double
+estimateCost(const Expr* e) {
+    double cost = 1;
+    if (dynamic_cast<const DescendantAll*>(e) != nullptr ||
+        dynamic_cast<const DescendantSearch*>(e) != nullptr ||
+        dynamic_cast<const FollowingStep*>(e) != nullptr ||
+        dynamic_cast<const PrecedingStep*>(e) != nullptr) {
+        cost = 100;
+    } else if (dynamic_cast<const AncestorStep*>(e) != nullptr ||
+               dynamic_cast<const FollowingSiblingAll*>(e) != nullptr ||
+               dynamic_cast<const FollowingSiblingSearch*>(e) != nullptr ||
+               dynamic_cast<const PrecedingSiblingStep*>(e) != nullptr) {
+        cost = 10;
+    } else if (dynamic_cast<const AllStep*>(e) != nullptr) {
+        cost = 5;
+    } else if (dynamic_cast<const Step*>(e) != nullptr ||
+               dynamic_cast<const ChildPath*>(e) != nullptr) {
+        cost = 2;
+    }
+    std::vector<const Expr*> children;
+    e->getChildren(children);
+    for (const Expr* child : children) {
+        cost += estimateCost(child);
+    }
+    const std::list<const Expr*>* preds = e->getPredicates();
+    if (preds != nullptr) {
+        for (const Expr* pred : *preds) {
+            cost += 10 * estimateCost(pred);
+        }
+    }
+    return cost;
+}
+
+bool
+isLiteral(const Expr* e) {
+    return
+        dynamic_cast<const NumericLiteral*>(e) != nullptr ||
+        dynamic_cast<const StringLiteral*>(e) != nullptr ||
+        dynamic_cast<const BooleanLiteral*>(e) != nullptr;
+}
+
+bool
+isLocationStep(const Expr* e) {
+    return
+        dynamic_cast<const Root*>(e) != nullptr ||
+        dynamic_cast<const Step*>(e) != nullptr ||
+        dynamic_cast<const AllStep*>(e) != nullptr ||
+        dynamic_cast<const SelfStep*>(e) != nullptr ||
+        dynamic_cast<const ParentStep*>(e) != nullptr ||
+        dynamic_cast<const DescendantAll*>(e) != nullptr ||
+        dynamic_cast<const FollowingSiblingAll*>(e) != nullptr ||
+        dynamic_cast<const ChildPath*>(e) != nullptr;
+}
+
+/**
+ * Returns an indication if evaluating an expression can not throw. Relational
+ * comparisons throw for objects and arrays, variables may be unbound and
+ * functions check their arguments, only expressions without them qualify.
+ */
+bool
+cannotThrow(const Expr* e) {
+    // Functions that accept any argument, with the number of arguments allowed.
+    static const struct {
+        const char* name;
+        size_t min;
+        size_t max;
+    } functions[] = {
+        {"true", 0, 0}, {"false", 0, 0}, {"position", 0, 0}, {"last", 0, 0},
+        {"not", 1, 1}, {"boolean", 1, 1}, {"string", 0, 1}, {"number", 0, 1},
+        {"string-length", 0, 1}, {"contains", 2, 2}, {"starts-with", 2, 2}
+    };
+    std::vector<const Expr*> children;
+    e->getChildren(children);
+    if (dynamic_cast<const Path*>(e) != nullptr) {
+        // A step throws if it is given something other than a node set.
+        for (const Expr* step : children) {
+            if (!isLocationStep(step)) {
+                return false;
+            }
+        }
+    } else if (dynamic_cast<const Fun*>(e) != nullptr) {
+        bool known(false);
+        for (const auto& f : functions) {
+            if (std::strcmp(f.name, e->getName()) == 0) {
+                known = children.size() >= f.min && children.size() <= f.max;
+                break;
+            }
+        }
+        if (!known) {
+            return false;
+        }
+    } else if (!isLiteral(e) &&
+               !isLocationStep(e) &&
+               typeid(*e) != typeid(And) &&
+               typeid(*e) != typeid(Or) &&
+               typeid(*e) != typeid(Eq) &&
+               typeid(*e) != typeid(Ne) &&
+               typeid(*e) != typeid(Predicate) &&
+               typeid(*e) != typeid(PositionPredicate)) {
+        return false;
+    }
+    for (const Expr* child : children) {
+        if (!cannotThrow(child)) {
+            return false;
+        }
+    }
+    const std::list<const Expr*>* preds = e->getPredicates();
+    if (preds != nullptr) {
+        for (const Expr* pred : *preds) {
+            if (!cannotThrow(pred)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * The parser merges "//" with the step after it, merge the descendant-or-self
+ * steps that are followed by another step after other passes, e.g. "//./x".
+ */
+struct DescendantPass : Pass {
+    const char* getName() const override { return "descendant"; }
+    Expr* rewrite(Expr* e) const override {
+        Path* path = dynamic_cast<Path*>(e);
+        if (path == nullptr) {
+            return e;
+        }
+        std::list<Expr*>& exprs = path->getExprs();
+        for (std::list<Expr*>::iterator i = exprs.begin(); i != exprs.end(); ++i) {
+            std::list<Expr*>::iterator next = std::next(i);
+            if (next == exprs.end() ||
+                typeid(**i) != typeid(DescendantOrSelfAll) ||
+                (*i)->getPredicates() != nullptr) {
+                continue;
+            }
+            Expr* step = *next;
+            Expr* descendant = Step::createDescendant(step);
+            if (descendant == nullptr) {
+                continue;
+            }
+            exprs.erase(next);
+            delete *i;
+            *i = descendant;
+        }
+        return e;
+    }
+};
+
+/**
+ * Removes "." steps that are not the first step of a path, they select the
+ * same node set as the step before them.
+ */
+struct SelfStepPass : Pass {
+    const char* getName() const override { return "self-step"; }
+    Expr* rewrite(Expr* e) const override {
+        Path* path = dynamic_cast<Path*>(e);
+        if (path == nullptr) {
+            return e;
+        }
+        std::list<Expr*>& exprs = path->getExprs();
+        std::list<Expr*>::iterator i = exprs.begin();
+        if (i != exprs.end()) {
+            ++i;
+        }
+        while (i != exprs.end()) {
+            if (typeid(**i) == typeid(SelfStep) && (*i)->getPredicates() == nullptr) {
+                delete *i;
+                i = exprs.erase(i);
+            } else {
+                ++i;
+            }
+        }
+        return e;
+    }
+};
+
+/**
+ * Evaluates expressions that do not depend on the context, e.g. "1 + 2" or
+ * "not(false())", and replaces them with literals.
+ */
+struct ConstantFoldingPass : Pass {
+    const char* getName() const override { return "constant-folding"; }
+    Expr* rewrite(Expr* e) const override {
+        if (!e->isConstant() || isLiteral(e)) {
+            return e;
+        }
+        Expr* literal = nullptr;
+        try {
+            Value context(false);
+            Env env(context);
+            Value v = e->eval(env, context, 0);
+            switch (v.getType()) {
+            case Value::Number:
+                literal = new NumericLiteral(v.getNumber());
+                break;
+            case Value::Bool:
+                literal = new BooleanLiteral(v.getBoolean());
+                break;
+            case Value::String:
+                literal = new StringLiteral(v.getString());
+                break;
+            default:
+                return e;
+            }
+        } catch (const std::exception& ex) {
+            // Leave the error to evaluation.
+            return e;
+        }
+        delete e;
+        return literal;
+    }
+};
+
+/**
+ * Puts the cheaper operand of "and" and "or" first, evaluation stops after it
+ * when it decides the result. The operands are kept in order if one of them can
+ * throw, the error would be skipped or raised where it was not before.
+ */
+struct BooleanOrderPass : Pass {
+    const char* getName() const override { return "boolean-order"; }
+    Expr* rewrite(Expr* e) const override {
+        if (typeid(*e) != typeid(And) && typeid(*e) != typeid(Or)) {
+            return e;
+        }
+        BinaryExpr* b = static_cast<BinaryExpr*>(e);
+        std::vector<const Expr*> operands;
+        b->getChildren(operands);
+        if (estimateCost(operands[1]) < estimateCost(operands[0]) &&
+            cannotThrow(operands[0]) &&
+            cannotThrow(operands[1])) {
+            b->swapOperands();
+        }
+        return e;
+    }
+};
+
+/**
+ * Removes predicates that are always true. An expression with a predicate that
+ * is always false, or a path with such a step, selects nothing.
+ */
+struct DeadPredicatePass : Pass {
+    enum class Truth {True, False, Unknown};
+    const char* getName() const override { return "dead-predicate"; }
+    Expr* rewrite(Expr* e) const override {
+        Path* path = dynamic_cast<Path*>(e);
+        if (path != nullptr) {
+            for (const Expr* step : path->getExprs()) {
+                if (dynamic_cast<const EmptyNodeSet*>(step) != nullptr) {
+                    delete e;
+                    return new EmptyNodeSet();
+                }
+            }
+        }
+        if (e->getPredicates() == nullptr) {
+            return e;
+        }
+        std::list<const Expr*>* preds = const_cast<std::list<const Expr*>*>(e->takePredicates());
+        for (const Expr* pred : *preds) {
+            if (getTruth(pred) == Truth::False) {
+                deleteExprs(preds);
+                delete e;
+                return new EmptyNodeSet();
+            }
+        }
+        for (std::list<const Expr*>::iterator i = preds->begin(); i != preds->end();) {
+            if (getTruth(*i) == Truth::True) {
+                delete *i;
+                i = preds->erase(i);
+            } else {
+                ++i;
+            }
+        }
+        if (preds->empty()) {
+            delete preds;
+        } else {
+            e->addPredicates(preds);
+        }
+        return e;
+    }
+    static Truth getTruth(const Expr* pred) {
+        const Predicate* p = dynamic_cast<const Predicate*>(pred);
+        const Expr* e = p == nullptr ? nullptr : p->getExpr();
+        if (const BooleanLiteral* b = dynamic_cast<const BooleanLiteral*>(e)) {
+            return b->getBoolean() ? Truth::True : Truth::False;
+        } else if (const StringLiteral* s = dynamic_cast<const StringLiteral*>(e)) {
+            return s->getString().empty() ? Truth::False : Truth::True;
+        } else if (const NumericLiteral* n = dynamic_cast<const NumericLiteral*>(e)) {
+            // A number is a position for node sets and a boolean otherwise,
+            // zero and NaN are false for both.
+            double d = n->getNumber();
+            return d == 0 || std::isnan(d) ? Truth::False : Truth::Unknown;
+        }
+        return Truth::Unknown;
+    }
+};
+
+/**
+ * Replaces "[n]" and "[last()]" with predicates that select by index, a child
+ * step with such a predicate first only creates the selected child.
+ */
+struct PositionPass : Pass {
+    const char* getName() const override { return "position"; }
+    Expr* rewrite(Expr* e) const override {
+        if (const Predicate* p = dynamic_cast<const Predicate*>(e)) {
+            const Expr* pe = p->getExpr();
+            if (pe->getPredicates() != nullptr) {
+                return e;
+            }
+            Expr* position = nullptr;
+            if (const NumericLiteral* n = dynamic_cast<const NumericLiteral*>(pe)) {
+                position = new PositionPredicate(n->getNumber(), false);
+            } else if (dynamic_cast<const Fun*>(pe) != nullptr &&
+                       std::string(pe->getName()) == "last") {
+                position = new PositionPredicate(0, true);
+            } else {
+                return e;
+            }
+            delete e;
+            return position;
+        }
+        if (typeid(*e) != typeid(ChildStep) || e->getPredicates() == nullptr) {
+            return e;
+        }
+        std::list<const Expr*>* preds = const_cast<std::list<const Expr*>*>(e->takePredicates());
+        const PositionPredicate* position = dynamic_cast<const PositionPredicate*>(preds->front());
+        if (position == nullptr) {
+            e->addPredicates(preds);
+            return e;
+        }
+        preds->pop_front();
+        Expr* step = new ChildIndexStep(static_cast<ChildStep*>(e)->getString(), position);
+        if (preds->empty()) {
+            delete preds;
+        } else {
+            step->addPredicates(preds);
+        }
+        delete e;
+        return step;
+    }
+};
+
+/**
+ * Replaces predicates that compare the context node, or its children with a
+ * name, with a number, e.g. "[. < 2]" or "[price >= 10]", with a
+ * ComparePredicate that filters the whole node set at once.
+ */
+struct ComparePass : Pass {
+    const char* getName() const override { return "compare"; }
+    Expr* rewrite(Expr* e) const override {
+        Predicate* p = dynamic_cast<Predicate*>(e);
+        if (p == nullptr) {
+            return e;
+        }
+        const Expr* pe = p->getExpr();
+        Comparison comparison;
+        if (!getComparison(pe, comparison) || pe->getPredicates() != nullptr) {
+            return e;
+        }
+        std::vector<const Expr*> operands;
+        pe->getChildren(operands);
+        const NumericLiteral* number = getNumber(operands[1]);
+        const Expr* path = operands[0];
+        if (number == nullptr) {
+            // The number is on the left, "2 > ." is ". < 2".
+            number = getNumber(operands[0]);
+            path = operands[1];
+            comparison = flip(comparison);
+        }
+        std::string name;
+        if (number == nullptr || !getName(path, name)) {
+            return e;
+        }
+        return new ComparePredicate(p, comparison, name, number->getNumber());
+    }
+    static bool getComparison(const Expr* e, Comparison& comparison) {
+        const std::type_info& type = typeid(*e);
+        if (type == typeid(Eq)) {
+            comparison = Comparison::Eq;
+        } else if (type == typeid(Ne)) {
+            comparison = Comparison::Ne;
+        } else if (type == typeid(Lt)) {
+            comparison = Comparison::Lt;
+        } else if (type == typeid(Le)) {
+            comparison = Comparison::Le;
+        } else if (type == typeid(Gt)) {
+            comparison = Comparison::Gt;
+        } else if (type == typeid(Ge)) {
+            comparison = Comparison::Ge;
+        } else {
+            return false;
+        }
+        return true;
+    }
+    static Comparison flip(Comparison comparison) {
+        switch (comparison) {
+        case Comparison::Lt: return Comparison::Gt;
+        case Comparison::Le: return Comparison::Ge;
+        case Comparison::Gt: return Comparison::Lt;
+        case Comparison::Ge: return Comparison::Le;
+        default: return comparison;
+        }
+    }
+    static const NumericLiteral* getNumber(const Expr* e) {
+        return e->getPredicates() == nullptr ? dynamic_cast<const NumericLiteral*>(e) : nullptr;
+    }
+    // Gets the name of "name" or an empty name for ".".
+    static bool getName(const Expr* e, std::string& name) {
+        std::vector<const Expr*> steps;
+        e->getChildren(steps);
+        if (typeid(*e) != typeid(Path) || e->getPredicates() != nullptr ||
+            steps.size() != 1 || steps[0]->getPredicates() != nullptr) {
+            return false;
+        }
+        if (typeid(*steps[0]) == typeid(ChildStep)) {
+            name = static_cast<const ChildStep*>(steps[0])->getString();
+            return true;
+        }
+        return typeid(*steps[0]) == typeid(SelfStep);
+    }
+};
+
+/**
+ * Replaces consecutive child and "*" steps with one ChildPath, only the last
+ * of them may have predicates, they apply to the result of the ChildPath.
+ */
+struct FuseStepsPass : Pass {
+    const char* getName() const override { return "fuse-steps"; }
+    Expr* rewrite(Expr* e) const override {
+        Path* path = dynamic_cast<Path*>(e);
+        if (path == nullptr) {
+            return e;
+        }
+        std::list<Expr*>& exprs = path->getExprs();
+        std::list<Expr*>::iterator i = exprs.begin();
+        while (i != exprs.end()) {
+            std::vector<std::string> names;
+            std::list<Expr*>::iterator end = i;
+            while (end != exprs.end() && isChildStep(*end)) {
+                names.push_back(Step::isAllStep(*end) ? "" : static_cast<Step*>(*end)->getString());
+                if ((*end++)->getPredicates() != nullptr) {
+                    break;
+                }
+            }
+            if (names.size() < 2) {
+                i = end == i ? std::next(i) : end;
+                continue;
+            }
+            Expr* fused = new ChildPath(names);
+            fused->addPredicates((*std::prev(end))->takePredicates());
+            for (std::list<Expr*>::iterator j = i; j != end; ++j) {
+                delete *j;
+            }
+            i = exprs.erase(i, end);
+            exprs.insert(i, fused);
+        }
+        return e;
+    }
+    static bool isChildStep(const Expr* e) {
+        return typeid(*e) == typeid(ChildStep) || typeid(*e) == typeid(AllStep);
+    }
+};
+
+/**
+ * Memoizes relative paths in predicates that start with parent steps, e.g.
+ * "../../limit" in "/r/a/b[. < ../../limit]" is evaluated once per ancestor
+ * instead of once per "b".
+ */
+struct MemoizePass : Pass {
+    const char* getName() const override { return "memoize"; }
+    Expr* rewrite(Expr* e) const override {
+        if (dynamic_cast<Predicate*>(e) != nullptr) {
+            e->rewriteChildren([this](Expr* child) { return memoize(child); });
+        }
+        return e;
+    }
+    Expr* memoize(Expr* e) const {
+        if (dynamic_cast<MemoizedPath*>(e) != nullptr) {
+            return e;
+        }
+        e->rewriteChildren([this](Expr* child) { return memoize(child); });
+        Path* path = dynamic_cast<Path*>(e);
+        if (path == nullptr) {
+            return e;
+        }
+        size_t depth = 0;
+        for (const Expr* step : path->getExprs()) {
+            if (typeid(*step) != typeid(ParentStep) || step->getPredicates() != nullptr) {
+                break;
+            }
+            depth++;
+        }
+        if (depth == 0 || depth == path->getExprs().size()) {
+            return e;
+        }
+        // The value is memoized without the predicates of the path, they are
+        // applied where the path was used.
+        const std::list<const Expr*>* preds = e->takePredicates();
+        Expr* memoized = new MemoizedPath(e, depth);
+        memoized->addPredicates(preds);
+        return memoized;
+    }
+};
+
+/**
+ * Evaluates context independent sub expressions at most once per evaluation,
+ * e.g. "/r/limit" in "/r/a[. < /r/limit]" is evaluated once instead of once
+ * per "a". Expressions are cached when they are part of a predicate or when
+ * the same expression occurs more than once, equal expressions share a slot.
+ * A path with predicates on its last step shares the path without them, e.g.
+ * "/a/b" in "count(/a/b[. < 4]) = count(/a/b)".
+ */
+struct HoistPass : Pass {
+    struct Occurrences {
+        size_t count = 0;
+        bool inPredicate = false;
+    };
+    using Counts = std::map<std::string, Occurrences>;
+    using Slots = std::map<std::string, size_t>;
+    const char* getName() const override { return "hoist"; }
+    bool isWholeTree() const override { return true; }
+    Expr* rewrite(Expr* e) const override {
+        Counts counts;
+        count(e, false, counts);
+        Slots slots;
+        return hoist(e, false, counts, slots);
+    }
+    static bool isCandidate(const Expr* e) {
+        if (!e->isContextIndependent() ||
+            isLiteral(e) ||
+            dynamic_cast<const VarRef*>(e) != nullptr ||
+            dynamic_cast<const Root*>(e) != nullptr ||
+            dynamic_cast<const EmptyNodeSet*>(e) != nullptr ||
+            dynamic_cast<const Cached*>(e) != nullptr) {
+            return false;
+        }
+        std::vector<const Expr*> children;
+        e->getChildren(children);
+        return !children.empty();
+    }
+    static std::string getKey(const Expr* e) {
+        std::stringstream ss;
+        printTree(ss, e, 0);
+        return ss.str();
+    }
+    /**
+     * Returns the last step of a path if it has predicates.
+     */
+    static Expr* getFilteredStep(Expr* e) {
+        Path* path = dynamic_cast<Path*>(e);
+        if (path == nullptr || path->getExprs().size() < 2) {
+            return nullptr;
+        }
+        Expr* step = path->getExprs().back();
+        return step->getPredicates() == nullptr ? nullptr : step;
+    }
+    static std::string getStemKey(Expr* e, Expr* step) {
+        const std::list<const Expr*>* preds = step->takePredicates();
+        std::string key = getKey(e);
+        step->addPredicates(preds);
+        return key;
+    }
+    static bool isPredicate(const Expr* e, const Expr* child) {
+        const std::list<const Expr*>* preds = e->getPredicates();
+        return
+            preds != nullptr &&
+            std::find(preds->begin(), preds->end(), child) != preds->end();
+    }
+    void count(Expr* e, bool inPredicate, Counts& counts) const {
+        if (isCandidate(e)) {
+            Occurrences& o = counts[getKey(e)];
+            o.count++;
+            o.inPredicate = o.inPredicate || inPredicate;
+            if (Expr* step = getFilteredStep(e)) {
+                counts[getStemKey(e, step)].count++;
+            }
+        }
+        e->rewriteChildren([this, e, inPredicate, &counts](Expr* child) {
+            count(child, inPredicate || isPredicate(e, child), counts);
+            return child;
+        });
+    }
+    Expr* hoist(Expr* e, bool inPredicate, const Counts& counts, Slots& slots) const {
+        if (!isCandidate(e)) {
+            hoistChildren(e, inPredicate, counts, slots);
+            return e;
+        }
+        // A cached expression is evaluated once, whatever it contains is not
+        // repeated for the nodes of an enclosing predicate.
+        std::string key = getKey(e);
+        if (inPredicate || counts.at(key).count > 1) {
+            size_t slot = getSlot(key, slots);
+            hoistChildren(e, false, counts, slots);
+            // The value is cached without the predicates of the expression,
+            // they are applied where the expression was used.
+            const std::list<const Expr*>* preds = e->takePredicates();
+            Expr* cached = new Cached(e, slot);
+            cached->addPredicates(preds);
+            return cached;
+        }
+        Expr* step = getFilteredStep(e);
+        if (step == nullptr || counts.at(getStemKey(e, step)).count < 2) {
+            hoistChildren(e, false, counts, slots);
+            return e;
+        }
+        size_t slot = getSlot(getStemKey(e, step), slots);
+        const std::list<const Expr*>* preds = step->takePredicates();
+        hoistChildren(e, false, counts, slots);
+        Expr* cached = new Cached(e, slot);
+        cached->addPredicates(preds);
+        cached->rewriteChildren([this, cached, &counts, &slots](Expr* child) {
+            return isPredicate(cached, child) ? hoist(child, true, counts, slots) : child;
+        });
+        // Function arguments are evaluated without their own predicates, a
+        // path applies the predicates of its steps.
+        return new Path(cached);
+    }
+    void hoistChildren(Expr* e, bool inPredicate, const Counts& counts, Slots& slots) const {
+        e->rewriteChildren([this, e, inPredicate, &counts, &slots](Expr* child) {
+            return hoist(child, inPredicate || isPredicate(e, child), counts, slots);
+        });
+    }
+    static size_t getSlot(const std::string& key, Slots& slots) {
+        Slots::iterator i = slots.find(key);
+        if (i == slots.end()) {
+            i = slots.emplace(key, slots.size()).first;
+        }
+        return i->second;
+    }
+};
+
+}
+
+namespace Jstr {
+namespace Xpath {
+
+Optimizer::Optimizer() {
+    addPass(std::make_unique<DescendantPass>());
+    addPass(std::make_unique<SelfStepPass>());
+    addPass(std::make_unique<ConstantFoldingPass>());
+    addPass(std::make_unique<DeadPredicatePass>());
+    addPass(std::make_unique<PositionPass>());
+    addPass(std::make_unique<ComparePass>());
+    addPass(std::make_unique<FuseStepsPass>());
+    addPass(std::make_unique<BooleanOrderPass>());
+    addPass(std::make_unique<MemoizePass>());
+    addPass(std::make_unique<HoistPass>());
+}
+
+void
+Optimizer::addPass(std::unique_ptr<const Pass> pass) {
+    _passes.push_back(std::move(pass));
+}
+
+void
+Optimizer::clearPasses() {
+    _passes.clear();
+}
+
+Expr*
+Optimizer::optimize(Expr* e) const {
+    if (!enabled.load()) {
+        return e;
+    }
+    std::ostream* os = trace.load();
+    if (os != nullptr) {
+        *os << "before optimization:" << std::endl;
+        print(*os, e);
+    }
+    for (const std::unique_ptr<const Pass>& pass : _passes) {
+        e = pass->isWholeTree() ? pass->rewrite(e) : run(*pass, e);
+    }
+    if (os != nullptr) {
+        *os << "after optimization:" << std::endl;
+        print(*os, e);
+    }
+    return e;
+}
+
+Expr*
+Optimizer::run(const Pass& pass, Expr* e) const {
+    e->rewriteChildren([this, &pass](Expr* child) { return run(pass, child); });
+    return pass.rewrite(e);
+}
+
+void
+Optimizer::print(std::ostream& os, const Expr* e) {
+    printTree(os, e, 0);
+}
+
+void
+Optimizer::setTrace(std::ostream* os) {
+    trace.store(os);
+}
+
+void
+Optimizer::setEnabled(bool on) {
+    enabled.store(on);
+}
+
+void
+setOptimizerTrace(std::ostream* os) {
+    Optimizer::setTrace(os);
+    if (os != nullptr) {
+        // Cached expressions would not be parsed and printed again.
+        ExpressionCache::getDefault().clear();
+    }
+}
+
+void
+setOptimizerEnabled(bool on) {
+    Optimizer::setEnabled(on);
+    // Cached expressions were parsed with the previous setting.
+    ExpressionCache::getDefault().clear();
+}
+
+}
+}
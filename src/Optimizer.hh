@@ -0,0 +1,106 @@
+// MIT license
+//
+// Copyright 2023 Per Nilsson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the “Software”), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+#ifndef _OPTIMIZER_HH_
+#define _OPTIMIZER_HH_
+
+#include <memory>
+#include <vector>
+#include <ostream>
+
+#include "Expr.hh"
+
+namespace Jstr {
+namespace Xpath {
+
+/**
+ * A rewrite of expression trees run by the optimizer.
+ */
+class Pass {
+public:
+    virtual ~Pass() = default;
+    virtual const char* getName() const = 0;
+    /**
+     * Rewrites one expression, its children are already rewritten.
+     * @param e the expression, the pass takes ownership of it.
+     * @return the expression to use instead of e, or e itself.
+     */
+    virtual Expr* rewrite(Expr* e) const = 0;
+    /**
+     * Returns an indication if the pass needs to see the whole tree at once,
+     * it is then only given the root.
+     * @return true if rewrite is only called for the root.
+     */
+    virtual bool isWholeTree() const { return false; }
+};
+
+/**
+ * Rewrites parsed expressions before they are evaluated. Each pass walks the
+ * whole tree bottom up, the passes run in the order they were added.
+ */
+class Optimizer {
+public:
+    /**
+     * Creates an optimizer with the default passes: descendant normalization,
+     * redundant step removal, constant folding, dead predicate removal,
+     * position predicates, numeric comparison predicates, fusing of child
+     * steps, ordering of boolean operands by cost, memoizing
+     * of paths relative to ancestors and caching of context independent sub
+     * expressions.
+     */
+    Optimizer();
+    Optimizer(const Optimizer&) = delete;
+    Optimizer& operator=(const Optimizer&) = delete;
+    void addPass(std::unique_ptr<const Pass> pass);
+    void clearPasses();
+    /**
+     * Runs the passes over the tree.
+     * @param e the tree, the optimizer takes ownership of it.
+     * @return the optimized tree.
+     */
+    Expr* optimize(Expr* e) const;
+    /**
+     * Prints a tree with one expression per line, children are indented.
+     * @param os the stream to print to.
+     * @param e the tree.
+     */
+    static void print(std::ostream& os, const Expr* e);
+    /**
+     * Sets the stream trees are printed to before and after optimization.
+     * @param os the stream, nullptr turns tracing off.
+     */
+    static void setTrace(std::ostream* os);
+    /**
+     * Turns optimization on or off, trees are left as parsed when it is off.
+     * @param on false turns optimization off.
+     */
+    static void setEnabled(bool on);
+private:
+    Expr* run(const Pass& pass, Expr* e) const;
+    std::vector<std::unique_ptr<const Pass>> _passes;
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,125 @@
+// MIT license
+//
+// Copyright 2023 Per Nilsson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the “Software”), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "RootNode.hh"
+
+namespace Jstr {
+namespace Xpath {
+
+// DocumentOrder
+DocumentOrder::DocumentOrder(const Node* root) {
+    // Preorder without recursion, the children are pushed in reverse.
+    std::vector<const Node*> stack(1, root);
+    std::vector<const Node*> children;
+    while (!stack.empty()) {
+        const Node* n = stack.back();
+        stack.pop_back();
+        _positions.emplace(n, _nodes.size());
+        _names[n->getLocalName()].push_back(_nodes.size());
+        _nodes.push_back(n);
+        children.clear();
+        n->getChildren(children);
+        stack.insert(stack.end(), children.rbegin(), children.rend());
+    }
+    _ends.resize(_nodes.size());
+    _previousSiblings.assign(_nodes.size(), npos);
+    for (size_t i = 0, size = _nodes.size(); i < size; i++) {
+        _ends[i] = i;
+    }
+    // Descendants come after their ancestors, the subtree of a node is done
+    // before the node is reached.
+    for (size_t i = _nodes.size(); i-- > 1; ) {
+        size_t parent = getPosition(_nodes[i]->getParent());
+        _ends[parent] = std::max(_ends[parent], _ends[i]);
+        // The first node after the subtree of a child is its next sibling.
+        size_t next = _ends[i] + 1;
+        if (next < _nodes.size() && _nodes[next]->getParent() == _nodes[parent]) {
+            _previousSiblings[next] = i;
+        }
+    }
+}
+
+size_t
+DocumentOrder::size() const {
+    return _nodes.size();
+}
+
+size_t
+DocumentOrder::getPosition(const Node* n) const {
+    std::unordered_map<const Node*, size_t>::const_iterator i = _positions.find(n);
+    if (i == _positions.end()) {
+        throw std::runtime_error("DocumentOrder::getPosition, the node is not part of the document.");
+    }
+    return i->second;
+}
+
+const Node*
+DocumentOrder::getNode(size_t position) const {
+    return _nodes[position];
+}
+
+size_t
+DocumentOrder::getEnd(size_t position) const {
+    return _ends[position];
+}
+
+size_t
+DocumentOrder::getPreviousSibling(size_t position) const {
+    return _previousSiblings[position];
+}
+
+const std::vector<size_t>&
+DocumentOrder::getPositions(const std::string& name) const {
+    static const std::vector<size_t> none;
+    std::unordered_map<std::string, std::vector<size_t>>::const_iterator i = _names.find(name);
+    return i == _names.end() ? none : i->second;
+}
+
+// RootNode
+RootNode::RootNode(const nlohmann::json& json) :
+    ObjectNode(nullptr, std::make_shared<const std::string>(), json) {
+}
+
+const DocumentOrder&
+RootNode::getOrder() const {
+    std::call_once(_once, [this]() { _order.reset(new DocumentOrder(this)); });
+    return *_order;
+}
+
+const DocumentOrder&
+RootNode::getOrder(const Node* n) {
+    while (n->getParent() != nullptr) {
+        n = n->getParent();
+    }
+    const RootNode* root = dynamic_cast<const RootNode*>(n);
+    if (root == nullptr) {
+        throw std::runtime_error("RootNode::getOrder, the node is not part of a document.");
+    }
+    return root->getOrder();
+}
+
+}
+}
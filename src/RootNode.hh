@@ -0,0 +1,113 @@
+// MIT license
+//
+// Copyright 2023 Per Nilsson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the “Software”), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+#ifndef _ROOT_NODE_HH_
+#define _ROOT_NODE_HH_
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <Jstr.hh>
+
+#include "ObjectNode.hh"
+
+namespace Jstr {
+namespace Xpath {
+
+/**
+ * The nodes of a document numbered in document order. The nodes of a subtree
+ * have consecutive positions, the following and preceding axes are ranges of
+ * positions.
+ */
+class DocumentOrder {
+public:
+    /**
+     * Numbers the nodes, all nodes of the document are created.
+     * @param root the root of the document.
+     */
+    explicit DocumentOrder(const Node* root);
+    DocumentOrder(const DocumentOrder&) = delete;
+    DocumentOrder& operator=(const DocumentOrder&) = delete;
+    size_t size() const;
+    /**
+     * Returns the position of a node, the root is at 0.
+     * @param n the node.
+     * @return the position.
+     */
+    size_t getPosition(const Node* n) const;
+    const Node* getNode(size_t position) const;
+    /**
+     * Returns the position of the last node of a subtree.
+     * @param position the position of the root of the subtree.
+     * @return the position.
+     */
+    size_t getEnd(size_t position) const;
+    /**
+     * Returns the position of the previous sibling of a node.
+     * @param position the position of the node.
+     * @return the position or npos if the node is the first child.
+     */
+    size_t getPreviousSibling(size_t position) const;
+    /**
+     * Returns the positions of the nodes with a local name.
+     * @param name the local name.
+     * @return the positions in ascending order, empty if there are none.
+     */
+    const std::vector<size_t>& getPositions(const std::string& name) const;
+    static constexpr size_t npos = static_cast<size_t>(-1);
+private:
+    std::vector<const Node*> _nodes;
+    std::vector<size_t> _ends;
+    std::vector<size_t> _previousSiblings;
+    std::unordered_map<const Node*, size_t> _positions;
+    std::unordered_map<std::string, std::vector<size_t>> _names;
+};
+
+/**
+ * The root node of a document, it numbers the document the first time the
+ * order is needed.
+ */
+class RootNode : public ObjectNode {
+public:
+    explicit RootNode(const nlohmann::json& json);
+    RootNode(const RootNode& node) = delete;
+    RootNode& operator=(const RootNode& node) = delete;
+    const DocumentOrder& getOrder() const;
+    /**
+     * Returns the order of the document of a node.
+     * @param n the node.
+     * @return the order.
+     * @throws std::runtime_error if the node is not part of a document.
+     */
+    static const DocumentOrder& getOrder(const Node* n);
+private:
+    mutable std::once_flag _once;
+    mutable std::unique_ptr<const DocumentOrder> _order;
+};
+
+}
+}
+
+#endif
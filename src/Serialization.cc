@@ -0,0 +1,592 @@
+// MIT license
+//
+// Copyright 2023 Per Nilsson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the “Software”), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <typeindex>
+#include <unordered_map>
+#include <vector>
+
+#include "Expr.hh"
+#include "Functions.hh"
+#include "Serialization.hh"
+
+namespace Jstr {
+namespace Xpath {
+
+namespace {
+
+const char magic[] = {'N', 'L', 'J', 'X'};
+
+// Incremented whenever a tag or the arguments of a node change, blobs of
+// other versions are rejected.
+const size_t formatVersion = 1;
+
+// Bounds the recursion of read for blobs that are not valid.
+const size_t maxDepth = 10000;
+
+enum class Tag : uint8_t {
+    Path = 1,
+    Root,
+    AllStep,
+    AncestorStep,
+    AncestorSelfStep,
+    ChildStep,
+    ParentStep,
+    ParentMatchStep,
+    SelfStep,
+    SelfMatchStep,
+    Predicate,
+    PositionPredicate,
+    ComparePredicate,
+    ChildIndexStep,
+    ChildPath,
+    DescendantAll,
+    DescendantOrSelfAll,
+    DescendantSearch,
+    DescendantOrSelfSearch,
+    FollowingSiblingAll,
+    FollowingSiblingSearch,
+    StringLiteral,
+    NumericLiteral,
+    BooleanLiteral,
+    EmptyNodeSet,
+    Union,
+    Or,
+    And,
+    Eq,
+    Ne,
+    Lt,
+    Gt,
+    Le,
+    Ge,
+    Plus,
+    Minus,
+    Mul,
+    Div,
+    Mod,
+    VarRef,
+    Cached,
+    MemoizedPath,
+    Fun,
+    // Added after Fun, blobs of the same version keep their tags.
+    FollowingStep,
+    PrecedingStep,
+    PrecedingSiblingStep
+};
+
+Tag
+getTag(const Expr* e) {
+    static const std::unordered_map<std::type_index, Tag> tags = {
+        {typeid(Path), Tag::Path},
+        {typeid(Root), Tag::Root},
+        {typeid(AllStep), Tag::AllStep},
+        {typeid(AncestorStep), Tag::AncestorStep},
+        {typeid(AncestorSelfStep), Tag::AncestorSelfStep},
+        {typeid(ChildStep), Tag::ChildStep},
+        {typeid(ParentStep), Tag::ParentStep},
+        {typeid(ParentMatchStep), Tag::ParentMatchStep},
+        {typeid(SelfStep), Tag::SelfStep},
+        {typeid(SelfMatchStep), Tag::SelfMatchStep},
+        {typeid(Predicate), Tag::Predicate},
+        {typeid(PositionPredicate), Tag::PositionPredicate},
+        {typeid(ComparePredicate), Tag::ComparePredicate},
+        {typeid(ChildIndexStep), Tag::ChildIndexStep},
+        {typeid(ChildPath), Tag::ChildPath},
+        {typeid(DescendantAll), Tag::DescendantAll},
+        {typeid(DescendantOrSelfAll), Tag::DescendantOrSelfAll},
+        {typeid(DescendantSearch), Tag::DescendantSearch},
+        {typeid(DescendantOrSelfSearch), Tag::DescendantOrSelfSearch},
+        {typeid(FollowingSiblingAll), Tag::FollowingSiblingAll},
+        {typeid(FollowingSiblingSearch), Tag::FollowingSiblingSearch},
+        {typeid(StringLiteral), Tag::StringLiteral},
+        {typeid(NumericLiteral), Tag::NumericLiteral},
+        {typeid(BooleanLiteral), Tag::BooleanLiteral},
+        {typeid(EmptyNodeSet), Tag::EmptyNodeSet},
+        {typeid(Union), Tag::Union},
+        {typeid(Or), Tag::Or},
+        {typeid(And), Tag::And},
+        {typeid(Eq), Tag::Eq},
+        {typeid(Ne), Tag::Ne},
+        {typeid(Lt), Tag::Lt},
+        {typeid(Gt), Tag::Gt},
+        {typeid(Le), Tag::Le},
+        {typeid(Ge), Tag::Ge},
+        {typeid(Plus), Tag::Plus},
+        {typeid(Minus), Tag::Minus},
+        {typeid(Mul), Tag::Mul},
+        {typeid(Div), Tag::Div},
+        {typeid(Mod), Tag::Mod},
+        {typeid(VarRef), Tag::VarRef},
+        {typeid(Cached), Tag::Cached},
+        {typeid(MemoizedPath), Tag::MemoizedPath},
+        {typeid(FollowingStep), Tag::FollowingStep},
+        {typeid(PrecedingStep), Tag::PrecedingStep},
+        {typeid(PrecedingSiblingStep), Tag::PrecedingSiblingStep}
+    };
+    std::unordered_map<std::type_index, Tag>::const_iterator i = tags.find(typeid(*e));
+    if (i != tags.end()) {
+        return i->second;
+    }
+    // Each function has its own class, they are created by name.
+    if (dynamic_cast<const Fun*>(e) != nullptr) {
+        return Tag::Fun;
+    }
+    throw std::runtime_error(std::string("serialize, can not serialize ") + e->getName());
+}
+
+class Writer {
+public:
+    Writer(std::string& blob) : _blob(blob) {}
+    void writeHeader() {
+        _blob.append(magic, sizeof(magic));
+        writeSize(formatVersion);
+    }
+    void write(const Expr* e) {
+        Tag tag = getTag(e);
+        writeByte(static_cast<uint8_t>(tag));
+        std::vector<const Expr*> children;
+        e->getChildren(children);
+        writeSize(children.size());
+        for (const Expr* child : children) {
+            write(child);
+        }
+        writeArguments(tag, e);
+        // 0 for no list, the parser does not create empty lists.
+        const std::list<const Expr*>* preds = e->getPredicates();
+        writeSize(preds == nullptr ? 0 : preds->size() + 1);
+        if (preds != nullptr) {
+            for (const Expr* pred : *preds) {
+                write(pred);
+            }
+        }
+    }
+private:
+    void writeArguments(Tag tag, const Expr* e) {
+        switch (tag) {
+        case Tag::AncestorStep:
+        case Tag::AncestorSelfStep:
+        case Tag::ChildStep:
+        case Tag::ParentMatchStep:
+        case Tag::SelfMatchStep:
+        case Tag::DescendantSearch:
+        case Tag::DescendantOrSelfSearch:
+        case Tag::FollowingSiblingSearch:
+        case Tag::FollowingStep:
+        case Tag::PrecedingStep:
+        case Tag::PrecedingSiblingStep:
+            writeString(static_cast<const Step*>(e)->getString());
+            break;
+        case Tag::ChildIndexStep: {
+            const ChildIndexStep* step = static_cast<const ChildIndexStep*>(e);
+            writeString(step->getString());
+            writePosition(step->getPosition());
+            break;
+        }
+        case Tag::PositionPredicate:
+            writePosition(static_cast<const PositionPredicate*>(e));
+            break;
+        case Tag::ComparePredicate: {
+            const ComparePredicate* compare = static_cast<const ComparePredicate*>(e);
+            writeByte(static_cast<uint8_t>(compare->getComparison()));
+            writeString(compare->getChildName());
+            writeNumber(compare->getNumber());
+            break;
+        }
+        case Tag::ChildPath: {
+            const std::vector<std::string>& names = static_cast<const ChildPath*>(e)->getNames();
+            writeSize(names.size());
+            for (const std::string& name : names) {
+                writeString(name);
+            }
+            break;
+        }
+        case Tag::StringLiteral:
+            writeString(static_cast<const StringLiteral*>(e)->getString());
+            break;
+        case Tag::NumericLiteral:
+            writeNumber(static_cast<const NumericLiteral*>(e)->getNumber());
+            break;
+        case Tag::BooleanLiteral:
+            writeByte(static_cast<const BooleanLiteral*>(e)->getBoolean());
+            break;
+        case Tag::VarRef:
+            writeString(static_cast<const VarRef*>(e)->getString());
+            break;
+        case Tag::Cached:
+            writeSize(static_cast<const Cached*>(e)->getSlot());
+            break;
+        case Tag::MemoizedPath:
+            writeSize(static_cast<const MemoizedPath*>(e)->getDepth());
+            break;
+        case Tag::Fun:
+            writeString(e->getName());
+            break;
+        default:
+            break;
+        }
+    }
+    void writePosition(const PositionPredicate* position) {
+        writeNumber(position->getPosition());
+        writeByte(position->isLast());
+    }
+    void writeByte(uint8_t b) {
+        _blob.push_back(static_cast<char>(b));
+    }
+    // Variable length, 7 bits per byte.
+    void writeSize(size_t n) {
+        while (n >= 0x80) {
+            writeByte(static_cast<uint8_t>(n | 0x80));
+            n >>= 7;
+        }
+        writeByte(static_cast<uint8_t>(n));
+    }
+    // Little endian, whatever the byte order of the host.
+    void writeNumber(double d) {
+        uint64_t bits;
+        std::memcpy(&bits, &d, sizeof(bits));
+        for (int i = 0; i < 8; i++) {
+            writeByte(static_cast<uint8_t>(bits >> (8 * i)));
+        }
+    }
+    void writeString(const std::string& s) {
+        writeSize(s.size());
+        _blob.append(s);
+    }
+    std::string& _blob;
+};
+
+class Reader {
+public:
+    Reader(std::string_view blob) : _blob(blob), _pos(0), _depth(0), _cached(0), _slots(0) {}
+    void readHeader() {
+        if (_blob.size() < sizeof(magic) || std::memcmp(_blob.data(), magic, sizeof(magic)) != 0) {
+            throw std::runtime_error("deserialize, not a serialized expression");
+        }
+        _pos = sizeof(magic);
+        size_t version = readSize();
+        if (version != formatVersion) {
+            throw std::runtime_error("deserialize, unsupported format version " +
+                                     std::to_string(version) + ", expected " +
+                                     std::to_string(formatVersion));
+        }
+    }
+    void readEnd() const {
+        if (_pos != _blob.size()) {
+            throw std::runtime_error("deserialize, trailing bytes");
+        }
+        // The optimizer numbers the slots from 0, Cached nodes of the same
+        // expression share one.
+        if (_slots > _cached) {
+            throw std::runtime_error("deserialize, invalid cache slot");
+        }
+    }
+    Expr* read() {
+        if (++_depth > maxDepth) {
+            throw std::runtime_error("deserialize, expression nested too deep");
+        }
+        Tag tag = static_cast<Tag>(readByte());
+        // Each node takes at least one byte.
+        size_t size = readCount();
+        std::vector<std::unique_ptr<Expr>> children;
+        for (size_t i = 0; i < size; i++) {
+            children.emplace_back(read());
+        }
+        std::unique_ptr<Expr> e(create(tag, children));
+        size = readCount();
+        if (size > 0) {
+            std::unique_ptr<std::list<const Expr*>, void (*)(std::list<const Expr*>*)> preds(
+                new std::list<const Expr*>(), deleteExprs);
+            for (size_t i = 1; i < size; i++) {
+                preds->push_back(read());
+            }
+            e->addPredicates(preds.release());
+        }
+        _depth--;
+        return e.release();
+    }
+private:
+    using Children = std::vector<std::unique_ptr<Expr>>;
+    static void deleteExprs(std::list<const Expr*>* exprs) {
+        for (const Expr* e : *exprs) {
+            delete e;
+        }
+        delete exprs;
+    }
+    Expr* create(Tag tag, Children& c) {
+        switch (tag) {
+        case Tag::Path: {
+            std::unique_ptr<Path> path(new Path(c.empty() ? nullptr : c[0].release()));
+            for (size_t i = 1; i < c.size(); i++) {
+                path->addBack(c[i].release());
+            }
+            return path.release();
+        }
+        case Tag::Root:
+            return leaf<Root>(c);
+        case Tag::AllStep:
+            return leaf<AllStep>(c);
+        case Tag::AncestorStep:
+            return withString<AncestorStep>(c);
+        case Tag::AncestorSelfStep:
+            return withString<AncestorSelfStep>(c);
+        case Tag::ChildStep:
+            return withString<ChildStep>(c);
+        case Tag::ParentStep:
+            return leaf<ParentStep>(c);
+        case Tag::ParentMatchStep:
+            return withString<ParentMatchStep>(c);
+        case Tag::SelfStep:
+            return leaf<SelfStep>(c);
+        case Tag::SelfMatchStep:
+            return withString<SelfMatchStep>(c);
+        case Tag::Predicate:
+            checkChildren(c, 1, 1);
+            return new Predicate(c[0].release());
+        case Tag::PositionPredicate:
+            checkChildren(c, 0, 0);
+            return readPosition();
+        case Tag::ComparePredicate: {
+            checkChildren(c, 1, 1);
+            if (dynamic_cast<const Predicate*>(c[0].get()) == nullptr) {
+                throw std::runtime_error("deserialize, invalid compare predicate");
+            }
+            uint8_t comparison = readByte();
+            if (comparison > static_cast<uint8_t>(Comparison::Ge)) {
+                throw std::runtime_error("deserialize, invalid comparison");
+            }
+            std::string name = readString();
+            double d = readNumber();
+            return new ComparePredicate(static_cast<const Predicate*>(c[0].release()),
+                                        static_cast<Comparison>(comparison),
+                                        name,
+                                        d);
+        }
+        case Tag::ChildIndexStep: {
+            checkChildren(c, 0, 0);
+            std::string name = readString();
+            return new ChildIndexStep(name, readPosition());
+        }
+        case Tag::ChildPath: {
+            checkChildren(c, 0, 0);
+            std::vector<std::string> names(readCount());
+            for (std::string& name : names) {
+                name = readString();
+            }
+            return new ChildPath(names);
+        }
+        case Tag::DescendantAll:
+            return leaf<DescendantAll>(c);
+        case Tag::DescendantOrSelfAll:
+            return leaf<DescendantOrSelfAll>(c);
+        case Tag::DescendantSearch:
+            return withString<DescendantSearch>(c);
+        case Tag::DescendantOrSelfSearch:
+            return withString<DescendantOrSelfSearch>(c);
+        case Tag::FollowingSiblingAll:
+            return leaf<FollowingSiblingAll>(c);
+        case Tag::FollowingSiblingSearch:
+            return withString<FollowingSiblingSearch>(c);
+        case Tag::FollowingStep:
+            return withString<FollowingStep>(c);
+        case Tag::PrecedingStep:
+            return withString<PrecedingStep>(c);
+        case Tag::PrecedingSiblingStep:
+            return withString<PrecedingSiblingStep>(c);
+        case Tag::StringLiteral:
+            return withString<StringLiteral>(c);
+        case Tag::NumericLiteral:
+            checkChildren(c, 0, 0);
+            return new NumericLiteral(readNumber());
+        case Tag::BooleanLiteral:
+            checkChildren(c, 0, 0);
+            return new BooleanLiteral(readByte() != 0);
+        case Tag::EmptyNodeSet:
+            return leaf<EmptyNodeSet>(c);
+        case Tag::Union:
+            return binary<Union>(c);
+        case Tag::Or:
+            return binary<Or>(c);
+        case Tag::And:
+            return binary<And>(c);
+        case Tag::Eq:
+            return binary<Eq>(c);
+        case Tag::Ne:
+            return binary<Ne>(c);
+        case Tag::Lt:
+            return binary<Lt>(c);
+        case Tag::Gt:
+            return binary<Gt>(c);
+        case Tag::Le:
+            return binary<Le>(c);
+        case Tag::Ge:
+            return binary<Ge>(c);
+        case Tag::Plus:
+            return binary<Plus>(c);
+        case Tag::Minus:
+            // Negation has no right operand.
+            checkChildren(c, 1, 2);
+            return new Minus(c[0].release(), c.size() == 2 ? c[1].release() : nullptr);
+        case Tag::Mul:
+            return binary<Mul>(c);
+        case Tag::Div:
+            return binary<Div>(c);
+        case Tag::Mod:
+            return binary<Mod>(c);
+        case Tag::VarRef:
+            return withString<VarRef>(c);
+        case Tag::Cached: {
+            checkChildren(c, 1, 1);
+            size_t slot = readSize();
+            // Each Cached node takes bytes of the blob, the slots are fewer.
+            if (slot >= _blob.size()) {
+                throw std::runtime_error("deserialize, invalid cache slot");
+            }
+            _cached++;
+            _slots = std::max(_slots, slot + 1);
+            return new Cached(c[0].release(), slot);
+        }
+        case Tag::MemoizedPath: {
+            checkChildren(c, 1, 1);
+            size_t depth = readSize();
+            return new MemoizedPath(c[0].release(), depth);
+        }
+        case Tag::Fun: {
+            std::string name = readString();
+            std::list<const Expr*>* args = nullptr;
+            if (!c.empty()) {
+                args = new std::list<const Expr*>();
+                for (std::unique_ptr<Expr>& arg : c) {
+                    args->push_back(arg.release());
+                }
+            }
+            return Fun::create(name, args);
+        }
+        default:
+            throw std::runtime_error("deserialize, invalid tag");
+        }
+    }
+    template <typename T>
+    Expr* leaf(const Children& c) {
+        checkChildren(c, 0, 0);
+        return new T();
+    }
+    // Nodes with a name or string as their only argument.
+    template <typename T>
+    Expr* withString(const Children& c) {
+        checkChildren(c, 0, 0);
+        return new T(readString());
+    }
+    template <typename T>
+    Expr* binary(Children& c) {
+        checkChildren(c, 2, 2);
+        return new T(c[0].release(), c[1].release());
+    }
+    void checkChildren(const Children& c, size_t min, size_t max) const {
+        if (c.size() < min || c.size() > max) {
+            throw std::runtime_error("deserialize, invalid number of children");
+        }
+    }
+    PositionPredicate* readPosition() {
+        double position = readNumber();
+        bool last = readByte() != 0;
+        return new PositionPredicate(position, last);
+    }
+    uint8_t readByte() {
+        if (_pos >= _blob.size()) {
+            throw std::runtime_error("deserialize, truncated blob");
+        }
+        return static_cast<uint8_t>(_blob[_pos++]);
+    }
+    size_t readSize() {
+        size_t n = 0;
+        for (unsigned shift = 0; ; shift += 7) {
+            if (shift >= 64) {
+                throw std::runtime_error("deserialize, invalid size");
+            }
+            uint8_t b = readByte();
+            // The last byte holds only the highest bit.
+            if (shift == 63 && (b & 0x7f) > 1) {
+                throw std::runtime_error("deserialize, invalid size");
+            }
+            n |= static_cast<size_t>(b & 0x7f) << shift;
+            if ((b & 0x80) == 0) {
+                return n;
+            }
+        }
+    }
+    // A size of items that take at least one byte each.
+    size_t readCount() {
+        size_t n = readSize();
+        if (n > _blob.size() - _pos + 1) {
+            throw std::runtime_error("deserialize, truncated blob");
+        }
+        return n;
+    }
+    double readNumber() {
+        uint64_t bits = 0;
+        for (int i = 0; i < 8; i++) {
+            bits |= static_cast<uint64_t>(readByte()) << (8 * i);
+        }
+        double d;
+        std::memcpy(&d, &bits, sizeof(d));
+        return d;
+    }
+    std::string readString() {
+        size_t size = readSize();
+        if (size > _blob.size() - _pos) {
+            throw std::runtime_error("deserialize, truncated blob");
+        }
+        std::string s(_blob.substr(_pos, size));
+        _pos += size;
+        return s;
+    }
+    std::string_view _blob;
+    size_t _pos;
+    size_t _depth;
+    // The number of Cached nodes and the number of slots they use.
+    size_t _cached;
+    size_t _slots;
+};
+
+}
+
+void
+serialize(const Expr* e, std::string& blob) {
+    Writer writer(blob);
+    writer.writeHeader();
+    writer.write(e);
+}
+
+std::unique_ptr<Expr>
+deserialize(std::string_view blob) {
+    Reader reader(blob);
+    reader.readHeader();
+    std::unique_ptr<Expr> e(reader.read());
+    reader.readEnd();
+    return e;
+}
+
+}
+}
@@ -0,0 +1,59 @@
+// MIT license
+//
+// Copyright 2023 Per Nilsson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the “Software”), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+#ifndef _SERIALIZATION_HH_
+#define _SERIALIZATION_HH_
+
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace Jstr {
+namespace Xpath {
+
+class Expr;
+
+/**
+ * Appends an expression tree to a binary blob. The blob starts with a magic
+ * number and the format version, each node is written as a tag, its
+ * children, its own arguments and its predicates.
+ * @param e the expression, as optimized.
+ * @param blob the result.
+ */
+void
+serialize(const Expr* e, std::string& blob);
+
+/**
+ * Reads an expression tree written by serialize, the tree is not optimized
+ * again.
+ * @param blob the blob.
+ * @return the expression.
+ * @throws std::runtime_error if the blob has another format version or is
+ * not valid.
+ */
+std::unique_ptr<Expr>
+deserialize(std::string_view blob);
+
+}
+}
+#endif
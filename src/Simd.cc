@@ -0,0 +1,226 @@
+// MIT license
+//
+// Copyright 2023 Per Nilsson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the “Software”), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+#include <cstring>
+#include <stdexcept>
+
+#include "Simd.hh"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define JSTR_AVX2 1
+#include <immintrin.h>
+#endif
+
+namespace {
+using namespace Jstr::Xpath;
+
+template <class Compare>
+void
+compareScalar(const double* values, size_t begin, size_t size, double d, uint8_t* mask, Compare c) {
+    for (size_t i = begin; i < size; i++) {
+        mask[i] = c(values[i], d);
+    }
+}
+
+void
+compareScalar(const double* values,
+              size_t begin,
+              size_t size,
+              Comparison comparison,
+              double d,
+              uint8_t* mask) {
+    switch (comparison) {
+    case Comparison::Eq:
+        compareScalar(values, begin, size, d, mask, [](double l, double r) { return l == r; });
+        break;
+    case Comparison::Ne:
+        compareScalar(values, begin, size, d, mask, [](double l, double r) { return l != r; });
+        break;
+    case Comparison::Lt:
+        compareScalar(values, begin, size, d, mask, [](double l, double r) { return l < r; });
+        break;
+    case Comparison::Le:
+        compareScalar(values, begin, size, d, mask, [](double l, double r) { return l <= r; });
+        break;
+    case Comparison::Gt:
+        compareScalar(values, begin, size, d, mask, [](double l, double r) { return l > r; });
+        break;
+    case Comparison::Ge:
+        compareScalar(values, begin, size, d, mask, [](double l, double r) { return l >= r; });
+        break;
+    default:
+        throw std::runtime_error("compareEach, unknown comparison");
+    }
+}
+
+#ifdef JSTR_AVX2
+// The four mask bytes for each result of _mm256_movemask_pd.
+const uint8_t masks[16][4] = {
+    {0, 0, 0, 0}, {1, 0, 0, 0}, {0, 1, 0, 0}, {1, 1, 0, 0},
+    {0, 0, 1, 0}, {1, 0, 1, 0}, {0, 1, 1, 0}, {1, 1, 1, 0},
+    {0, 0, 0, 1}, {1, 0, 0, 1}, {0, 1, 0, 1}, {1, 1, 0, 1},
+    {0, 0, 1, 1}, {1, 0, 1, 1}, {0, 1, 1, 1}, {1, 1, 1, 1}
+};
+
+// Returns the number of values compared, the rest is left to compareScalar.
+template <int Predicate>
+__attribute__((target("avx2")))
+size_t
+compareAvx2(const double* values, size_t size, double d, uint8_t* mask) {
+    __m256d r = _mm256_set1_pd(d);
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4) {
+        __m256d l = _mm256_loadu_pd(values + i);
+        int bits = _mm256_movemask_pd(_mm256_cmp_pd(l, r, Predicate));
+        std::memcpy(mask + i, masks[bits], 4);
+    }
+    return i;
+}
+
+// Finds candidates by their first and last byte, pattern has at least two bytes.
+__attribute__((target("avx2")))
+size_t
+findStringAvx2(std::string_view s, std::string_view pattern) {
+    size_t m = pattern.size();
+    const char* p = pattern.data();
+    const __m256i first = _mm256_set1_epi8(p[0]);
+    const __m256i last = _mm256_set1_epi8(p[m - 1]);
+    // The number of positions the pattern can start at.
+    size_t n = s.size() - m + 1;
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        const char* q = s.data() + i;
+        __m256i f0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(q));
+        __m256i l0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(q + m - 1));
+        __m256i f1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(q + 32));
+        __m256i l1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(q + 31 + m));
+        __m256i e0 = _mm256_and_si256(_mm256_cmpeq_epi8(f0, first), _mm256_cmpeq_epi8(l0, last));
+        __m256i e1 = _mm256_and_si256(_mm256_cmpeq_epi8(f1, first), _mm256_cmpeq_epi8(l1, last));
+        __m256i e = _mm256_or_si256(e0, e1);
+        if (_mm256_testz_si256(e, e)) {
+            continue;
+        }
+        uint64_t bits = static_cast<uint32_t>(_mm256_movemask_epi8(e0)) |
+            static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(e1))) << 32;
+        for (; bits != 0; bits &= bits - 1) {
+            size_t b = __builtin_ctzll(bits);
+            if (std::memcmp(q + b + 1, p + 1, m - 2) == 0) {
+                return i + b;
+            }
+        }
+    }
+    for (; i < n; i++) {
+        if (s[i] == p[0] && std::memcmp(s.data() + i + 1, p + 1, m - 1) == 0) {
+            return i;
+        }
+    }
+    return std::string_view::npos;
+}
+
+// Continuation bytes are 0x80 to 0xbf, -128 to -65 as signed bytes.
+__attribute__((target("avx2,popcnt")))
+size_t
+countCharactersAvx2(const char* s, size_t size, size_t& count) {
+    const __m256i continuation = _mm256_set1_epi8(-65);
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+        uint32_t bits = _mm256_movemask_epi8(_mm256_cmpgt_epi8(bytes, continuation));
+        count += _mm_popcnt_u32(bits);
+    }
+    return i;
+}
+
+size_t
+compareAvx2(const double* values, size_t size, Comparison comparison, double d, uint8_t* mask) {
+    static const bool supported = __builtin_cpu_supports("avx2");
+    if (!supported) {
+        return 0;
+    }
+    // Ordered predicates are false for NaN, Ne is unordered and true for NaN.
+    switch (comparison) {
+    case Comparison::Eq: return compareAvx2<_CMP_EQ_OQ>(values, size, d, mask);
+    case Comparison::Ne: return compareAvx2<_CMP_NEQ_UQ>(values, size, d, mask);
+    case Comparison::Lt: return compareAvx2<_CMP_LT_OQ>(values, size, d, mask);
+    case Comparison::Le: return compareAvx2<_CMP_LE_OQ>(values, size, d, mask);
+    case Comparison::Gt: return compareAvx2<_CMP_GT_OQ>(values, size, d, mask);
+    case Comparison::Ge: return compareAvx2<_CMP_GE_OQ>(values, size, d, mask);
+    default: return 0;
+    }
+}
+#endif
+
+}
+
+namespace Jstr {
+namespace Xpath {
+
+void
+compareEach(const double* values, size_t size, Comparison comparison, double d, uint8_t* mask) {
+    size_t begin = 0;
+#ifdef JSTR_AVX2
+    begin = compareAvx2(values, size, comparison, d, mask);
+#endif
+    compareScalar(values, begin, size, comparison, d, mask);
+}
+
+size_t
+findString(std::string_view s, std::string_view pattern) {
+    size_t m = pattern.size();
+    if (m < 2 || m > s.size()) {
+        return s.find(pattern);
+    }
+    // memchr is faster when the first byte is rare, e.g. not in s at all.
+    const void* first = std::memchr(s.data(), pattern[0], s.size() - m + 1);
+    if (first == nullptr) {
+        return std::string_view::npos;
+    }
+    size_t begin = static_cast<const char*>(first) - s.data();
+#ifdef JSTR_AVX2
+    static const bool supported = __builtin_cpu_supports("avx2");
+    if (supported) {
+        size_t p = findStringAvx2(s.substr(begin), pattern);
+        return p == std::string_view::npos ? p : begin + p;
+    }
+#endif
+    return s.find(pattern, begin);
+}
+
+size_t
+countCharacters(std::string_view s) {
+    size_t count = 0;
+    size_t begin = 0;
+#ifdef JSTR_AVX2
+    static const bool supported = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+    if (supported) {
+        begin = countCharactersAvx2(s.data(), s.size(), count);
+    }
+#endif
+    for (size_t i = begin, size = s.size(); i < size; i++) {
+        count += static_cast<int8_t>(s[i]) > -65;
+    }
+    return count;
+}
+
+}
+}
@@ -0,0 +1,79 @@
+// MIT license
+//
+// Copyright 2023 Per Nilsson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the “Software”), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+#ifndef _SIMD_HH_
+#define _SIMD_HH_
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace Jstr {
+namespace Xpath {
+
+enum class Comparison {
+    Eq,
+    Ne,
+    Lt,
+    Le,
+    Gt,
+    Ge
+};
+
+/**
+ * Compares numbers with a constant. AVX2 is used when the processor supports
+ * it, four numbers are compared at a time.
+ * @param values the numbers.
+ * @param size the number of values.
+ * @param comparison the comparison, values[i] is the left operand.
+ * @param d the right operand.
+ * @param mask the result, mask[i] is 1 if the comparison is true and 0
+ *        otherwise. Comparisons with NaN are false except Ne.
+ */
+void
+compareEach(const double* values, size_t size, Comparison comparison, double d, uint8_t* mask);
+
+/**
+ * Finds the first occurrence of a pattern, same as s.find(pattern). Candidates
+ * are positions where both the first and the last byte of the pattern match,
+ * with AVX2 they are found 64 positions at a time.
+ * @param s the string to search.
+ * @param pattern the pattern.
+ * @return the position or std::string_view::npos.
+ */
+size_t
+findString(std::string_view s, std::string_view pattern);
+
+/**
+ * Counts the characters of an UTF-8 string, i.e. the bytes that are not
+ * continuation bytes. AVX2 is used when the processor supports it.
+ * @param s the string.
+ * @return the number of characters.
+ */
+size_t
+countCharacters(std::string_view s);
+
+}
+}
+
+#endif
@@ -0,0 +1,184 @@
+// MIT license
+//
+// Copyright 2023 Per Nilsson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the “Software”), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+#include <map>
+
+#include "ThreadPool.hh"
+
+namespace {
+
+thread_local bool runningTask = false;
+
+}
+
+namespace Jstr {
+namespace Xpath {
+
+ThreadPool::ThreadPool(size_t threads) : _pending(0), _stop(false) {
+    size_t workers = threads > 1 ? threads - 1 : 0;
+    for (size_t i = 0; i < workers; i++) {
+        _queues.emplace_back(new Queue());
+    }
+    for (size_t i = 0; i < workers; i++) {
+        _workers.emplace_back(&ThreadPool::work, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _wake.notify_all();
+    for (std::thread& worker : _workers) {
+        worker.join();
+    }
+}
+
+ThreadPool&
+ThreadPool::get(size_t threads) {
+    static std::mutex mutex;
+    static std::map<size_t, std::unique_ptr<ThreadPool>> pools;
+    std::lock_guard<std::mutex> lock(mutex);
+    std::unique_ptr<ThreadPool>& pool = pools[threads];
+    if (pool == nullptr) {
+        pool.reset(new ThreadPool(threads));
+    }
+    return *pool;
+}
+
+bool
+ThreadPool::inTask() {
+    return runningTask;
+}
+
+size_t
+ThreadPool::getThreads() const {
+    return _workers.size() + 1;
+}
+
+void
+ThreadPool::run(size_t n, const std::function<void(size_t)>& f) {
+    Job job;
+    job.f = &f;
+    job.remaining = n;
+    job.errors.resize(n);
+    if (_queues.empty() || n < 2 || runningTask) {
+        for (size_t i = 0; i < n; i++) {
+            execute(Task{&job, i});
+        }
+    } else {
+        // Consecutive tasks go to the same queue, the owner takes them from
+        // the front and thieves from the back.
+        _pending += n;
+        for (size_t i = 0; i < n; i++) {
+            Queue& queue = *_queues[i * _queues.size() / n];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back(Task{&job, i});
+        }
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+        }
+        _wake.notify_all();
+        Task task;
+        while (job.remaining > 0 && steal(_queues.size(), task)) {
+            execute(task);
+        }
+        std::unique_lock<std::mutex> lock(_mutex);
+        _done.wait(lock, [&job] { return job.remaining == 0; });
+    }
+    for (const std::exception_ptr& error : job.errors) {
+        if (error != nullptr) {
+            std::rethrow_exception(error);
+        }
+    }
+}
+
+void
+ThreadPool::work(size_t self) {
+    for (;;) {
+        Task task;
+        if (pop(self, task) || steal(self, task)) {
+            execute(task);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(_mutex);
+        _wake.wait(lock, [this] { return _stop || _pending > 0; });
+        if (_stop) {
+            return;
+        }
+    }
+}
+
+bool
+ThreadPool::pop(size_t self, Task& task) {
+    Queue& queue = *_queues[self];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty()) {
+        return false;
+    }
+    task = queue.tasks.front();
+    queue.tasks.pop_front();
+    _pending--;
+    return true;
+}
+
+bool
+ThreadPool::steal(size_t self, Task& task) {
+    // self is the number of queues for a thread that has no queue.
+    for (size_t k = 1, size = _queues.size(); k <= size; k++) {
+        size_t i = (self + k) % size;
+        if (i == self) {
+            continue;
+        }
+        Queue& queue = *_queues[i];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty()) {
+            task = queue.tasks.back();
+            queue.tasks.pop_back();
+            _pending--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void
+ThreadPool::execute(const Task& task) {
+    bool nested = runningTask;
+    runningTask = true;
+    try {
+        (*task.job->f)(task.index);
+    } catch (...) {
+        task.job->errors[task.index] = std::current_exception();
+    }
+    runningTask = nested;
+    // The job may be gone as soon as the last task is counted.
+    if (--task.job->remaining == 0) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _done.notify_all();
+    }
+}
+
+}
+}
@@ -0,0 +1,109 @@
+// MIT license
+//
+// Copyright 2023 Per Nilsson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the “Software”), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+#ifndef _THREAD_POOL_HH_
+#define _THREAD_POOL_HH_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Jstr {
+namespace Xpath {
+
+/**
+ * Worker threads that run the chunks of parallel evaluations. Each worker has
+ * its own queue of tasks and steals from the back of the other queues when
+ * its own queue is empty. The thread that runs a job takes tasks as well
+ * while it waits for the job to finish.
+ */
+class ThreadPool {
+public:
+    /**
+     * @param threads the number of threads working on a job, the calling
+     * thread included.
+     */
+    ThreadPool(size_t threads);
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    ~ThreadPool();
+    /**
+     * Returns the pool shared by all evaluations with the same number of
+     * threads, it is created on first use.
+     * @param threads the number of threads, the calling thread included.
+     * @return the pool.
+     */
+    static ThreadPool& get(size_t threads);
+    /**
+     * Returns an indication if the calling thread runs a task, jobs started
+     * by tasks are not split again.
+     * @return true inside a task.
+     */
+    static bool inTask();
+    size_t getThreads() const;
+    /**
+     * Calls f for each index in [0, n) and returns when all calls returned.
+     * If calls throw, the exception of the smallest index is rethrown.
+     * @param n the number of tasks.
+     * @param f the task.
+     */
+    void run(size_t n, const std::function<void(size_t)>& f);
+private:
+    struct Job {
+        const std::function<void(size_t)>* f;
+        std::atomic<size_t> remaining;
+        std::vector<std::exception_ptr> errors;
+    };
+    struct Task {
+        Job* job;
+        size_t index;
+    };
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+    void work(size_t self);
+    bool pop(size_t self, Task& task);
+    bool steal(size_t self, Task& task);
+    void execute(const Task& task);
+    std::vector<std::unique_ptr<Queue>> _queues;
+    std::vector<std::thread> _workers;
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    std::condition_variable _done;
+    // Tasks queued and not taken yet.
+    std::atomic<size_t> _pending;
+    bool _stop;
+};
+
+}
+}
+
+#endif
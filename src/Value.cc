@@ -23,21 +23,168 @@
 #include <sstream>
 #include <iostream>
 #include <stdexcept>
+#include <unordered_set>
 #include <Jstr.hh>
 #include "Utils.hh"
+#include "Numbers.hh"
+#include "NodeSetPool.hh"
 
 namespace {
 
 using namespace Jstr::Xpath;
 const std::vector<const Node*> _emptyNodeSet;
 
+// Existential equality of two node sets. The string values of the smaller
+// node set are hashed and probed with the string values of the larger one.
+bool
+nodeSetEqual(const std::vector<const Node*>& l, const std::vector<const Node*>& r) {
+    const std::vector<const Node*>& small = l.size() < r.size() ? l : r;
+    const std::vector<const Node*>& large = l.size() < r.size() ? r : l;
+    if (small.empty()) {
+        return false;
+    }
+    std::string buffer;
+    if (small.size() == 1) {
+        std::string smallBuffer;
+        std::string_view s = small[0]->getStringView(smallBuffer);
+        for (const Node* n : large) {
+            if (n->getStringView(buffer) == s) {
+                return true;
+            }
+        }
+        return false;
+    }
+    // String values that are not JSON strings are kept in built, reserved up front
+    // so the views in strings stay valid.
+    std::vector<std::string> built;
+    built.reserve(small.size());
+    std::unordered_set<std::string_view> strings;
+    strings.reserve(small.size());
+    for (const Node* n : small) {
+        std::string_view s = n->getStringView(buffer);
+        if (s.data() == buffer.data()) {
+            built.emplace_back(buffer);
+            s = built.back();
+        }
+        strings.insert(s);
+    }
+    for (const Node* n : large) {
+        if (strings.count(n->getStringView(buffer)) != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Existential inequality of two node sets. There is a pair of nodes with
+// different string values unless all nodes in both sets have the same value.
+bool
+nodeSetNotEqual(const std::vector<const Node*>& l, const std::vector<const Node*>& r) {
+    if (l.empty() || r.empty()) {
+        return false;
+    }
+    std::string firstBuffer;
+    std::string buffer;
+    std::string_view s = l[0]->getStringView(firstBuffer);
+    for (size_t i = 1, size = l.size(); i < size; i++) {
+        if (l[i]->getStringView(buffer) != s) {
+            return true;
+        }
+    }
+    for (const Node* n : r) {
+        if (n->getStringView(buffer) != s) {
+            return true;
+        }
+    }
+    return false;
+}
+
+enum class Relation {
+    Lt,
+    Le,
+    Gt,
+    Ge
+};
+
+bool
+compareNumbers(double l, double r, Relation relation) {
+    switch (relation) {
+    case Relation::Lt: return l < r;
+    case Relation::Le: return l <= r;
+    case Relation::Gt: return l > r;
+    case Relation::Ge: return l >= r;
+    default:
+        throw std::runtime_error("Value::compare, unkown relation");
+    }
+}
+
+double
+getNodeNumber(const Node* n) {
+    const nlohmann::json& j = n->getJson();
+    if (j.is_number()) {
+        return j.get<double>();
+    }
+    std::string buffer;
+    return stringToNumber(n->getStringView(buffer));
+}
+
+// Finds the smallest or largest number in a node set, NaN is ignored.
+// Returns false if there is no such number.
+bool
+getExtreme(const std::vector<const Node*>& ns, bool largest, double& result) {
+    bool found(false);
+    for (const Node* n : ns) {
+        if (!n->isValue()) {
+            throw std::runtime_error("Value::compare, can not compare objects or arrays");
+        }
+        double d = getNodeNumber(n);
+        if (!std::isnan(d) && (!found || (largest ? d > result : d < result))) {
+            result = d;
+            found = true;
+        }
+    }
+    return found;
+}
+
+// A node set takes part in an ordering relation if any of its nodes does.
+// It is enough to compare the smallest or largest numbers of the node sets.
+// Example: l < r is true if min(l) < max(r).
+bool
+compare(const Value& l, const Value& r, Relation relation) {
+    Value::Type lt = l.getType();
+    Value::Type rt = r.getType();
+    if (lt != Value::NodeSet && rt != Value::NodeSet) {
+        return compareNumbers(l.getNumber(), r.getNumber(), relation);
+    } else if (lt == Value::Bool || rt == Value::Bool) {
+        return compareNumbers(l.getBoolean(), r.getBoolean(), relation);
+    }
+    bool less = relation == Relation::Lt || relation == Relation::Le;
+    double ln;
+    double rn;
+    if (lt == Value::NodeSet) {
+        if (!getExtreme(l.getNodeSet(), !less, ln)) {
+            return false;
+        }
+    } else {
+        ln = l.getNumber();
+    }
+    if (rt == Value::NodeSet) {
+        if (!getExtreme(r.getNodeSet(), less, rn)) {
+            return false;
+        }
+    } else {
+        rn = r.getNumber();
+    }
+    return compareNumbers(ln, rn, relation);
+}
+
 }
 
 namespace Jstr {
 namespace Xpath {
 
 Value::Value() : _type(NodeSet) {
-    _d.ns = new std::vector<const Node*>();
+    _d.ns = NodeSetPool::acquire();
 }
 
 Value::Value(const Value& v) : _type(Number) { // type here is just dummy
@@ -56,21 +203,28 @@ Value::Value(bool b) : _type(Bool) {
     _d.b = b;
 }
 
-Value::Value(const char* s) : _type(String) {
-    _d.s = new std::string(s);
-}
+Value::Value(const char* s) : _type(String), _s(std::make_shared<const std::string>(s)) {}
 
-Value::Value(const std::string& s) : _type(String) {
-    _d.s = new std::string(s);
-}
+Value::Value(const std::string& s) : _type(String), _s(std::make_shared<const std::string>(s)) {}
+
+Value::Value(std::string&& s) :
+    _type(String), _s(std::make_shared<const std::string>(std::move(s))) {}
+
+Value::Value(const std::shared_ptr<const std::string>& s) : _type(String), _s(s) {}
 
 Value::Value(const Node* node) : _type(NodeSet) {
-    _d.ns = new std::vector<const Node*>();
+    _d.ns = NodeSetPool::acquire();
     _d.ns->emplace_back(node);
 }
 
 Value::Value(const std::vector<const Node*>& ns) : _type(NodeSet) {
-    _d.ns = new std::vector<const Node*>(ns);
+    _d.ns = NodeSetPool::acquire();
+    _d.ns->assign(ns.begin(), ns.end());
+}
+
+Value::Value(std::vector<const Node*>&& ns) : _type(NodeSet) {
+    _d.ns = NodeSetPool::acquire();
+    _d.ns->swap(ns);
 }
 
 Value
@@ -78,11 +232,12 @@ Value::nodeSetUnion(const Value& v) const {
     if (!(_type == NodeSet && v._type == NodeSet)) {
         throw std::runtime_error("Union::eval both values must be node sets");
     }
-    std::vector<const Node*> result = *_d.ns;
+    ScratchNodeSet result;
+    result->assign(_d.ns->begin(), _d.ns->end());
     for (const Node* n : *v._d.ns) {
-        addIfUnique(result, n);
+        addIfUnique(*result, n);
     }
-    return Value(result);
+    return Value(std::move(*result));
 }
 
 Value&
@@ -115,20 +270,10 @@ Value::getNumber() const {
     switch (_type) {
     case Number: return _d.n;
     case Bool: return _d.b;
-    case String: {
-        if (_d.s->empty()) {
-            return NAN;
-        } else {
-            try {
-                std::stod(*_d.s);
-            } catch (const std::exception& e) {
-                return NAN;
-            }
-        }
-    }
+    case String: return stringToNumber(*_s);
     case NodeSet: {
-        const std::string& s = getString();
-        return s.empty() ? NAN : std::stod(s);
+        std::string buffer;
+        return stringToNumber(getStringView(buffer));
     }
     default:
         throw std::runtime_error("Value::getNumber(): unkown type");
@@ -140,7 +285,7 @@ Value::getBoolean() const {
     switch(_type) {
     case Number: return !(_d.n == 0 || std::isnan(_d.n));
     case Bool: return _d.b;
-    case String: return !_d.s->empty();
+    case String: return !_s->empty();
     case NodeSet: return !_d.ns->empty();
     default:
         throw std::runtime_error("Value::getBoolean(): unkown type");
@@ -155,8 +300,9 @@ Value::getStringValue() const {
     case String: return getString();
     case NodeSet: {
         std::string r;
+        std::string buffer;
         for (const Node* n :  *_d.ns) {
-            r += n->getString(); // TODO: r should be input parameter
+            r += n->getStringView(buffer);
         }
         return r;
     }
@@ -168,30 +314,30 @@ Value::getStringValue() const {
 std::string
 Value::getString() const {
     switch (_type) {
-    case Number: {
-        if (std::isnan(_d.n)) {
-            return "NaN";
-        } else {
-            std::stringstream ss;
-            ss << _d.n;
-            const std::string& s = ss.str();
-            if (s == "inf") {   // TODO do this without string comparison
-                return "Infinity";
-            } else if (s == "-inf") {
-                return "-Infinity";
-            } else {
-                return s;
-            }
-        }
-    }
+    case Number: return numberToString(_d.n);
     case Bool: return _d.b ? "true" : "false";
-    case String: return *(_d.s);
+    case String: return *_s;
     case NodeSet:  return _d.ns->empty() ? "" : (*_d.ns->begin())->getString();
     default:
         throw std::runtime_error("Value::getString(): unkown type");
     }
 }
 
+std::string_view
+Value::getStringView(std::string& buffer) const {
+    switch (_type) {
+    case Number:
+        buffer.clear();
+        appendNumber(_d.n, buffer);
+        return buffer;
+    case Bool: return _d.b ? "true" : "false";
+    case String: return *_s;
+    case NodeSet: return _d.ns->empty() ? "" : (*_d.ns->begin())->getStringView(buffer);
+    default:
+        throw std::runtime_error("Value::getStringView(): unkown type");
+    }
+}
+
 const Node*
 Value::getNode(size_t pos) const {
     if (_type != NodeSet) {
@@ -223,9 +369,11 @@ Value::getNodeSetSize() const {
 Value
 Value::getLocalName() const {
     if (_type == NodeSet && !_d.ns->empty()) {
-        return Value((*_d.ns->begin())->getLocalName());
+        return Value((*_d.ns->begin())->getSharedLocalName());
     } else {
-        return Value("");
+        static const std::shared_ptr<const std::string> empty =
+            std::make_shared<const std::string>();
+        return Value(empty);
     }
 }
 
@@ -240,24 +388,19 @@ Value::getRoot() const {
 bool
 Value::operator==(const Value& xd) const {
     if (_type == NodeSet && xd._type == NodeSet) {
-        for (const Node* l : getNodeSet()) {
-            if (xd == l->getString()) {
-                return true;
-            }
-        }
-        return false;
+        return nodeSetEqual(*_d.ns, *xd._d.ns);
     } else if (_type == NodeSet) {
         switch (xd._type) {
         case Number: return *this == xd.getNumber();
         case Bool: return *this == xd.getBoolean();
-        case String: return *this == xd.getString();
+        case String: return *this == std::string_view(*xd._s);
         default: throw std::runtime_error("Value::operator==, unkown type _type==NodeSet");
         }
     } else if (xd._type == NodeSet){
         switch (_type) {
         case Number: return xd == getNumber();
         case Bool: return xd == getBoolean();
-        case String: return xd == getString();
+        case String: return xd == std::string_view(*_s);
         default: throw std::runtime_error("Value::operator==, unkown type xd._type==NodeSet");
         }
     } else if (_type == Bool || xd._type == Bool) {
@@ -265,31 +408,28 @@ Value::operator==(const Value& xd) const {
     } else if (_type == Number || xd._type == Bool) {
         return getNumber() == xd.getNumber();
     } else {
-        return getString() == xd.getString();
+        std::string lb;
+        std::string rb;
+        return getStringView(lb) == xd.getStringView(rb);
     }
 }
 
 bool
 Value::operator!=(const Value& xd) const {
     if (_type == NodeSet && xd._type == NodeSet) {
-        for (const Node* l : getNodeSet()) {
-            if (xd != l->getString()) {
-                return true;
-            }
-        }
-        return false;
+        return nodeSetNotEqual(*_d.ns, *xd._d.ns);
     } else if (_type == NodeSet) {
         switch (xd._type) {
         case Number: return *this != xd.getNumber();
         case Bool: return *this != xd.getBoolean();
-        case String: return *this != xd.getString();
+        case String: return *this != std::string_view(*xd._s);
         default: throw std::runtime_error("Value::operator!=, unkown type _type==NodeSet");
         }
     } else if (xd._type == NodeSet){
         switch (_type) {
         case Number: return xd != getNumber();
         case Bool: return xd != getBoolean();
-        case String: return xd != getString();
+        case String: return xd != std::string_view(*_s);
         default: throw std::runtime_error("Value::operator!=, unkown type xd._type==NodeSet");
         }
     } else if (_type == Bool || xd._type == Bool) {
@@ -297,36 +437,26 @@ Value::operator!=(const Value& xd) const {
     } else if (_type == Number || xd._type == Number) {
         return getNumber() != xd.getNumber();
     } else {
-        return getString() != xd.getString();
+        std::string lb;
+        std::string rb;
+        return getStringView(lb) != xd.getStringView(rb);
     }
 }
 
 bool Value::operator<(const Value& v) const {
-    checkOrderingRelationArgs(v);
-    return getNumber() < v.getNumber();
+    return compare(*this, v, Relation::Lt);
 }
 
 bool Value::operator<=(const Value& v) const {
-    checkOrderingRelationArgs(v);
-    return getNumber() <= v.getNumber();
+    return compare(*this, v, Relation::Le);
 }
 
 bool Value::operator>(const Value& v) const {
-    checkOrderingRelationArgs(v);
-    return getNumber() > v.getNumber();
+    return compare(*this, v, Relation::Gt);
 }
 
 bool Value::operator>=(const Value& v) const {
-    checkOrderingRelationArgs(v);
-    return getNumber() >= v.getNumber();
-}
-
-void
-Value::checkOrderingRelationArgs(const Value& v) const {
-    if (!isValue() || !v.isValue()) {
-        std::string m("Value::checkOrderingRelationArgs, can not compare node sets");
-        throw std::runtime_error(m);
-    }
+    return compare(*this, v, Relation::Ge);
 }
 
 void
@@ -341,10 +471,11 @@ Value::assign(const Value& xd) {
         _d.b = xd._d.b;
         break;
     case String:
-        _d.s = new std::string(*xd._d.s);
+        _s = xd._s;
         break;
     case NodeSet:
-        _d.ns = new std::vector<const Node*>(*xd._d.ns);
+        _d.ns = NodeSetPool::acquire();
+        _d.ns->assign(xd._d.ns->begin(), xd._d.ns->end());
         break;
     default:
         throw std::runtime_error("Value::assign: unkown type");
@@ -363,7 +494,7 @@ Value::exchange(Value&& xd) {
         _d.b = xd._d.b;
         break;
     case String:
-        _d.s = std::exchange(xd._d.s, nullptr);
+        _s = std::move(xd._s);
         break;
     case NodeSet:
         _d.ns = std::exchange(xd._d.ns, nullptr);
@@ -377,11 +508,10 @@ void
 Value::clear() {
     switch (_type) {
     case String:
-        delete _d.s;
-        _d.s = nullptr;
+        _s.reset();
         break;
     case NodeSet:
-        delete _d.ns;
+        NodeSetPool::release(_d.ns);
         _d.ns = nullptr;
         break;
     default:
@@ -20,11 +20,14 @@
 // FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
 // DEALINGS IN THE SOFTWARE.
 
+#include <sstream>
+
 #include "xpath10_driver.hh"
 #include "xpath10_parser.hh"
+#include "Optimizer.hh"
 
 xpath10_driver::xpath10_driver() :
-    trace_scanning(false), trace_parsing(false) {
+    scanner(nullptr), trace_parsing(false), trace_scanning(false) {
 }
 
 xpath10_driver::~xpath10_driver() {}
@@ -32,20 +35,41 @@ xpath10_driver::~xpath10_driver() {}
 int
 xpath10_driver::parse (const std::string& s) {
     xpath = s;
+    _error.clear();
     scan_begin ();
-    yy::xpath10_parser parser (*this);
-    parser.set_debug_level (trace_parsing);
-    int res = parser.parse ();
+    int res;
+    try {
+        yy::xpath10_parser parser (*this);
+        parser.set_debug_level (trace_parsing);
+        res = parser.parse ();
+    } catch (...) {
+        scan_end ();
+        throw;
+    }
     scan_end ();
+    if (res == 0 && result != nullptr) {
+        static const Jstr::Xpath::Optimizer optimizer;
+        result.reset(optimizer.optimize(result.release()));
+    }
     return res;
 }
 
 void
 xpath10_driver::error (const yy::location& l, const std::string& m) {
-    std::cerr << l << ": " << m << std::endl;
+    std::stringstream ss;
+    ss << l << ": " << m;
+    error(ss.str());
 }
 
 void
 xpath10_driver::error (const std::string& m) {
-    std::cerr << m << std::endl;
+    if (!_error.empty()) {
+        _error += ", ";
+    }
+    _error += m;
+}
+
+const std::string&
+xpath10_driver::getError() const {
+    return _error;
 }
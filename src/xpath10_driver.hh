@@ -26,12 +26,15 @@
 #include <string>
 #include <memory>
 #include "xpath10_parser.hh"
+// The state of a reentrant flex scanner.
+typedef void* yyscan_t;
 // Tell Flex the lexer's prototype ...
 # define YY_DECL                                                    \
-    yy::xpath10_parser::symbol_type yylex (xpath10_driver& driver)
+    yy::xpath10_parser::symbol_type yylex (xpath10_driver& driver, yyscan_t yyscanner)
 // ... and declare it for the parser's sake.
 YY_DECL;
-// Conducting the whole scanning and parsing of Calc++.
+// Conducting the whole scanning and parsing of Calc++. Each driver has its
+// own scanner, drivers can parse on several threads at once.
 class xpath10_driver
 {
 public:
@@ -41,17 +44,29 @@ public:
     // Handling the scanner.
     void scan_begin ();
     void scan_end ();
-    // Run the parser on file F.
-    // Return 0 on success.
+    // Run the parser on the expression.
+    // Return 0 on success, getError() tells why it failed.
     int parse(const std::string& xpath);
-    // Used later to pass the file name to the location tracker.
-    std::unique_ptr<const Expr> result;
+    std::unique_ptr<Expr> result;
     std::string xpath;
+    // The scanner and the location of the current token.
+    yyscan_t scanner;
+    yy::location location;
     // Whether parser traces should be generated.
     bool trace_parsing;
     bool trace_scanning;
-    // Error handling.
+    // Error handling, the messages are kept instead of printed.
     void error (const yy::location& l, const std::string& m);
     void error (const std::string& m);
+    const std::string& getError() const;
+private:
+    std::string _error;
 };
+
+// The parser passes the driver, the scanner is the one of the driver.
+inline yy::xpath10_parser::symbol_type
+yylex (xpath10_driver& driver)
+{
+    return yylex (driver, driver.scanner);
+}
 #endif // ! XPATH10_DRIVER_HH
@@ -211,11 +211,11 @@ AxisName :
 | "child"	                                     { $$ = $1; }
 | "descendant"	                                 { $$ = $1; }
 | "descendant-or-self"	                         { $$ = $1; }
-//| "following"	                                 { $$ = $1; }
+| "following"	                                 { $$ = $1; }
 | "following-sibling"	                         { $$ = $1; }
 | "parent"	                                     { $$ = $1; }
-//| "preceding"	                                 { $$ = $1; }
-//| "preceding-sibling"	                         { $$ = $1; }
+| "preceding"	                                 { $$ = $1; }
+| "preceding-sibling"	                         { $$ = $1; }
 | "self"                                         { $$ = $1; }
 
 // [7] NodeTest	                          ::=    NameTest	
@@ -239,11 +239,18 @@ PredicateExpr:
 
 // [10] AbbreviatedAbsoluteLocationPath	  ::=  	 '//' RelativeLocationPath	
 AbbreviatedAbsoluteLocationPath:
-  "//" RelativeLocationPath	                     { $$ = $2; $$->addAbsoluteDescendant(); }
+  "//" RelativeLocationPath	                     { $$ = $2;
+                                                   // The document root is not selected by "//." or "//..".
+                                                   if (Step::isSelfOrParentStep($$->getExprs().front())) {
+                                                       $$->addFront(new DescendantAll());
+                                                   } else {
+                                                       $$->addDescendantFront();
+                                                   }
+                                                   $$->addFront(new Root()); }
 
 // [119 AbbreviatedRelativeLocationPath	  ::=  	 RelativeLocationPath '//' Step	
 AbbreviatedRelativeLocationPath:
-  RelativeLocationPath "//" Step	             { $$ = $1; $$->addRelativeDescendant($3); }
+  RelativeLocationPath "//" Step	             { $$ = $1; $$->addDescendantBack($3); }
 
 // [12] AbbreviatedStep	                  ::=    '.'	
 //                                               | '..'	
@@ -293,7 +300,7 @@ PathExpr :
   LocationPath	                                 { $$ = $1; }
 | FilterExpr	                                 { $$ = $1; }
 | FilterExpr "/" RelativeLocationPath	         { $3->addFront($1); $$ = $3; }
-| FilterExpr "//" RelativeLocationPath	         { $$ = $3; $3->addRelativeDescendant(); $3->addFront($1); };
+| FilterExpr "//" RelativeLocationPath	         { $$ = $3; $3->addDescendantFront(); $3->addFront($1); };
 
 //[20] FilterExpr	                       ::=   PrimaryExpr	
 //                                               | FilterExpr Predicate
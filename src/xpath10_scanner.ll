@@ -27,6 +27,7 @@
 # include <cstdlib>
 # include <cstdio>
 # include <string>
+# include <stdexcept>
 # include "xpath10_driver.hh"
 # include "xpath10_parser.hh"
 
@@ -67,12 +68,12 @@
 // | 'processing-instruction'	
 // | 'node'	
 // [39]   	ExprWhitespace	   ::=   	S
-    
-// The location of the current token.
-static yy::location loc;
+
+// The scanner is reentrant, the location of the current token is kept by the
+// driver and the input is the expression string of the driver.
 // to debug add debug to %option below
 %}
-%option noyywrap nounput batch noinput
+%option reentrant noyywrap nounput batch noinput
 
 id    [^0-9'"\=!<>\-+*/|()\[\].,: \n\t$][^'"=!<>+*/:()\[\],  \n\t"]*
 digit [0-9]+
@@ -80,13 +81,14 @@ blank [ \t\n]
 
 %{
   // Code run each time a pattern is matched.
-  # define YY_USER_ACTION  loc.columns (yyleng);
+  # define YY_USER_ACTION  driver.location.columns (yyleng);
 %}
 
 %%
 
 %{
   // Code run each time yylex is called.
+  yy::location& loc = driver.location;
   loc.step ();
 %}
 
@@ -133,7 +135,7 @@ blank [ \t\n]
   errno = 0;
   double d = strtod(yytext, nullptr);
   if (errno == ERANGE) {
-    driver.error (loc, "double is out of range");
+    throw yy::xpath10_parser::syntax_error (loc, "double is out of range");
   }
   return yy::xpath10_parser::make_NUMBER(d, loc);
 }
@@ -148,7 +150,7 @@ blank [ \t\n]
 	std::string message("invalid character: [");
 	message += yytext[0];
 	message += "]";
-	driver.error (loc, message);
+	throw yy::xpath10_parser::syntax_error (loc, message);
  }
 <<EOF>>                  return yy::xpath10_parser::make_END(loc);
 %%
@@ -156,28 +158,17 @@ blank [ \t\n]
 void
 xpath10_driver::scan_begin ()
 {
-/*
-  yy_flex_debug = trace_scanning;
-  if (file.empty () || file == "-")
-    yyin = stdin;
-  else if (!(yyin = fopen (file.c_str (), "r")))
-    {
-      error ("cannot open " + file + ": " + strerror(errno));
-      exit (EXIT_FAILURE);
-    }
-*/
-  yyin = fmemopen((void*)xpath.c_str(), xpath.length(), "r");
-  if (yyin == nullptr) {
-     error("can not fmemopen " + xpath + " : " + strerror(errno));
-     exit (EXIT_FAILURE);
+  if (yylex_init (&scanner) != 0) {
+    throw std::runtime_error ("xpath10_driver::scan_begin, can not create scanner");
   }
+  // The scanner reads a copy of the expression, no FILE is involved.
+  yy_scan_bytes (xpath.data (), xpath.size (), scanner);
+  location.initialize ();
 }
 
-
-
 void
 xpath10_driver::scan_end ()
 {
-  fclose (yyin);
+  yylex_destroy (scanner);
+  scanner = nullptr;
 }
-
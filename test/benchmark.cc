@@ -0,0 +1,100 @@
+// MIT license
+//
+// Copyright 2023 Per Nilsson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the “Software”), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include <Jstr.hh>
+
+using namespace Jstr::Xpath;
+
+namespace {
+
+// Predicates in the style of schematron rules, a cheap test of the node
+// combined with an expensive search of the whole document.
+const char* queries[] = {
+    "count(/root/a[b = 1 and //c = 'x'])",
+    "count(/root/a[//c = 'x' and b = 1])",
+    "count(/root/a[b != 1 or //c = 'y'])",
+    "count(/root/a[//c = 'y' or b != 1])",
+    "count(/root/a[b > 0 and b < 2 and c = 'x'])",
+    "count(/root/a[not(//c = 'y') and b = 2])",
+};
+
+// Queries that parallel evaluation splits into chunks, a descendant search
+// and predicates that only look at the subtrees of the nodes they filter.
+const char* parallelQueries[] = {
+    "count(//c)",
+    "count(/root/a[contains(c, 'x') and b * 2 > 1])",
+    "count(/root/a[count(.//*) = 2][string-length(c) = 1])",
+};
+
+nlohmann::json
+createData(size_t entries) {
+    nlohmann::json a = nlohmann::json::array();
+    for (size_t i = 0; i < entries; i++) {
+        a.push_back({{"b", i % 3}, {"c", "x"}});
+    }
+    return nlohmann::json{{"root", {{"a", a}}}};
+}
+
+}
+
+int
+main (int argc, char *argv[])
+{
+    size_t entries = argc > 1 ? std::atoi(argv[1]) : 1000;
+    size_t iterations = argc > 2 ? std::atoi(argv[2]) : 5;
+    nlohmann::json json = createData(entries);
+    Document document(json);
+    Env env(document.getRoot());
+    std::cout << "entries: " << entries << " iterations: " << iterations << std::endl;
+    for (const char* query : queries) {
+        Expression expression(query);
+        Value result;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < iterations; i++) {
+            result = expression.eval(env);
+        }
+        std::chrono::duration<double, std::milli> elapsed =
+            std::chrono::steady_clock::now() - start;
+        std::cout << query << " = " << result
+                  << ", " << elapsed.count() / iterations << " ms" << std::endl;
+    }
+    size_t maxThreads = argc > 3 ? std::atoi(argv[3]) : std::thread::hardware_concurrency();
+    for (const char* query : parallelQueries) {
+        Expression expression(query);
+        for (size_t threads = 1; threads <= std::max<size_t>(maxThreads, 1); threads *= 2) {
+            env.setParallelism(threads, 1024);
+            Value result;
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < iterations; i++) {
+                result = expression.eval(env);
+            }
+            std::chrono::duration<double, std::milli> elapsed =
+                std::chrono::steady_clock::now() - start;
+            std::cout << query << " = " << result << ", threads: " << threads
+                      << ", " << elapsed.count() / iterations << " ms" << std::endl;
+        }
+    }
+    return 0;
+}
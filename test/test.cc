@@ -20,10 +20,14 @@
 // FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
 // DEALINGS IN THE SOFTWARE.
 
+#include <cmath>
 #include <memory>
 #include <cassert>
+#include <sstream>
 #include <iostream>
+#include <thread>
 #include <Jstr.hh>
+#include <StaticXpath.hh>
 
 
 using namespace Jstr::Xpath;
@@ -249,6 +253,63 @@ testNumbers() {
         Value r(eval("round(2.5)", document));
         assert(r.getNumber() == 3);
     }
+    // string to number
+    {
+        nlohmann::json json;
+        Document document(json);
+        Value r(eval("number(' 12 ')", document));
+        assert(r.getNumber() == 12);
+        r = eval("number('-.5')", document);
+        assert(r.getNumber() == -0.5);
+        r = eval("number('1.')", document);
+        assert(r.getNumber() == 1);
+        r = eval("number('1e3')", document);
+        assert(std::isnan(r.getNumber()));
+        r = eval("number('+1')", document);
+        assert(std::isnan(r.getNumber()));
+        r = eval("number('-')", document);
+        assert(std::isnan(r.getNumber()));
+        r = eval("number('inf')", document);
+        assert(std::isnan(r.getNumber()));
+        r = eval("number('')", document);
+        assert(std::isnan(r.getNumber()));
+    }
+    {
+        // <a><b>1</b><b>x</b><c>2.5</c></a>
+        const char* j = R"({"a":{"b":[1, "x"],"c":"2.5"}})";
+        nlohmann::json json = nlohmann::json::parse(j);
+        Document document(json);
+        Value r(eval("sum(/a/b)", document));
+        assert(std::isnan(r.getNumber()));
+        r = eval("/a/c + 1", document);
+        assert(r.getNumber() == 3.5);
+        r = eval("number(/a/b[2])", document);
+        assert(std::isnan(r.getNumber()));
+    }
+    // number to string
+    {
+        nlohmann::json json;
+        Document document(json);
+        Value r(eval("string(1 div 3)", document));
+        assert(r.getString() == "0.3333333333333333");
+        r = eval("string(1000000 * 1000000)", document);
+        assert(r.getString() == "1000000000000");
+        r = eval("string(0.5)", document);
+        assert(r.getString() == "0.5");
+        r = eval("string(-0.25)", document);
+        assert(r.getString() == "-0.25");
+        r = eval("string(0 div -1)", document);
+        assert(r.getString() == "0");
+    }
+    {
+        const char* j = R"({"a":1.5,"b":1e21})";
+        nlohmann::json json = nlohmann::json::parse(j);
+        Document document(json);
+        Value r(eval("string(/a)", document));
+        assert(r.getString() == "1.5");
+        r = eval("string(/b)", document);
+        assert(r.getString() == "1000000000000000000000");
+    }
 }
 
 void
@@ -334,6 +395,15 @@ testLogic() {
         Document document(json);
         Value r(eval("/a and /a/b and /a/c and /a/d", document));
         assert(r.getBoolean());
+        // The right operand is not evaluated when the left decides the result.
+        r = eval("/a/x and count(/a/b | 1) = 1", document);
+        assert(!r.getBoolean());
+        r = eval("/a/b or count(/a/b | 1) = 1", document);
+        assert(r.getBoolean());
+        r = eval("count(/a/*[. = 'foo' or //d = 'foo'])", document);
+        assert(r.getNumber() == 3);
+        r = eval("count(/a/*[//d = 'foo' and . = 'foo'])", document);
+        assert(r.getNumber() == 1);
     }
     // Union
     {
@@ -468,6 +538,53 @@ testPaths() {
         r = eval("/a/b[b = 2]/following-sibling::b", document);
         assert(r.getStringValue() == "3");
     }
+    {
+        // <a><b><c>1</c><d>2</d></b><b><c>3</c><d>4</d></b><e>5</e></a>
+        const char* j = R"({"a":{"b":[{"c":1,"d":2},{"c":3,"d":4}],"e":5}})";
+        nlohmann::json json = nlohmann::json::parse(j);
+        Document document(json);
+        Value r(eval("count(/a/b[1]/following::*)", document));
+        assert(r.getNumber() == 4);
+        r = eval("/a/b[1]/following::c", document);
+        assert(r.getStringValue() == "3");
+        r = eval("/a/b[1]/c/following::*[1]", document);
+        assert(r.getStringValue() == "2");
+        // the union for several nodes
+        r = eval("count(/a/b/c/following::*)", document);
+        assert(r.getNumber() == 5);
+        r = eval("count(/a/e/preceding::*)", document);
+        assert(r.getNumber() == 6);
+        // reverse axes count positions from the nearest node
+        r = eval("/a/e/preceding::*[1]", document);
+        assert(r.getStringValue() == "4");
+        r = eval("/a/e/preceding::c[last()]", document);
+        assert(r.getStringValue() == "1");
+        r = eval("/a/b[2]/d/preceding::*", document);
+        assert(r.getNodeSet().size() == 4 && r.getStringValue() == "32112");
+        r = eval("count(/a/e/preceding-sibling::*)", document);
+        assert(r.getNumber() == 2);
+        r = eval("/a/e/preceding-sibling::*[1]/c", document);
+        assert(r.getStringValue() == "3");
+        r = eval("/a/b/d/preceding-sibling::c", document);
+        assert(r.getStringValue() == "13");
+        r = eval("count(/a/b/c/preceding-sibling::*)", document);
+        assert(r.getNumber() == 0);
+        r = eval("count(/a/b[following::e = 5])", document);
+        assert(r.getNumber() == 2);
+        r = eval("/a/b[preceding-sibling::b]/c", document);
+        assert(r.getStringValue() == "3");
+        r = eval("count(/following::* | /preceding::* | /a/preceding-sibling::*)", document);
+        assert(r.getNumber() == 0);
+        // name tests skip ancestors and nodes with other names
+        r = eval("count(/a/b[2]/d/preceding::b)", document);
+        assert(r.getNumber() == 1);
+        r = eval("/a/b[2]/d/preceding::c", document);
+        assert(r.getStringValue() == "31");
+        r = eval("/a/b[1]/d/following::d", document);
+        assert(r.getStringValue() == "4");
+        r = eval("count(/a/b/c/following::x | /a/e/preceding::x)", document);
+        assert(r.getNumber() == 0);
+    }
     // Descendant tests
     {
         // <a>3</a>
@@ -865,6 +982,61 @@ testRelations() {
         }
         assert(exception);
     }
+    // node set to node set
+    {
+        const char* j = R"({"a":{"b":[1, 2, 3, 4],"c":[9, 8, 4],"d":[5, 6],"e":[7, 7],"f":7}})";
+        nlohmann::json json = nlohmann::json::parse(j);
+        Document document(json);
+        Value r(eval("/a/b = /a/c", document));
+        assert(r.getBoolean());
+        r = eval("/a/c = /a/b", document);
+        assert(r.getBoolean());
+        r = eval("/a/b = /a/d", document);
+        assert(!r.getBoolean());
+        r = eval("/a/b = /a/x", document);
+        assert(!r.getBoolean());
+        r = eval("/a/e = /a/f", document);
+        assert(r.getBoolean());
+        r = eval("/a/e != /a/f", document);
+        assert(!r.getBoolean());
+        r = eval("/a/e != /a/e", document);
+        assert(!r.getBoolean());
+        r = eval("/a/e != /a/d", document);
+        assert(r.getBoolean());
+        r = eval("/a/b != /a/b", document);
+        assert(r.getBoolean());
+        r = eval("/a/b != /a/x", document);
+        assert(!r.getBoolean());
+        r = eval("/a/b < 2", document);
+        assert(r.getBoolean());
+        r = eval("/a/b > 4", document);
+        assert(!r.getBoolean());
+        r = eval("/a/b >= 4", document);
+        assert(r.getBoolean());
+        r = eval("5 <= /a/b", document);
+        assert(!r.getBoolean());
+        r = eval("/a/b < /a/d", document);
+        assert(r.getBoolean());
+        r = eval("/a/d < /a/b", document);
+        assert(!r.getBoolean());
+        r = eval("/a/c > /a/d", document);
+        assert(r.getBoolean());
+        r = eval("/a/x < 1", document);
+        assert(!r.getBoolean());
+        r = eval("/a/x >= /a/b", document);
+        assert(!r.getBoolean());
+    }
+    {
+        const char* j = R"({"a":{"b":["x", 3],"c":["y"]}})";
+        nlohmann::json json = nlohmann::json::parse(j);
+        Document document(json);
+        Value r(eval("/a/b < 4", document));
+        assert(r.getBoolean());
+        r = eval("/a/b > 3", document);
+        assert(!r.getBoolean());
+        r = eval("/a/c < 4", document);
+        assert(!r.getBoolean());
+    }
 }
 
 void 
@@ -947,6 +1119,78 @@ testFilter() {
         Value r(eval("1[count(/a/b) = 4]", document));
         assert(r.getNumber() == 1);
     }
+    {
+        const char* j = R"({"a":{"limit":3,"b":[{"c":1},{"c":2},{"c":3},{"c":4},{"c":5}]}})";
+        nlohmann::json json = nlohmann::json::parse(j);
+        Document document(json);
+        Value r(eval("sum(/a/b/c[. < ../../limit])", document));
+        assert(r.getNumber() == 3);
+        r = eval("sum(/a/b[c > 1][position() < 3][c != 2]/c)", document);
+        assert(r.getNumber() == 3);
+        r = eval("count(/a/b[c > 5])", document);
+        assert(r.getNumber() == 0);
+        for (int i = 0; i < 3; i++) {
+            r = eval("/a/b[c > 1][position() = last()]/c", document);
+            assert(r.getNumber() == 5);
+        }
+    }
+    {
+        // positions select by index, array elements are created one by one
+        const char* j = R"({"a":{"b":[{"c":1,"d":2},{"c":2,"d":3},{"c":3,"d":4}],"e":5}})";
+        nlohmann::json json = nlohmann::json::parse(j);
+        Document document(json);
+        Env env(document.getRoot());
+        Expression e1("/a/b[2]/c");
+        Value r = e1.eval(env);
+        assert(r.getNumber() == 2);
+        Expression e2("/a/b[last()]/d");
+        r = e2.eval(env);
+        assert(r.getNumber() == 4);
+        Expression e3("count(/a/b[4])");
+        r = e3.eval(env);
+        assert(r.getNumber() == 0);
+        Expression e4("count(/a/b[1.5])");
+        r = e4.eval(env);
+        assert(r.getNumber() == 0);
+        // the nodes created first are the same nodes as in the whole node set
+        Expression e5("count(/a/b[2] | /a/b | /a/b[last()])");
+        r = e5.eval(env);
+        assert(r.getNumber() == 3);
+        Expression e6("count(/a/*)");
+        r = e6.eval(env);
+        assert(r.getNumber() == 4);
+        Expression e7("count(/a/b/*)");
+        r = e7.eval(env);
+        assert(r.getNumber() == 6);
+        Expression e8("/a/b[c > 1][1]/c");
+        r = e8.eval(env);
+        assert(r.getNumber() == 2);
+        Expression e9("/a/*[last()]");
+        r = e9.eval(env);
+        assert(r.getNumber() == 5);
+        Expression e10("/a/b[2][1]/c");
+        r = e10.eval(env);
+        assert(r.getNumber() == 2);
+        Expression e11("/a/b/c[1]");
+        r = e11.eval(env);
+        assert(r.getNodeSet().size() == 1 && r.getNumber() == 1);
+        Expression e12("/a/e[1]");
+        r = e12.eval(env);
+        assert(r.getNumber() == 5);
+        Expression e13("/a/b[1]/../e");
+        r = e13.eval(env);
+        assert(r.getNumber() == 5);
+    }
+    {
+        // positions in arrays of arrays
+        const char* j = R"({"a":[[1,2],[3]]})";
+        nlohmann::json json = nlohmann::json::parse(j);
+        Document document(json);
+        Value r(eval("count(/a[2])", document));
+        assert(r.getNumber() == 1);
+        r = eval("count(/a[3])", document);
+        assert(r.getNumber() == 0);
+    }
 }
 
 void
@@ -969,6 +1213,53 @@ testNodeSetFunctions() {
         r = eval("count(/a[position()=2])", document);
         assert(r.getNumber() == 0);
     }
+    {
+        // <a><b>1</b><b>2</b><c>x</c></a>
+        const char* j = R"({"a":{"b":[1,2],"c":"x"}})";
+        nlohmann::json json = nlohmann::json::parse(j);
+        Document document(json);
+        Value r(eval("local-name(/a/b[2])", document));
+        assert(r.getString() == "b");
+        r = eval("count(/a/*[local-name() = 'b'])", document);
+        assert(r.getNumber() == 2);
+        r = eval("local-name(/a/d)", document);
+        assert(r.getString() == "");
+        r = eval("concat(local-name(/a/c), 'y', /a/c)", document);
+        assert(r.getString() == "cyx");
+        r = eval("string('lit')", document);
+        assert(r.getString() == "lit");
+        Value copy(r);
+        assert(copy.getString() == "lit");
+        r = eval("translate('abc', 'b', 'x')", document);
+        assert(copy.getString() == "lit");
+        assert(r.getString() == "axc");
+    }
+    {
+        // aggregates streamed over paths give the same result as node sets,
+        // a union is not streamed
+        const char* j = R"({"a":{"b":[1,2,3],"c":{"b":[4,6],"d":{"b":5}}}})";
+        nlohmann::json json = nlohmann::json::parse(j);
+        Document document(json);
+        const char* paths[] = {
+            "/a/b", "//b", "//*", "/a/*/b", "/a//b", "/a/b[. > 1]", "//b[. > 1][. < 6]",
+            "/a/b[2]", "//b[last()]", "//b[position() > 1]", "/a/c[d/b = 5]/b", "/a/c/..",
+            "/a/x", "//*[not(b)]", "/a/*[b][1]/d"
+        };
+        for (const char* path : paths) {
+            std::string p(path);
+            Value ns(eval(p + " | /x", document));
+            assert(eval("count(" + p + ")", document) == eval("count(" + p + " | /x)", document));
+            double sum = eval("sum(" + p + ")", document).getNumber();
+            double expected = eval("sum(" + p + " | /x)", document).getNumber();
+            assert(sum == expected || (std::isnan(sum) && std::isnan(expected)));
+            assert(eval("boolean(" + p + ")", document).getBoolean() == !ns.getNodeSet().empty());
+            assert(eval("not(" + p + ")", document).getBoolean() == ns.getNodeSet().empty());
+        }
+        Value r(eval("sum(//b[. > 1][. < 6])", document));
+        assert(r.getNumber() == 14);
+        r = eval("count(//*)", document);
+        assert(r.getNumber() == 9);
+    }
 }
 
 void
@@ -1059,6 +1350,29 @@ testStringFunctions() {
         r = eval("concat(/, '5', 6)", document);
         assert(r.getString() == "123456");
     }
+    // contains
+    {
+        // <a><b>foobar</b><c>3</c></a>
+        const char* j = R"({"a":{"b":"foobar","c":3}})";
+        nlohmann::json json = nlohmann::json::parse(j);
+        Document document(json);
+        Value r(eval("contains(/a/b, 'oba')", document));
+        assert(r.getBoolean());
+        r = eval("contains(/a/b, 'bar')", document);
+        assert(r.getBoolean());
+        r = eval("contains(/a/b, 'baz')", document);
+        assert(!r.getBoolean());
+        r = eval("contains(/a/b, '')", document);
+        assert(r.getBoolean());
+        r = eval("contains(/a/c * 11, 3)", document);
+        assert(r.getBoolean());
+        r = eval("string-length(/a/b)", document);
+        assert(r.getNumber() == 6);
+        r = eval("/a/b = 'foobar'", document);
+        assert(r.getBoolean());
+        r = eval("/a/b != 'foobar'", document);
+        assert(!r.getBoolean());
+    }
     // starts-with
     {
         // <a><b>1</b><b>2</b><b>3</b><b>4</b></a>
@@ -1134,6 +1448,57 @@ testStringFunctions() {
         r = eval("substring('12345', -1 div 0, 1 div 0)", document);
         assert(r.getString() == "");
     }
+    // literal patterns, translation tables and characters
+    {
+        const char* j = R"({"a":{"b":"the quick brown fox jumps over the lazy dog","p":"fox",)"
+            R"("u":"na\u00efve caf\u00e9 \u00e5\u00e4\u00f6 na\u00efve caf\u00e9 na\u00efve caf\u00e9"}})";
+        nlohmann::json json = nlohmann::json::parse(j);
+        Document document(json);
+        Value r(eval("contains(/a/b, 'lazy dog')", document));
+        assert(r.getBoolean());
+        r = eval("contains(/a/b, 'lazy cat')", document);
+        assert(!r.getBoolean());
+        r = eval("contains(/a/b, /a/p)", document);
+        assert(r.getBoolean());
+        r = eval("substring-before(/a/b, 'brown fox')", document);
+        assert(r.getString() == "the quick ");
+        r = eval("substring-after(/a/b, 'jumps')", document);
+        assert(r.getString() == " over the lazy dog");
+        r = eval("substring-after(/a/b, /a/p)", document);
+        assert(r.getString() == " jumps over the lazy dog");
+        r = eval("substring-after(/a/b, concat('o', 'g'))", document);
+        assert(r.getString() == "");
+        r = eval("contains(concat(/a/b, /a/b, /a/b, 'xyz'), 'dogxyz')", document);
+        assert(r.getBoolean());
+        r = eval("substring-before(concat(/a/b, /a/b, /a/b), 'dogthe quick')", document);
+        assert(r.getString() == "the quick brown fox jumps over the lazy ");
+        r = eval("contains(concat(/a/b, /a/b, /a/b), 'dogq')", document);
+        assert(!r.getBoolean());
+        r = eval("string-length(/a/b)", document);
+        assert(r.getNumber() == 43);
+        r = eval("string-length(/a/u)", document);
+        assert(r.getNumber() == 36);
+        r = eval("translate(/a/b, 'abc', 'ABC')", document);
+        assert(r.getString() == "the quiCk Brown fox jumps over the lAzy dog");
+        r = eval("translate(/a/b, /a/p, 'FOX')", document);
+        assert(r.getString() == "the quick brOwn FOX jumps Over the lazy dOg");
+        r = eval("translate('aabc', 'aa', 'xy')", document);
+        assert(r.getString() == "xxbc");
+        r = eval("translate('abc', 'abc', 'x')", document);
+        assert(r.getString() == "x");
+        r = eval("translate(/a/u, '\u00e9\u00efa', 'e')", document);
+        assert(r.getString() == "nve cfe \u00e5\u00e4\u00f6 nve cfe nve cfe");
+        r = eval("translate(/a/u, 'a\u00e5', '\u00e5a')", document);
+        assert(r.getString() == "n\u00e5\u00efve c\u00e5f\u00e9 a\u00e4\u00f6 n\u00e5\u00efve c\u00e5f\u00e9 n\u00e5\u00efve c\u00e5f\u00e9");
+        r = eval("translate(concat('\u00e9', /a/b), /a/b, /a/b)", document);
+        assert(r.getString() == "\u00e9the quick brown fox jumps over the lazy dog");
+        r = eval("substring(/a/u, 9, 4)", document);
+        assert(r.getString() == "\u00e9 \u00e5\u00e4");
+        r = eval("substring(/a/u, 33)", document);
+        assert(r.getString() == "af\u00e9");
+        r = eval("string-length(substring(/a/u, 2, 1000))", document);
+        assert(r.getNumber() == 34);
+    }
 }
 
 void
@@ -1193,6 +1558,71 @@ testEnv() {
         r = e5.eval(env);
         assert(r.getBoolean());
     }
+    {
+        // variables bound by slot, with both backends
+        const char* j = R"({"a":{"b":[1,2,3,4]}})";
+        nlohmann::json json = nlohmann::json::parse(j);
+        Document document(json);
+        Env env(document.getRoot());
+        env.addVariable("min", Value(1.0));
+        for (Expression::Backend backend : {Expression::Tree, Expression::Bytecode}) {
+            Expression e("count(/a/b[. > $min and . < $max]) + count(/a/b[. = $max])", backend);
+            assert(e.getVariables().size() == 2);
+            assert(e.getVariables()[0] == "min" && e.getVariables()[1] == "max");
+            size_t max = e.getSlot("max");
+            Bindings bindings(e);
+            // not bound
+            bool thrown(false);
+            try {
+                e.eval(env, bindings);
+            } catch (const std::runtime_error&) {
+                thrown = true;
+            }
+            assert(thrown);
+            bindings.bind(max, Value(4.0));
+            assert(e.eval(env, bindings).getNumber() == 3);
+            Value b = eval("/a/b[. > 2]", document);
+            bindings.bind(max, &b);
+            assert(e.eval(env, bindings).getNumber() == 4);
+            // the slot overrides the environment
+            Value zero(0.0);
+            bindings.bind(e.getSlot("min"), &zero);
+            assert(e.eval(env, bindings).getNumber() == 5);
+            bindings.clear();
+            bindings.bind(max, Value(3.0));
+            assert(e.eval(env, bindings).getNumber() == 2);
+            // the same expression evaluated without bindings
+            thrown = false;
+            try {
+                e.eval(env);
+            } catch (const std::runtime_error&) {
+                thrown = true;
+            }
+            assert(thrown);
+            thrown = false;
+            try {
+                e.getSlot("x");
+            } catch (const std::runtime_error&) {
+                thrown = true;
+            }
+            assert(thrown);
+            thrown = false;
+            try {
+                bindings.bind(2, Value(1.0));
+            } catch (const std::runtime_error&) {
+                thrown = true;
+            }
+            assert(thrown);
+        }
+        // slots are resolved again for deserialized expressions
+        Expression e("$x * $y + $x");
+        std::unique_ptr<Expression> copy = Expression::deserialize(e.serialize());
+        assert(copy->getVariables() == e.getVariables());
+        Bindings bindings(*copy);
+        bindings.bind(copy->getSlot("x"), Value(2.0));
+        bindings.bind(copy->getSlot("y"), Value(5.0));
+        assert(copy->eval(env, bindings).getNumber() == 12);
+    }
     {
         //<a><b><c><e>1</e></c></b><d><c><e>1</e></c></d></a>
         const char* j = R"({"a":{"b":{"c":{"e":1}},"d":{"c":{"e":1}}}})";
@@ -1218,6 +1648,908 @@ testEnv() {
         Value size = r.getNodeSetSize();
         assert(size.getNumber() == 0);
     }
+    {
+        // expression cache
+        const char* j = R"({"a":{"b":[1,2,3,4]}})";
+        nlohmann::json json = nlohmann::json::parse(j);
+        Document document(json);
+        ExpressionCache& defaultCache = ExpressionCache::getDefault();
+        defaultCache.clear();
+        assert(eval("count(/a/b)", document).getNumber() == 4);
+        assert(eval("count(/a/b)", document).getNumber() == 4);
+        assert(defaultCache.getHits() == 1);
+        assert(defaultCache.getMisses() == 1);
+        ExpressionCache cache(2);
+        std::shared_ptr<const Expression> e1 = cache.get("/a/b[1]");
+        std::shared_ptr<const Expression> e2 = cache.get("/a/b[2]");
+        assert(cache.get("/a/b[1]") == e1);
+        // "/a/b[2]" is the least recently used.
+        cache.get("/a/b[3]");
+        assert(cache.getSize() == 2);
+        assert(cache.get("/a/b[1]") == e1);
+        assert(cache.get("/a/b[2]") != e2);
+        assert(cache.getHits() == 2);
+        assert(cache.getMisses() == 4);
+        Env env(document.getRoot());
+        assert(e2->eval(env).getNumber() == 2);
+        bool thrown(false);
+        try {
+            cache.get("/a/b[");
+        } catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+        assert(cache.getSize() == 2);
+        cache.setCapacity(1);
+        assert(cache.getSize() == 1);
+        cache.setCapacity(0);
+        assert(cache.getSize() == 0);
+        assert(cache.get("/a/b[1]") != cache.get("/a/b[1]"));
+        assert(cache.getSize() == 0);
+    }
+    {
+        // expressions compiled on several threads at once
+        const char* j = R"({"a":{"b":[1,2,3,4],"c":"x"}})";
+        nlohmann::json json = nlohmann::json::parse(j);
+        Document document(json);
+        const char* expressions[] = {
+            "count(/a/b[. > 2])", "concat(/a/c, 'y', 1.5)", "sum(//b) div 4",
+            "/a/b[last()] * 2", "string-length(translate(/a/c, 'x', 'yz'))"
+        };
+        std::vector<std::string> expected;
+        for (const char* xpath : expressions) {
+            Env env(document.getRoot());
+            expected.push_back(Expression(xpath).eval(env).getString());
+        }
+        std::vector<std::thread> threads;
+        std::vector<int> failures(8, 0);
+        for (size_t t = 0; t < failures.size(); t++) {
+            threads.emplace_back([&, t]() {
+                Env env(document.getRoot());
+                for (size_t i = 0; i < 200; i++) {
+                    size_t k = (i + t) % expected.size();
+                    if (Expression(expressions[k]).eval(env).getString() != expected[k]) {
+                        failures[t]++;
+                    }
+                    try {
+                        Expression e("/a/b[. ! 1]");
+                        failures[t]++;
+                    } catch (const std::runtime_error& e) {
+                        if (std::string(e.what()).find("invalid character: [!]") == std::string::npos) {
+                            failures[t]++;
+                        }
+                    }
+                }
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        for (int f : failures) {
+            assert(f == 0);
+        }
+    }
+}
+
+void
+testOptimizer() {
+    {
+        // <a><b>1</b><b>2</b><b>3</b><c><b>4</b></c></a>
+        const char* j = R"({"a":{"b":[1,2,3],"c":{"b":4}}})";
+        nlohmann::json json = nlohmann::json::parse(j);
+        Document document(json);
+        std::stringstream trace;
+        setOptimizerTrace(&trace);
+        Value r(eval("1 + 2 * 3", document));
+        setOptimizerTrace(nullptr);
+        assert(r.getNumber() == 7);
+        std::string s = trace.str();
+        assert(s.find("after optimization:\nNumericLiteral 7\n") != std::string::npos);
+        trace.str("");
+        setOptimizerTrace(&trace);
+        r = eval("not(false()) and concat('a', 'b') = 'ab'", document);
+        setOptimizerTrace(nullptr);
+        assert(r.getBoolean());
+        s = trace.str();
+        assert(s.find("after optimization:\nBooleanLiteral true\n") != std::string::npos);
+        trace.str("");
+        setOptimizerTrace(&trace);
+        r = eval("count(//b)", document);
+        setOptimizerTrace(nullptr);
+        assert(r.getNumber() == 4);
+        s = trace.str();
+        assert(s.find("DescendantOrSelfAll") == std::string::npos);
+        assert(s.find("DescendantSearch b") != std::string::npos);
+        trace.str("");
+        setOptimizerTrace(&trace);
+        r = eval("/a/b[3]", document);
+        setOptimizerTrace(nullptr);
+        assert(r.getNumber() == 3);
+        s = trace.str();
+        assert(s.find("ChildIndexStep b PositionPredicate 3") != std::string::npos);
+        // dead predicates
+        r = eval("count(/a/b[true()])", document);
+        assert(r.getNumber() == 3);
+        r = eval("count(/a/b[1 = 2])", document);
+        assert(r.getNumber() == 0);
+        r = eval("count(/a/b[0]/following-sibling::*)", document);
+        assert(r.getNumber() == 0);
+        r = eval("count(/a/b['x'][2])", document);
+        assert(r.getNumber() == 1);
+        // redundant steps
+        r = eval("count(/a/./b/.)", document);
+        assert(r.getNumber() == 3);
+        r = eval("sum(/a/b[. > 1 + 0])", document);
+        assert(r.getNumber() == 5);
+        // constant expressions that fail are left to evaluation
+        r = eval("count(/a/b[. = 2]) + 1", document);
+        assert(r.getNumber() == 2);
+        bool thrown(false);
+        try {
+            eval("count(1 | 2) + 1", document);
+        } catch (const std::runtime_error& e) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+    {
+        // <a><b>1</b><c><b>2</b><d><b>3</b></d></c></a>
+        const char* j = R"({"a":{"b":1,"c":{"b":2,"d":{"b":3}}}})";
+        nlohmann::json json = nlohmann::json::parse(j);
+        Document document(json);
+        Value r(eval("count(/a/c//b)", document));
+        assert(r.getNumber() == 2);
+        r = eval("count(/a//c/d//b)", document);
+        assert(r.getNumber() == 1);
+        r = eval("count(//descendant::b)", document);
+        assert(r.getNumber() == 3);
+        r = eval("count(/a/c/d//..)", document);
+        assert(r.getNumber() == 2);
+        r = eval("sum(/a/c//*)", document);
+        assert(r.getNumber() == 8);
+    }
+    {
+        // <a><b><c>1</c></b><d><b><c>2</c></b></d></a>
+        const char* j = R"({"a":{"b":{"c":1},"d":{"b":{"c":2}}}})";
+        nlohmann::json json = nlohmann::json::parse(j);
+        Document document(json);
+        // "//" is merged by the parser, the optimizer must not change the results.
+        for (bool enabled : {true, false}) {
+            setOptimizerEnabled(enabled);
+            assert(eval("count(//descendant-or-self::x)", document).getNumber() == 0);
+            assert(eval("count(//descendant-or-self::b)", document).getNumber() == 2);
+            assert(eval("//descendant-or-self::e", document).getNodeSet().empty());
+            assert(eval("descendant-or-self::r//descendant-or-self::n", document).getNodeSet().empty());
+            assert(eval("count(//descendant::b)", document).getNumber() == 2);
+            assert(eval("count(/a//descendant::*)", document).getNumber() == 5);
+            assert(eval("count(/a//.//c)", document).getNumber() == 2);
+            assert(eval("count(//././/.)", document).getNumber() == 6);
+            assert(eval("//*[last()-1]", document).getNumber() == 2);
+        }
+        setOptimizerEnabled(true);
+    }
+    {
+        // context independent sub expressions
+        const char* j = R"({"r":{"a":{"b":[1,2,3,4,5]},"upper-limit":3}})";
+        nlohmann::json json = nlohmann::json::parse(j);
+        Document document(json);
+        std::stringstream trace;
+        setOptimizerTrace(&trace);
+        Value r(eval("count(/r/a/b[. < /r/upper-limit])", document));
+        setOptimizerTrace(nullptr);
+        assert(r.getNumber() == 2);
+        std::string s = trace.str();
+        s = s.substr(s.find("after optimization:"));
+        assert(s.find("Cached 0") < s.find("ChildStep upper-limit"));
+        trace.str("");
+        setOptimizerTrace(&trace);
+        r = eval("count(/r/a/b[. < 4]) = count(/r/a/b)", document);
+        setOptimizerTrace(nullptr);
+        assert(!r.getBoolean());
+        s = trace.str();
+        s = s.substr(s.find("after optimization:"));
+        assert(s.find("Cached 0") != s.rfind("Cached 0"));
+        assert(s.find("Cached 1") == std::string::npos);
+        r = eval("/r/a/b[position() = count(/r/a/b[. > 2])]", document);
+        assert(r.getNumber() == 3);
+        r = eval("sum(/r/a/b[. > count(/r/a/b) - 3]) + sum(/r/a/b[. > count(/r/a/b) - 3])",
+                 document);
+        assert(r.getNumber() == 24);
+        r = eval("count(/r/a/b[. = current()/r/upper-limit])", document);
+        assert(r.getNumber() == 1);
+        Env env(document.getRoot());
+        env.addVariable("limit", Value(4.0));
+        Expression e("count(/r/a/b[. < $limit + 0])");
+        assert(e.eval(env).getNumber() == 3);
+        assert(e.eval(env).getNumber() == 3);
+        Env env1(document.getRoot());
+        env1.addVariable("limit", Value(2.0));
+        assert(e.eval(env1).getNumber() == 1);
+    }
+    {
+        // paths relative to ancestors
+        const char* j = R"({"r":[{"a":{"b":[1,2,3]},"limit":3},{"a":{"b":[1,2,3]},"limit":2}]})";
+        nlohmann::json json = nlohmann::json::parse(j);
+        Document document(json);
+        std::stringstream trace;
+        setOptimizerTrace(&trace);
+        Value r(eval("sum(/r/a/b[. < ../../limit])", document));
+        setOptimizerTrace(nullptr);
+        assert(r.getNumber() == 4);
+        std::string s = trace.str();
+        assert(s.find("MemoizedPath 2") != std::string::npos);
+        r = eval("count(//b[. = count(../b)])", document);
+        assert(r.getNumber() == 2);
+        r = eval("count(/r/a/b[../../limit = 2][../b[. = ../../limit]])", document);
+        assert(r.getNumber() == 3);
+        r = eval("count(/r[a/b[. = ../../limit]])", document);
+        assert(r.getNumber() == 2);
+        r = eval("count(/r/limit[../..])", document);
+        assert(r.getNumber() == 2);
+    }
+    {
+        // fused child steps
+        const char* j = R"({"a":{"b":[{"c":1},{"c":[2,3]}],"d":{"c":4,"e":{"c":5}}}})";
+        nlohmann::json json = nlohmann::json::parse(j);
+        Document document(json);
+        std::stringstream trace;
+        setOptimizerTrace(&trace);
+        Value r(eval("/a/*/c", document));
+        setOptimizerTrace(nullptr);
+        std::string s = trace.str();
+        assert(s.find("ChildPath a/*/c") != std::string::npos);
+        const std::vector<const Node*>& ns = r.getNodeSet();
+        assert(ns.size() == 4);
+        for (size_t i = 0; i < ns.size(); i++) {
+            assert(ns[i]->getNumber() == i + 1);
+        }
+        r = eval("/a/*/c[. > 1][2]", document);
+        assert(r.getNumber() == 3);
+        r = eval("sum(/a/*/*/c)", document);
+        assert(r.getNumber() == 5);
+        r = eval("count(/a/d[c]/*/c)", document);
+        assert(r.getNumber() == 1);
+        r = eval("count(/a/b/c/d)", document);
+        assert(r.getNumber() == 0);
+    }
+    {
+        // numeric comparison predicates
+        const char* j = R"({"r":{"n":[1,2,3,4,5,6,7,"3"," 2 ",true,"x"],)"
+            R"("o":[{"p":1},{"p":[5,0]},{"q":1},{"p":{"s":1}}]}})";
+        nlohmann::json json = nlohmann::json::parse(j);
+        Document document(json);
+        std::stringstream trace;
+        setOptimizerTrace(&trace);
+        Value r(eval("count(/r/n[. < 3])", document));
+        setOptimizerTrace(nullptr);
+        std::string s = trace.str();
+        assert(s.find("ComparePredicate . Lt 3") != std::string::npos);
+        assert(r.getNumber() == 3);
+        r = eval("count(/r/n[. = 1])", document);
+        assert(r.getNumber() == 2);
+        r = eval("count(/r/n[. != 1])", document);
+        assert(r.getNumber() == 9);
+        r = eval("count(/r/n[3 <= .])", document);
+        assert(r.getNumber() == 6);
+        r = eval("/r/n[. > 6]", document);
+        assert(r.getNumber() == 7);
+        r = eval("/r/n[. >= 2][. < 5][2]", document);
+        assert(r.getNumber() == 3);
+        r = eval("count(/r/o[p = 0])", document);
+        assert(r.getNumber() == 1);
+        r = eval("count(/r/o[p != 5])", document);
+        assert(r.getNumber() == 3);
+        bool thrown(false);
+        try {
+            eval("/r/o[p < 2]", document);
+        } catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+}
+
+namespace {
+
+void
+assertSameValue(const Value& expected, const Value& v) {
+    assert(expected.getType() == v.getType());
+    if (expected.getType() == Value::NodeSet) {
+        assert(expected.getNodeSet() == v.getNodeSet());
+    } else if (expected.getType() == Value::Number && std::isnan(expected.getNumber())) {
+        assert(std::isnan(v.getNumber()));
+    } else {
+        assert(expected.getStringValue() == v.getStringValue());
+    }
+}
+
+// Evaluates an expression with both backends and after a serialization round
+// trip, the results must be the same.
+void
+assertSameResult(const std::string& xpath, const Env& env) {
+    Value tree;
+    Value bytecode;
+    bool treeThrows(false);
+    bool bytecodeThrows(false);
+    try {
+        tree = Expression(xpath).eval(env);
+    } catch (const std::exception&) {
+        treeThrows = true;
+    }
+    try {
+        bytecode = Expression(xpath, Expression::Bytecode).eval(env);
+    } catch (const std::exception&) {
+        bytecodeThrows = true;
+    }
+    assert(treeThrows == bytecodeThrows);
+    if (treeThrows) {
+        return;
+    }
+    assertSameValue(tree, bytecode);
+    std::string blob = Expression(xpath).serialize();
+    std::unique_ptr<Expression> copy = Expression::deserialize(blob);
+    assert(copy->serialize() == blob);
+    assertSameValue(tree, copy->eval(env));
+    assertSameValue(tree, Expression::deserialize(blob, Expression::Bytecode)->eval(env));
+}
+
+}
+
+void
+testBytecode() {
+    const char* expressions[] = {
+        "1", "'a'", "true()", "false()", "-1", "--2", "1 + 2 * 3 - 4 div 5",
+        "7 mod 3", "'x' + 1", "1 = 1", "1 != 1", "1 < 2", "2 <= 1", "2 > 1",
+        "1 >= 2", "/", ".", "..", "*", "//.", "//*", "//b", "/a", "/a/b", "a/b",
+        "/a/b[1]", "/a/b[last()]", "/a/b[position() > 1]", "/a/b[. > 1][1]",
+        "/a/*[2]/..", "/a/b | /a/c", "/a/b | /x", "/a/c/b[. = 4]",
+        "//b[not(. = 2)]", "//b[boolean(.)]", "count(//b)", "count(/a/*)",
+        "count(1)", "count(/a/b[2])", "sum(//b)", "/a/b = 2", "/a/b != 2",
+        "/a/b < 2", "/a/b > /a/c/b", "//b[. = 1] or //b[. = 9]",
+        "//b[. = 9] or //b[. = 1]", "//b[. = 1] and //b[. = 9]",
+        "//b and //c", "1 and 0", "0 or ''", "not(/x)", "boolean(/a/b)",
+        "/a/b[. = 1 or . = 3]", "/a/b[. > 1 and . < 3]", "$v", "$v + 1",
+        "/a/b[. = $v]", "$x", "current()/a/b", "(/a/b)[2]", "(/a/b)[. > 1]",
+        "('x')['a']", "(1)[false()]", "/a/b[true()][false()]",
+        "local-name(/a/*)", "name(/a/c)", "string(/a/b)", "concat('a', /a/b)",
+        "/a/b[1]/following-sibling::*", "/a/c/b/ancestor::*",
+        "//b[../c]", "//b[count(../b) = 3]", "/a/b[position() = last() - 1]",
+        "//*[local-name() = 'c']/b", "/a/d/e[@f]", "/a/d/e/@f", "/a/d/e[@f = 'g']",
+        "string-length(/a/d/e/@f)", "/a/b[/a/c/b = 4]", "/a/b[2][1]",
+        "sum(/a/b[. mod 2 = 1])", "/a/b div 0", "-(/a/b)", "/a/b[. = 'x']",
+        "unknown()", "/a/b[", "1 div 0 = 1 div 0", "/a/b[. < count(/a/b)]",
+        "count(/a/b[. > 1]) = count(/a/b)", "/a/b[. = $v + count(/a/c)]",
+        "/a/b[position() = count(/a/b[. > $v])]", "/a/b[. < ../c/b]",
+        "//b[../../d/e/@f = 'g']", "//b[count(../b) = 3][1]", "/a/b[../..]",
+        "/a/*/b", "count(/*/*/*)", "/a/*/*[1]", "/a/d/e/@f/..", "a/c/b",
+        "/a/b[. < 3]", "/a/b[2 < .]", "/a/c[b >= 4]", "count(/a/b[. != 2])",
+        "/a/*[b = 4]", "/a/b[. = 2][1]", "/a/b[2]/following::*",
+        "/a/c/b/preceding::*[1]", "/a/b/preceding-sibling::b[last()]",
+        "//b[preceding::b = 1]", "count(//*[following::e])",
+        "/a/*[not(b)]", "/a/*[count(b) = 1]", "boolean(/a/*[1])", "-count(/a/b)",
+        "/a/b[position() mod 2 = 1]", "/a/*[b = 4 or not(b)][last()]", "(/a/b)[1] | /a/c"
+    };
+    const char* documents[] = {
+        R"({"a":{"b":[1,2,3],"c":{"b":4},"d":{"e":{"@f":"g"}}}})",
+        R"({"a":{"b":true,"c":{"b":[true,false]}}})",
+        R"([{"a":{"b":"x"}},{"a":{"b":[]}}])",
+        R"({})"
+    };
+    for (const char* j : documents) {
+        nlohmann::json json = nlohmann::json::parse(j);
+        Document document(json);
+        Env env(document.getRoot());
+        env.addVariable("v", Value(2.0));
+        for (const char* xpath : expressions) {
+            assertSameResult(xpath, env);
+        }
+    }
+    {
+        // predicates in predicates and long boolean chains
+        const char* j = R"({"a":{"b":[{"c":1,"d":2},{"c":2,"d":2},{"c":3}]}})";
+        nlohmann::json json = nlohmann::json::parse(j);
+        Document document(json);
+        Env env(document.getRoot());
+        Expression e("count(/a/b[c = d or not(d)][c > 1])", Expression::Bytecode);
+        assert(e.eval(env).getNumber() == 2);
+        Expression e1("/a/b[d[. = 2]][2]/c", Expression::Bytecode);
+        assert(e1.eval(env).getNumber() == 2);
+        Expression e2("/a/b/c = 1 and /a/b/c = 2 and /a/b/c = 3 and /a/b/c = 4",
+                      Expression::Bytecode);
+        assert(!e2.eval(env).getBoolean());
+    }
+}
+
+// The optimizer must not change results, or errors into results and back.
+void
+testOptimizedResults() {
+    const char* expressions[] = {
+        "/a/*[not(*) and . < 5]", "/a/*[. < 5 and not(*)]", "/a/*[not(*) or . < 5]",
+        "/a/*[*/k = 1 and . > 2]", "/a/*[count(*) = 0 and $v = 1]",
+        "/a/*[string-length(.) > 0 and . >= 3]", "/a/*[. = 3 or */k < 1]",
+        "count(/a/c/d//..)", "count(/a/c/d//.)", "count(//.)", "count(//..)",
+        "count(/a//b)", "count(//*)", "sum(/a/c//*)", "/a/c//b[1]",
+        "/a/b[2]", "/a/b[last()]", "/a/b[. > 1][1]", "count(/a/b[. != 2])",
+        "/a/*/b", "/a/b[. = 1 or . = 3]", "1 + 2 * 3", "not(false()) and 'a' = 'a'",
+        "/a/b[true()][false()]", "//b[../c]", "//b[count(../b) = 3]",
+        "/a/b[/a/c/b = 4]", "/a/b[1]/following-sibling::*", "/a/c/b/ancestor::*",
+        "//descendant::b", "/a//descendant::*", "//*[last()-1]", "count(/a//.//c)",
+        "count(//././/.)", "//descendant-or-self::e", "count(//descendant-or-self::x)",
+        "descendant-or-self::r//descendant-or-self::n", "/a//c[1]//b",
+        "/w[../*>=/self::f//u[3] or ../t or not(x<='1') or . or 1]/y//f",
+        "/w[../t or ../* >= 1]", "/w[1 or ../* >= 1]"
+    };
+    const char* documents[] = {
+        R"({"a":{"x":{"k":1},"y":3}})",
+        R"({"a":{"b":1,"c":{"b":2,"d":{"b":3}}}})",
+        R"({"a":{"b":[1,2,3],"c":{"b":4},"d":{"e":{"@f":"g"}}}})",
+        R"({"a":{"b":{"c":1},"d":{"b":{"c":2}}}})",
+        R"({"m":1,"n":2,"w":{"y":{"f":3},"t":1}})"
+    };
+    auto evaluate = [](const char* xpath, const Env& env, Value& v) {
+        try {
+            v = Expression(xpath).eval(env);
+            return true;
+        } catch (const std::exception&) {
+            return false;
+        }
+    };
+    for (const char* j : documents) {
+        nlohmann::json json = nlohmann::json::parse(j);
+        Document document(json);
+        Env env(document.getRoot());
+        env.addVariable("v", Value(1.0));
+        for (const char* xpath : expressions) {
+            Value optimized;
+            Value parsed;
+            bool optimizedOk = evaluate(xpath, env, optimized);
+            setOptimizerEnabled(false);
+            bool parsedOk = evaluate(xpath, env, parsed);
+            setOptimizerEnabled(true);
+            assert(optimizedOk == parsedOk);
+            if (optimizedOk) {
+                assertSameValue(parsed, optimized);
+            }
+        }
+    }
+    nlohmann::json json = nlohmann::json::parse(documents[0]);
+    Document document(json);
+    Value r(eval("count(/a/*[not(*) and . < 5])", document));
+    assert(r.getNumber() == 1);
+}
+
+void
+testSerialization() {
+    const char* j = R"({"a":{"b":[1,2,3],"c":{"b":4}}})";
+    nlohmann::json json = nlohmann::json::parse(j);
+    Document document(json);
+    Env env(document.getRoot());
+    Expression e("count(/a/b[. > 1][last()]) + sum(/a/c/b) - string-length(concat('ab', /a/b[2]))");
+    std::string blob = e.serialize();
+    assert(blob.compare(0, 4, "NLJX") == 0);
+    assert(Expression::deserialize(blob)->eval(env).getNumber() == 2);
+    // the blob must not be read by another version of the format or if it is damaged
+    auto throws = [](const std::string& b, const std::string& message) {
+        try {
+            Expression::deserialize(b);
+        } catch (const std::runtime_error& ex) {
+            return std::string(ex.what()).find(message) != std::string::npos;
+        }
+        return false;
+    };
+    std::string other(blob);
+    other[4] = 2;
+    assert(throws(other, "unsupported format version 2, expected 1"));
+    assert(throws("", "not a serialized expression"));
+    assert(throws("count(/a/b)", "not a serialized expression"));
+    for (size_t size = 4; size < blob.size(); size++) {
+        assert(throws(blob.substr(0, size), "deserialize"));
+    }
+    assert(throws(blob + '\0', "trailing bytes"));
+    other = blob;
+    other[5] = 127;
+    assert(throws(other, "invalid tag"));
+    // Cached (tag 41) of the number 1 (tag 23) with a slot that is not used by the
+    // optimizer or does not fit into the size
+    std::string number("\x17\x00\x00\x00\x00\x00\x00\x00\xf0\x3f\x00", 11);
+    std::string cached = std::string("NLJX\x01\x29\x01", 7) + number;
+    assert(Expression::deserialize(cached + '\0' + '\0')->eval(env).getNumber() == 1);
+    assert(throws(cached + '\x01' + '\0', "invalid cache slot"));
+    assert(throws(cached + "\xff\xff\xff\xff\x0f" + '\0', "invalid cache slot"));
+    assert(throws(cached + "\xff\xff\xff\xff\xff\xff\xff\xff\xff\x01" + '\0', "invalid cache slot"));
+    assert(throws(cached + "\xff\xff\xff\xff\xff\xff\xff\xff\xff\x02" + '\0', "invalid size"));
+    assert(throws(cached + "\x80\x80\x80\x80\x80\x80\x80\x80\x80\x80\x01" + '\0', "invalid size"));
+}
+
+void
+testParallel() {
+    // <a><b><c>0</c><d><c>0</c></d><e>x0</e></b>...<f><b>...</b></f></a>
+    nlohmann::json json;
+    for (int i = 0; i < 3000; i++) {
+        nlohmann::json b = {{"c", i % 7}, {"d", {{"c", i % 5}}}, {"e", "x" + std::to_string(i)}};
+        json["a"]["b"].push_back(b);
+        if (i % 3 == 0) {
+            json["a"]["f"].push_back({{"b", b}, {"g", {1, 2, 3}}});
+        }
+    }
+    Document document(json);
+    Env sequential(document.getRoot());
+    sequential.addVariable("v", Value(3.0));
+    const char* expressions[] = {
+        "//b", "//c", "count(//c)", "//*", "//d/c", "/a/b/*", "/a/*/*", "//b/..",
+        "/a/b[c > 2]", "/a/b[c > 2 and d/c < 3]", "/a/b[contains(e, '7')]",
+        "/a/b[count(.//c) = 2][d/c = 1]", "/a/b[string-length(e) = 3]",
+        "/a/b[d[c = 4]]", "/a/b[c = $v]", "/a/b[c = ../b[1]/c]",
+        "/a/b[position() mod 100 = 0]", "/a/b[last() - position() < 5]",
+        "/a/b[c + 1]", "/a/*[b/c = 1]", "//b[d/c = 2][e != 'x1']",
+        "/a/b[c = current()/a/b[2]/c]", "sum(/a/b[d/c > 2]/c)",
+        "/a/b[d < 1]", "/a/b[sum(d/c) > 3] | /a/f[g = 2]"
+    };
+    for (size_t threads : {2, 4, 8}) {
+        Env parallel(document.getRoot());
+        parallel.addVariable("v", Value(3.0));
+        parallel.setParallelism(threads, 16);
+        assert(parallel.getThreads() == threads && parallel.getParallelThreshold() == 16);
+        for (const char* xpath : expressions) {
+            for (Expression::Backend backend : {Expression::Tree, Expression::Bytecode}) {
+                Expression e(xpath, backend);
+                std::string expected;
+                std::string actual;
+                try {
+                    Value r = e.eval(sequential);
+                    expected = r.getType() == Value::NodeSet ? std::to_string(r.getNodeSet().size()) : "";
+                    expected += r.getStringValue();
+                    if (r.getType() == Value::NodeSet) {
+                        assert(e.eval(parallel).getNodeSet() == r.getNodeSet());
+                    }
+                } catch (const std::runtime_error& ex) {
+                    expected = ex.what();
+                }
+                try {
+                    Value r = e.eval(parallel);
+                    actual = r.getType() == Value::NodeSet ? std::to_string(r.getNodeSet().size()) : "";
+                    actual += r.getStringValue();
+                } catch (const std::runtime_error& ex) {
+                    actual = ex.what();
+                }
+                assert(actual == expected);
+            }
+        }
+    }
+    {
+        // the nodes are created by several threads
+        Document fresh(json);
+        Env env(fresh.getRoot());
+        env.setParallelism(4, 16);
+        Value r = Expression("/a/b[count(.//c) = 2][contains(e, '9')]").eval(env);
+        Document other(json);
+        assert(r.getNodeSet().size() == eval("/a/b[count(.//c) = 2][contains(e, '9')]", other).getNodeSet().size());
+        Document fresh1(json);
+        Env env1(fresh1.getRoot());
+        env1.setParallelism(4, 16);
+        assert(Expression("//c").eval(env1).getNodeSet().size() == 8000);
+        bool thrown(false);
+        try {
+            env1.setParallelism(0);
+        } catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+}
+
+void
+testBudget() {
+    nlohmann::json json;
+    nlohmann::json large;
+    for (int i = 0; i < 2000; i++) {
+        nlohmann::json b = {{"c", i % 7}, {"d", {{"c", i % 5}}}};
+        if (i < 200) {
+            json["a"]["b"].push_back(b);
+        }
+        large["a"]["b"].push_back(b);
+    }
+    Document document(json);
+    Document largeDocument(large);
+    // The limit an evaluation exceeds, -1 if it does not exceed any.
+    auto exceeded = [](const Expression& e, const Env& env) {
+        try {
+            e.eval(env);
+        } catch (const BudgetExceeded& ex) {
+            return static_cast<int>(ex.getLimit());
+        }
+        return -1;
+    };
+    for (Expression::Backend backend : {Expression::Tree, Expression::Bytecode}) {
+        Env env(document.getRoot());
+        assert(env.getMaxNodes() == 0 && env.getMaxNodeSetSize() == 0 && env.getTimeout().count() == 0);
+        // compares each node with its siblings
+        Expression expensive("//*[. = ../*]", backend);
+        Expression count("count(/a/b)", backend);
+        Expression path("/a/b/d/c", backend);
+        assert(exceeded(expensive, env) == -1);
+        env.setBudget(10000);
+        assert(env.getMaxNodes() == 10000);
+        assert(exceeded(expensive, env) == BudgetExceeded::Nodes);
+        // each evaluation has a budget of its own
+        assert(count.eval(env).getNumber() == 200);
+        assert(count.eval(env).getNumber() == 200);
+        assert(path.eval(env).getNodeSet().size() == 200);
+        env.setBudget(0, 100);
+        assert(exceeded(path, env) == BudgetExceeded::NodeSetSize);
+        assert(exceeded(count, env) == BudgetExceeded::NodeSetSize);
+        assert(Expression("/a/b[1]/d/c", backend).eval(env).getNodeSet().size() == 1);
+        Env largeEnv(largeDocument.getRoot());
+        largeEnv.setBudget(0, 0, std::chrono::milliseconds(1));
+        assert(largeEnv.getTimeout() == std::chrono::milliseconds(1));
+        assert(exceeded(expensive, largeEnv) == BudgetExceeded::Time);
+        largeEnv.setBudget(0, 0, std::chrono::milliseconds(60000));
+        assert(path.eval(largeEnv).getNodeSet().size() == 2000);
+        env.setBudget(0);
+        assert(exceeded(expensive, env) == -1);
+        // variables bound without the environment
+        Expression bound("/a/b[c = $v]/d/c", backend);
+        Bindings bindings(bound);
+        bindings.bind(bound.getSlot("v"), Value(3.0));
+        env.setBudget(1000);
+        assert(bound.eval(env, bindings).getNodeSet().size() == 29);
+        env.setBudget(100);
+        bool thrown(false);
+        try {
+            bound.eval(env, bindings);
+        } catch (const std::runtime_error& ex) {
+            thrown = dynamic_cast<const BudgetExceeded*>(&ex) != nullptr;
+        }
+        assert(thrown);
+        // threads that help an evaluation share its budget
+        Env parallel(document.getRoot());
+        parallel.setParallelism(4, 16);
+        parallel.setBudget(10000);
+        assert(exceeded(expensive, parallel) == BudgetExceeded::Nodes);
+        assert(exceeded(Expression("/a/b[count(.//c) = 2]", backend), parallel) == -1);
+        parallel.setBudget(300);
+        assert(exceeded(Expression("/a/b[count(.//c) = 2]", backend), parallel) == BudgetExceeded::Nodes);
+    }
+}
+
+void
+testEvaluation() {
+    nlohmann::json json;
+    for (int i = 0; i < 3000; i++) {
+        json["a"]["b"].push_back({{"c", i % 7}, {"d", {{"c", i % 5}}}});
+    }
+    Document document(json);
+    Env env(document.getRoot());
+    env.addVariable("v", Value(3.0));
+    for (Expression::Backend backend : {Expression::Tree, Expression::Bytecode}) {
+        const char* expressions[] = {
+            "//c", "count(//c)", "/a/b[c = $v]/d", "sum(//d/c)", "/a/b[c > /a/b[2]/c][d/c = 1]", "//*[. = ../*]"
+        };
+        for (const char* xpath : expressions) {
+            Expression e(xpath, backend);
+            Value expected = e.eval(env);
+            Evaluation evaluation(e, env, 256);
+            assert(!evaluation.isDone());
+            size_t slices = 1;
+            for (; !evaluation.resume(); slices++) {
+                // other evaluations may run on the thread between the slices
+                assert(Expression("count(/a/b[c = 1])").eval(env).getNumber() == 429);
+            }
+            assert(evaluation.isDone() && !evaluation.isCancelled());
+            assert(slices > 1);
+            assert(evaluation.getResult() == expected);
+            if (expected.getType() == Value::NodeSet) {
+                assert(evaluation.getResult().getNodeSet() == expected.getNodeSet());
+            }
+        }
+        // interleaved evaluations
+        Expression descendants("//c", backend);
+        Expression filter("/a/b[c = $v]/d/c", backend);
+        Evaluation first(descendants, env, 100);
+        Evaluation second(filter, env, 1000);
+        bool firstDone(false);
+        bool secondDone(false);
+        while (!firstDone || !secondDone) {
+            firstDone = first.resume();
+            secondDone = second.resume();
+        }
+        assert(first.getResult().getNodeSet().size() == 6000);
+        assert(second.getResult().getNodeSet().size() == 429);
+        // bindings
+        Bindings bindings(filter);
+        bindings.bind(filter.getSlot("v"), Value(1.0));
+        Evaluation bound(filter, env, bindings, 64);
+        while (!bound.resume()) {
+        }
+        assert(bound.getResult().getNodeSet().size() == 429);
+        // cancel between slices
+        Evaluation cancelled(descendants, env, 100);
+        assert(!cancelled.resume());
+        bool thrown(false);
+        try {
+            cancelled.getResult();
+        } catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+        cancelled.cancel();
+        assert(cancelled.isDone() && cancelled.isCancelled() && cancelled.resume());
+        thrown = false;
+        try {
+            cancelled.getResult();
+        } catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+        {
+            // destroyed before it is done
+            Evaluation abandoned(descendants, env, 100);
+            abandoned.resume();
+            Evaluation unstarted(descendants, env, 100);
+        }
+        assert(descendants.eval(env).getNodeSet().size() == 6000);
+        // errors end the evaluation
+        Expression unknown("/a/b[c = $unknown]", backend);
+        Evaluation failed(unknown, env, 100);
+        while (!failed.resume()) {
+        }
+        thrown = false;
+        try {
+            failed.getResult();
+        } catch (const std::runtime_error& ex) {
+            thrown = std::string(ex.what()).find("unknown") != std::string::npos;
+        }
+        assert(thrown);
+        // the budget of the environment applies to the whole evaluation
+        Env limited(document.getRoot());
+        limited.setBudget(5000);
+        Evaluation exceeded(descendants, limited, 100);
+        size_t slices = 1;
+        for (; !exceeded.resume(); slices++) {
+        }
+        assert(slices > 1);
+        int limit = -1;
+        try {
+            exceeded.getResult();
+        } catch (const BudgetExceeded& ex) {
+            limit = ex.getLimit();
+        }
+        assert(limit == BudgetExceeded::Nodes);
+    }
+    bool thrown(false);
+    try {
+        Expression e("/a");
+        Evaluation evaluation(e, env, 0);
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    assert(thrown);
+    {
+        // documents nested deeper than a small stack allows
+        nlohmann::json deep = 1;
+        for (int i = 0; i < 20000; i++) {
+            nlohmann::json parent;
+            parent["a"] = std::move(deep);
+            deep = std::move(parent);
+        }
+        Document deepDocument(deep);
+        Env deepEnv(deepDocument.getRoot());
+        for (const char* xpath : {"count(//a)", "count(//a[not(a)])", "count(//*[. = 1])"}) {
+            Expression e(xpath);
+            Evaluation evaluation(e, deepEnv, 1000);
+            while (!evaluation.resume()) {
+            }
+            assert(evaluation.getResult() == e.eval(deepEnv));
+        }
+    }
+}
+
+namespace {
+
+// A static expression must give the same result as the parsed expression.
+template <class E>
+void
+assertSameAsParsed(const E& e, const char* xpath, const Env& env) {
+    assert(Static::isSupported(xpath));
+    Value expected = Expression(xpath).eval(env);
+    Value r = e.eval(env);
+    assert(r.getType() == expected.getType());
+    if (r.getType() == Value::NodeSet) {
+        assert(r.getNodeSet() == expected.getNodeSet());
+    } else {
+        assert(r.getStringValue() == expected.getStringValue());
+    }
+}
+
+}
+
+#define ASSERT_STATIC(xpath, env) assertSameAsParsed(JSTR_XPATH(xpath), xpath, env)
+
+void
+testStaticExpressions() {
+    {
+        // <a><b>1</b><b>2</b><b>3</b><c><b>4</b><d>x</d></c><e><f>1</f></e><e><f>2</f></e></a>
+        const char* j = R"({"a":{"b":[1,2,3],"c":{"b":4,"d":"x"},"e":[{"f":1},{"f":2}]}})";
+        nlohmann::json json = nlohmann::json::parse(j);
+        Document document(json);
+        Env env(document.getRoot());
+        Value r = JSTR_XPATH("/a/b[2]").eval(env);
+        assert(r.getNodeSet().size() == 1);
+        assert(r == 2.0);
+        r = JSTR_XPATH("count(//b)").eval(env);
+        assert(r.getNumber() == 4);
+        r = JSTR_XPATH("/a/e[f > 1]/f = 2").eval(env);
+        assert(r.getType() == Value::Bool && r.getBoolean());
+        ASSERT_STATIC("/", env);
+        ASSERT_STATIC("/a", env);
+        ASSERT_STATIC("a/b", env);
+        ASSERT_STATIC("/a/*", env);
+        ASSERT_STATIC("//b", env);
+        ASSERT_STATIC("//*", env);
+        ASSERT_STATIC("/a//b", env);
+        ASSERT_STATIC("//b/..", env);
+        ASSERT_STATIC("/a/./b", env);
+        ASSERT_STATIC("/a/b[1]", env);
+        ASSERT_STATIC("/a/b[4]", env);
+        ASSERT_STATIC("/a/b[last()]", env);
+        ASSERT_STATIC("//b[2]", env);
+        ASSERT_STATIC("/a/b[. > 1]", env);
+        ASSERT_STATIC("/a/b[. != 2][2]", env);
+        ASSERT_STATIC("/a/c[d = 'x']/b", env);
+        ASSERT_STATIC("/a/c[d != \"x\"]", env);
+        ASSERT_STATIC("/a/e[f]", env);
+        ASSERT_STATIC("/a/e[g]", env);
+        ASSERT_STATIC("/a/e[count(f) = 1]", env);
+        ASSERT_STATIC("/a/b[count(/a/e)]", env);
+        ASSERT_STATIC("/a/e[f >= 1.5]/f", env);
+        ASSERT_STATIC("/a/e[f < 2][f <= 1]", env);
+        ASSERT_STATIC("/a/b = 3", env);
+        ASSERT_STATIC("/a/b != 3", env);
+        ASSERT_STATIC("/a/b < 1", env);
+        ASSERT_STATIC("/a/b = 'x'", env);
+        ASSERT_STATIC("//d = 'x'", env);
+        ASSERT_STATIC("count(/a/*)", env);
+        ASSERT_STATIC("count( /a/b ) > 2", env);
+        ASSERT_STATIC("/a/x", env);
+        assert(!Static::isSupported(""));
+        assert(!Static::isSupported("1 + 2"));
+        assert(!Static::isSupported("/a/b[1 = 1]"));
+        assert(!Static::isSupported("/a/b < 'x'"));
+        assert(!Static::isSupported("count(/a) = 'x'"));
+        assert(!Static::isSupported("//."));
+        assert(!Static::isSupported("/a/b["));
+        assert(!Static::isSupported("/a and /b"));
+        assert(!Static::isSupported("sum(/a/b)"));
+        assert(!Static::isSupported("-1"));
+        assert(!Static::isSupported("-/a"));
+        // nested predicates follow the same grammar
+        assert(Static::isSupported(" /a/e[f[. = 'x']][count(f) > 1] "));
+        assert(!Static::isSupported("/a/e[count(f) = 'x']"));
+        assert(!Static::isSupported("/a/e[f[.]"));
+    }
+    {
+        // primitive contexts
+        Env env(Value(3.0));
+        ASSERT_STATIC(". < 10", env);
+        ASSERT_STATIC(". = 3", env);
+    }
+    {
+        // JSON true equals 1, objects can not be ordered
+        const char* j = R"({"a":{"b":[true,false],"c":{"d":1}}})";
+        nlohmann::json json = nlohmann::json::parse(j);
+        Document document(json);
+        Env env(document.getRoot());
+        ASSERT_STATIC("/a/b = 1", env);
+        ASSERT_STATIC("/a/b[. = 0]", env);
+        ASSERT_STATIC("/a/b > 0", env);
+        bool thrown(false);
+        try {
+            JSTR_XPATH("/a/c > 0").eval(env);
+        } catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
 }
 
 int
@@ -1232,5 +2564,13 @@ main (int argc, char *argv[])
     testStringFunctions();
     testStringValue();
     testEnv();
+    testOptimizer();
+    testBytecode();
+    testOptimizedResults();
+    testSerialization();
+    testParallel();
+    testBudget();
+    testEvaluation();
+    testStaticExpressions();
     return 0;
 }
@@ -0,0 +1,68 @@
+// MIT license
+//
+// Copyright 2023 Per Nilsson
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the “Software”), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+
+#include <cassert>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <Jstr.hh>
+
+// Generated by jxpc from schematron-jxpc.json.
+bool
+validate(const nlohmann::json& data, std::ostream& out);
+
+namespace {
+
+// The generated validator must give the same result as the interpreter.
+void
+assertSameAsInterpreter(const nlohmann::json& schematron, const char* data) {
+    nlohmann::json json = nlohmann::json::parse(data);
+    std::stringstream expected;
+    std::stringstream out;
+    bool result = Jstr::Schematron::eval(schematron, json, expected);
+    assert(validate(json, out) == result);
+    assert(out.str() == expected.str());
+}
+
+}
+
+int
+main (int argc, char *argv[])
+{
+    std::ifstream ifs(argc > 1 ? argv[1] : "schematron-jxpc.json");
+    assert(ifs.good());
+    nlohmann::json schematron = nlohmann::json::parse(ifs);
+    {
+        std::stringstream out;
+        assert(validate(nlohmann::json::parse(R"({"a":{"b":[1,2,3]}})"), out));
+        assert(out.str().empty());
+    }
+    assertSameAsInterpreter(schematron, R"({"a":{"b":[1,2,3]}})");
+    assertSameAsInterpreter(schematron, R"({"a":{"b":[1,2,2,0]}})");
+    assertSameAsInterpreter(schematron, R"({"a":{"b":[1,2],"c":{"d":"x"}}})");
+    assertSameAsInterpreter(schematron, R"({"a":{"b":[1,2,3,4],"c":{"d":"x"}}})");
+    assertSameAsInterpreter(schematron, R"({"a":{"b":[1,2,3,4,5,6,7,8,9,10]}})");
+    assertSameAsInterpreter(schematron, R"({"a":[{"b":1},{"b":2}]})");
+    assertSameAsInterpreter(schematron, R"({"x":1})");
+    return 0;
+}